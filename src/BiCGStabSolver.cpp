@@ -0,0 +1,89 @@
+#include "BiCGStabSolver.hpp"
+#include <glm/glm.hpp>
+
+namespace RadiosityTest
+{
+
+static glm::vec3 channelDot(const RadianceBuffer &a, const RadianceBuffer &b)
+{
+    double red = 0.0, green = 0.0, blue = 0.0;
+    for(size_t i = 0; i < a.size(); ++i)
+    {
+        red += double(a.red[i])*b.red[i];
+        green += double(a.green[i])*b.green[i];
+        blue += double(a.blue[i])*b.blue[i];
+    }
+
+    return glm::vec3(red, green, blue);
+}
+
+// A division that returns zero on the channels where the method broke down.
+static glm::vec3 safeDivide(const glm::vec3 &a, const glm::vec3 &b)
+{
+    glm::vec3 result;
+    for(int i = 0; i < 3; ++i)
+        result[i] = fabsf(b[i]) > 1e-30f ? a[i] / b[i] : 0.0f;
+    return result;
+}
+
+// result = a + scale*b
+static void scaleAndAdd(RadianceBuffer &result, const RadianceBuffer &a, const glm::vec3 &scale, const RadianceBuffer &b)
+{
+    result.resize(a.size());
+    for(size_t i = 0; i < a.size(); ++i)
+    {
+        result.red[i] = a.red[i] + scale.r*b.red[i];
+        result.green[i] = a.green[i] + scale.g*b.green[i];
+        result.blue[i] = a.blue[i] + scale.b*b.blue[i];
+    }
+}
+
+BiCGStabSolver::BiCGStabSolver()
+{
+}
+
+BiCGStabSolver::~BiCGStabSolver()
+{
+}
+
+void BiCGStabSolver::restart(const Operator &A, const RadianceBuffer &b, const RadianceBuffer &x)
+{
+    // r = b - A x
+    A(x, v);
+    scaleAndAdd(r, b, glm::vec3(-1.0f), v);
+
+    rHat = r;
+    p.resize(r.size());
+    p.clear();
+    v.clear();
+    rho = alpha = omega = glm::vec3(1.0f);
+}
+
+void BiCGStabSolver::iterate(const Operator &A, RadianceBuffer &x)
+{
+    auto newRho = channelDot(rHat, r);
+    auto beta = safeDivide(newRho, rho)*safeDivide(alpha, omega);
+    rho = newRho;
+
+    // p = r + beta*(p - omega*v)
+    scaleAndAdd(p, p, -omega, v);
+    scaleAndAdd(p, r, beta, p);
+
+    A(p, v);
+    alpha = safeDivide(rho, channelDot(rHat, v));
+
+    // s = r - alpha*v
+    scaleAndAdd(s, r, -alpha, v);
+
+    A(s, t);
+    omega = safeDivide(channelDot(t, s), channelDot(t, t));
+
+    // x = x + alpha*p + omega*s
+    scaleAndAdd(x, x, alpha, p);
+    scaleAndAdd(x, x, omega, s);
+
+    // r = s - omega*t
+    scaleAndAdd(r, s, -omega, t);
+}
+
+} // End of namespace RadiosityTest
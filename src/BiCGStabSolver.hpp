@@ -0,0 +1,43 @@
+#ifndef RADIOSITY_TEST_BICGSTAB_SOLVER_HPP
+#define RADIOSITY_TEST_BICGSTAB_SOLVER_HPP
+
+#include "RadianceBuffer.hpp"
+#include <functional>
+
+namespace RadiosityTest
+{
+
+/**
+ * Biconjugate gradient stabilized (BiCGSTAB) solver for A x = b. The three
+ * color channels are solved as independent systems at the same time, so
+ * every scalar of the method is a vec3.
+ */
+class BiCGStabSolver
+{
+public:
+    typedef std::function<void (const RadianceBuffer &x, RadianceBuffer &result)> Operator;
+
+    BiCGStabSolver();
+    ~BiCGStabSolver();
+
+    // Starts a new solve from the current value of x.
+    void restart(const Operator &A, const RadianceBuffer &b, const RadianceBuffer &x);
+
+    // Performs a single iteration, which applies the operator twice.
+    void iterate(const Operator &A, RadianceBuffer &x);
+
+private:
+    RadianceBuffer r;
+    RadianceBuffer rHat;
+    RadianceBuffer p;
+    RadianceBuffer v;
+    RadianceBuffer s;
+    RadianceBuffer t;
+    glm::vec3 rho;
+    glm::vec3 alpha;
+    glm::vec3 omega;
+};
+
+} // End of namespace RadiosityTest
+
+#endif //RADIOSITY_TEST_BICGSTAB_SOLVER_HPP
@@ -16,6 +16,11 @@ public:
     Box2(float minX, float minY, float maxX, float maxY)
         : min(minX, minY), max(maxX, maxY) {}
 
+    bool isEmpty() const
+    {
+        return min.x > max.x || min.y > max.y;
+    }
+
     void insertPoint(const glm::vec2 &point)
     {
         min.x = std::min(min.x, point.x);
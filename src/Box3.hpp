@@ -0,0 +1,73 @@
+#ifndef RADIOSITY_TEST_BOX3_HPP
+#define RADIOSITY_TEST_BOX3_HPP
+
+#include <glm/vec3.hpp>
+#include <algorithm>
+#include <math.h>
+
+namespace RadiosityTest
+{
+
+class Box3
+{
+public:
+    Box3()
+        : min(INFINITY, INFINITY, INFINITY), max(-INFINITY, -INFINITY, -INFINITY) {}
+    Box3(const glm::vec3 &min, const glm::vec3 &max)
+        : min(min), max(max) {}
+
+    bool isEmpty() const
+    {
+        return min.x > max.x || min.y > max.y || min.z > max.z;
+    }
+
+    void insertPoint(const glm::vec3 &point)
+    {
+        min.x = std::min(min.x, point.x);
+        min.y = std::min(min.y, point.y);
+        min.z = std::min(min.z, point.z);
+        max.x = std::max(max.x, point.x);
+        max.y = std::max(max.y, point.y);
+        max.z = std::max(max.z, point.z);
+    }
+
+    void insertBox(const Box3 &box)
+    {
+        min.x = std::min(min.x, box.min.x);
+        min.y = std::min(min.y, box.min.y);
+        min.z = std::min(min.z, box.min.z);
+        max.x = std::max(max.x, box.max.x);
+        max.y = std::max(max.y, box.max.y);
+        max.z = std::max(max.z, box.max.z);
+    }
+
+    glm::vec3 center() const
+    {
+        return (min + max)*0.5f;
+    }
+
+    glm::vec3 extent() const
+    {
+        return max - min;
+    }
+
+    glm::vec3 corner(int index) const
+    {
+        return glm::vec3(
+            (index & 1) ? max.x : min.x,
+            (index & 2) ? max.y : min.y,
+            (index & 4) ? max.z : min.z);
+    }
+
+    float surfaceArea() const
+    {
+        auto ex = extent();
+        return 2.0f*(ex.x*ex.y + ex.y*ex.z + ex.z*ex.x);
+    }
+
+    glm::vec3 min, max;
+};
+
+} // End of namespace RadiosityTest
+
+#endif //RADIOSITY_TEST_BOX3_HPP
@@ -1,6 +1,8 @@
 #ifndef RADIOSITY_TEST_FLOAT_HPP
 #define RADIOSITY_TEST_FLOAT_HPP
 
+#include <glm/vec3.hpp>
+
 namespace RadiosityTest
 {
 static constexpr auto FloatEpsilon = 0.0001f;
@@ -11,6 +13,11 @@ inline bool closeTo(float a, float b)
     return -FloatEpsilon <= delta && delta <= FloatEpsilon;
 }
 
+inline bool closeTo(const glm::vec3 &a, const glm::vec3 &b)
+{
+    return closeTo(a.x, b.x) && closeTo(a.y, b.y) && closeTo(a.z, b.z);
+}
+
 } // End of namespace RadiosityTest
 
 #endif //RADIOSITY_TEST_FLOAT_HPP
@@ -0,0 +1,342 @@
+#include "FormFactorCache.hpp"
+#include "Lightmap.hpp"
+#include "SceneOcclusion.hpp"
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include "File.hpp"
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace RadiosityTest
+{
+
+static constexpr uint64_t FnvOffsetBasis = 14695981039346656037ull;
+static constexpr uint64_t FnvPrime = 1099511628211ull;
+
+/**
+ * FNV-1a over the bytes, for the small cache keys.
+ */
+class KeyHasher
+{
+public:
+    KeyHasher()
+        : value(FnvOffsetBasis) {}
+
+    void addBytes(const void *data, size_t size)
+    {
+        auto bytes = reinterpret_cast<const uint8_t*> (data);
+        for(size_t i = 0; i < size; ++i)
+            value = (value ^ bytes[i])*FnvPrime;
+    }
+
+    void add(uint64_t x)
+    {
+        addBytes(&x, sizeof(x));
+    }
+
+    void add(float x)
+    {
+        addBytes(&x, sizeof(x));
+    }
+
+    void add(const glm::vec2 &v)
+    {
+        add(v.x); add(v.y);
+    }
+
+    void add(const glm::vec3 &v)
+    {
+        add(v.x); add(v.y); add(v.z);
+    }
+
+    uint64_t value;
+};
+
+// FNV-1a over 64 bit words, which is fast enough for the large payloads.
+static uint64_t computeChecksum(const void *data, size_t size)
+{
+    auto bytes = reinterpret_cast<const uint8_t*> (data);
+    uint64_t hash = FnvOffsetBasis;
+    size_t i = 0;
+    for(; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        hash = (hash ^ word)*FnvPrime;
+        hash ^= hash >> 29;
+    }
+
+    for(; i < size; ++i)
+        hash = (hash ^ bytes[i])*FnvPrime;
+    return hash;
+}
+
+static uint64_t combineChecksums(uint64_t rowOffsets, uint64_t columns, uint64_t values)
+{
+    uint64_t checksums[] = {rowOffsets, columns, values};
+    return computeChecksum(checksums, sizeof(checksums));
+}
+
+/**
+ * A read only view of a whole file, mapped in memory when possible.
+ */
+class MappedFile
+{
+public:
+    MappedFile()
+        : data(nullptr), size(0) {}
+
+    ~MappedFile()
+    {
+#ifndef _WIN32
+        if(data)
+            munmap(const_cast<uint8_t*> (data), size);
+#endif
+    }
+
+    bool open(const std::string &fileName)
+    {
+#ifdef _WIN32
+        content = readWholeFile(fileName);
+        data = content.empty() ? nullptr : &content[0];
+        size = content.size();
+        return data != nullptr;
+#else
+        auto fd = ::open(fileName.c_str(), O_RDONLY);
+        if(fd < 0)
+            return false;
+
+        struct stat fileStat;
+        if(fstat(fd, &fileStat) < 0 || fileStat.st_size == 0)
+        {
+            close(fd);
+            return false;
+        }
+
+        auto mapping = mmap(nullptr, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(mapping == MAP_FAILED)
+            return false;
+
+        data = reinterpret_cast<const uint8_t*> (mapping);
+        size = fileStat.st_size;
+        return true;
+#endif
+    }
+
+    const uint8_t *data;
+    size_t size;
+
+private:
+#ifdef _WIN32
+    std::vector<uint8_t> content;
+#endif
+};
+
+FormFactorCache::FormFactorCache(const std::string &directory)
+    : directory(directory)
+{
+}
+
+FormFactorCache::~FormFactorCache()
+{
+}
+
+uint64_t FormFactorCache::computeKey(const Lightmap &lightmap)
+{
+    KeyHasher hasher;
+    hasher.add(uint64_t(Version));
+    hasher.add(lightmap.texelScale);
+    hasher.add(uint64_t(lightmap.getFormFactorMethod()));
+    if(lightmap.getFormFactorMethod() == FormFactorMethod::Hemicube)
+        hasher.add(uint64_t(lightmap.getHemicubeResolution()));
+    else if(lightmap.getFormFactorMethod() == FormFactorMethod::MonteCarlo)
+        hasher.add(uint64_t(lightmap.getFormFactorSampleBudget()));
+    else
+        hasher.add(uint64_t(lightmap.getSurfaceVisibilityClassification()));
+    hasher.add(lightmap.getFormFactorEpsilon());
+
+    hasher.add(uint64_t(lightmap.quadSurfaces.size()));
+    for(auto &quad : lightmap.quadSurfaces)
+    {
+        for(auto &vertex : quad.vertices)
+            hasher.add(vertex);
+        hasher.add(quad.normal);
+        hasher.add(quad.tangent);
+        hasher.add(quad.bitangent);
+        hasher.add(quad.distance);
+    }
+
+    // The patches also depend on the packing and on the patch order.
+    hasher.add(uint64_t(lightmap.patches.size()));
+    for(auto &patch : lightmap.patches)
+    {
+        hasher.add(patch.position);
+        hasher.add(patch.normal);
+        hasher.add(uint64_t(patch.surfaceIndex));
+    }
+
+    // The other instances of the scene occlusion, relative to this one.
+    auto &sceneOcclusion = lightmap.getSceneOcclusion();
+    if(sceneOcclusion)
+    {
+        auto &self = sceneOcclusion->getInstance(lightmap.getSceneInstance());
+        hasher.add(uint64_t(sceneOcclusion->getInstanceCount()));
+        for(size_t i = 0; i < sceneOcclusion->getInstanceCount(); ++i)
+        {
+            if(i == lightmap.getSceneInstance())
+                continue;
+
+            auto &instance = sceneOcclusion->getInstance(i);
+            auto relativeTransform = self.inverseTransform*instance.transform;
+            for(int column = 0; column < 4; ++column)
+                hasher.add(glm::vec3(relativeTransform[column]));
+
+            hasher.add(uint64_t(instance.lightmap->quadSurfaces.size()));
+            for(auto &quad : instance.lightmap->quadSurfaces)
+            {
+                for(auto &vertex : quad.vertices)
+                    hasher.add(vertex);
+            }
+        }
+    }
+
+    return hasher.value;
+}
+
+std::string FormFactorCache::getFileName(uint64_t key) const
+{
+    char name[64];
+    snprintf(name, sizeof(name), "formFactors-%016llx.bin", (unsigned long long)key);
+    if(directory.empty())
+        return name;
+    return directory + "/" + name;
+}
+
+bool FormFactorCache::load(uint64_t key, float texelScale, size_t patchCount, SparseMatrix &result) const
+{
+    auto fileName = getFileName(key);
+    MappedFile file;
+    if(!file.open(fileName))
+        return false;
+
+    // Validate the header.
+    FormFactorCacheHeader header;
+    if(file.size < sizeof(header))
+    {
+        printf("Form factor cache '%s' is truncated\n", fileName.c_str());
+        return false;
+    }
+
+    memcpy(&header, file.data, sizeof(header));
+    if(header.magic != Magic || header.version != Version)
+    {
+        printf("Form factor cache '%s' is from another version\n", fileName.c_str());
+        return false;
+    }
+
+    if(header.key != key || header.texelScale != texelScale || header.rowCount != patchCount)
+    {
+        printf("Form factor cache '%s' is stale\n", fileName.c_str());
+        return false;
+    }
+
+    auto rowOffsetsSize = (header.rowCount + 1)*sizeof(uint64_t);
+    auto columnsSize = header.nonZeroCount*sizeof(uint32_t);
+    auto valuesSize = header.nonZeroCount*sizeof(float);
+    if(file.size != sizeof(header) + rowOffsetsSize + columnsSize + valuesSize)
+    {
+        printf("Form factor cache '%s' has a wrong size\n", fileName.c_str());
+        return false;
+    }
+
+    auto rowOffsetsData = file.data + sizeof(header);
+    auto columnsData = rowOffsetsData + rowOffsetsSize;
+    auto valuesData = columnsData + columnsSize;
+    auto checksum = combineChecksums(computeChecksum(rowOffsetsData, rowOffsetsSize),
+        computeChecksum(columnsData, columnsSize), computeChecksum(valuesData, valuesSize));
+    if(checksum != header.payloadChecksum)
+    {
+        printf("Form factor cache '%s' is corrupt\n", fileName.c_str());
+        return false;
+    }
+
+    // The matrix is only replaced once the file is known to be good.
+    std::vector<uint64_t> rowOffsets(header.rowCount + 1);
+    memcpy(&rowOffsets[0], rowOffsetsData, rowOffsetsSize);
+    if(rowOffsets[0] != 0 || rowOffsets.back() != header.nonZeroCount)
+    {
+        printf("Form factor cache '%s' has invalid rows\n", fileName.c_str());
+        return false;
+    }
+
+    result.resize(header.rowCount, header.rowCount, header.nonZeroCount);
+    std::copy(rowOffsets.begin(), rowOffsets.end(), result.rowOffsets.begin());
+    if(header.nonZeroCount)
+    {
+        memcpy(&result.columns[0], columnsData, columnsSize);
+        memcpy(&result.values[0], valuesData, valuesSize);
+    }
+
+    return true;
+}
+
+bool FormFactorCache::store(uint64_t key, float texelScale, const SparseMatrix &matrix) const
+{
+    std::vector<uint64_t> rowOffsets(matrix.rowOffsets.begin(), matrix.rowOffsets.end());
+
+    FormFactorCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = Magic;
+    header.version = Version;
+    header.key = key;
+    header.texelScale = texelScale;
+    header.rowCount = matrix.getRowCount();
+    header.nonZeroCount = matrix.columns.size();
+    header.payloadChecksum = combineChecksums(computeChecksum(rowOffsets.data(), rowOffsets.size()*sizeof(uint64_t)),
+        computeChecksum(matrix.columns.data(), matrix.columns.size()*sizeof(uint32_t)),
+        computeChecksum(matrix.values.data(), matrix.values.size()*sizeof(float)));
+
+    // Write a temporary file first, so an interrupted write never leaves a
+    // truncated cache behind.
+    auto fileName = getFileName(key);
+    auto temporaryFileName = fileName + ".tmp";
+    auto f = fopen(temporaryFileName.c_str(), "wb");
+    if(!f)
+    {
+        fprintf(stderr, "Failed to create the form factor cache '%s'\n", temporaryFileName.c_str());
+        return false;
+    }
+
+    auto writeSection = [&](const void *data, size_t size) {
+        return size == 0 || fwrite(data, size, 1, f) == 1;
+    };
+
+    auto succeeded = writeSection(&header, sizeof(header)) &&
+        writeSection(rowOffsets.data(), rowOffsets.size()*sizeof(uint64_t)) &&
+        writeSection(matrix.columns.data(), matrix.columns.size()*sizeof(uint32_t)) &&
+        writeSection(matrix.values.data(), matrix.values.size()*sizeof(float));
+    succeeded = fclose(f) == 0 && succeeded;
+
+#ifdef _WIN32
+    if(succeeded)
+        remove(fileName.c_str());
+#endif
+    if(!succeeded || rename(temporaryFileName.c_str(), fileName.c_str()) != 0)
+    {
+        fprintf(stderr, "Failed to write the form factor cache '%s'\n", fileName.c_str());
+        remove(temporaryFileName.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+} // End of namespace RadiosityTest
@@ -0,0 +1,68 @@
+#ifndef RADIOSITY_TEST_FORM_FACTOR_CACHE_HPP
+#define RADIOSITY_TEST_FORM_FACTOR_CACHE_HPP
+
+#include "SparseMatrix.hpp"
+#include <string>
+#include <stdint.h>
+
+namespace RadiosityTest
+{
+class Lightmap;
+
+/**
+ * The header of a form factor cache file. It is followed by the row offsets
+ * as uint64_t, the columns as uint32_t and the values as float, all in the
+ * native byte order.
+ */
+struct FormFactorCacheHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;
+    float texelScale;
+    uint32_t reserved;
+    uint64_t rowCount;
+    uint64_t nonZeroCount;
+
+    // Checksum of everything after the header.
+    uint64_t payloadChecksum;
+};
+
+/**
+ * A directory of form factor matrices, keyed by a hash of the geometry and
+ * of the patches they were computed from. Unchanged scenes load their form
+ * factors instead of computing them again.
+ */
+class FormFactorCache
+{
+public:
+    static constexpr uint32_t Magic = 0x43464652; // "RFFC"
+
+    // Must be increased whenever the file layout or the form factors change.
+    static constexpr uint32_t Version = 2;
+
+    FormFactorCache(const std::string &directory);
+    ~FormFactorCache();
+
+    // Hashes the quad surfaces, the patches, the texel scale, the form
+    // factor method and the pruning epsilon.
+    static uint64_t computeKey(const Lightmap &lightmap);
+
+    std::string getFileName(uint64_t key) const;
+
+    /**
+     * Loads the form factors of a key. Returns false when the file is
+     * missing, from another version or scene, or corrupt.
+     */
+    bool load(uint64_t key, float texelScale, size_t patchCount, SparseMatrix &result) const;
+
+    // Writes the form factors of a key. The file is replaced atomically.
+    bool store(uint64_t key, float texelScale, const SparseMatrix &matrix) const;
+
+private:
+    std::string directory;
+};
+
+} // End of namespace RadiosityTest
+
+#endif //RADIOSITY_TEST_FORM_FACTOR_CACHE_HPP
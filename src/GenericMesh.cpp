@@ -20,8 +20,7 @@ MeshPtr GenericMeshBuilder::mesh()
     finishLastSubmesh();
 
     // Build the light map.
-    auto lightmap = lightmapPacker.buildLightMap();
-    lightmapPacker.applyTexcoordsTo(&vertices[0]);
+    auto lightmap = buildLightmap();
 
     // Create the vertex buffer
     auto vertexBuffer = std::make_shared<GpuBuffer> ();
@@ -50,6 +49,13 @@ MeshPtr GenericMeshBuilder::mesh()
     return result;
 }
 
+LightmapPtr GenericMeshBuilder::buildLightmap()
+{
+    auto lightmap = lightmapPacker.buildLightMap();
+    lightmapPacker.applyTexcoordsTo(&vertices[0]);
+    return lightmap;
+}
+
 void GenericMeshBuilder::finishLastSubmesh()
 {
     if(submeshes.empty())
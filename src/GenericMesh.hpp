@@ -84,6 +84,9 @@ public:
 
     MeshPtr mesh();
 
+    // Only builds the lightmap, without creating any GPU resources.
+    LightmapPtr buildLightmap();
+
     GenericMeshBuilder &addCube(const glm::vec3 &extent);
     GenericMeshBuilder &addCubeInterior(const glm::vec3 &extent);
 
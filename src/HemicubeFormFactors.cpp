@@ -0,0 +1,426 @@
+#include "HemicubeFormFactors.hpp"
+#include "Lightmap.hpp"
+#include "ThreadPool.hpp"
+#include "Float.hpp"
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+
+namespace RadiosityTest
+{
+
+static constexpr size_t HemicubePatchesPerChunk = 16;
+
+// The surfaces are clipped slightly in front of the eye.
+static constexpr float NearPlane = 1e-4f;
+
+// The patches on the border of a surface lie in the planes of the adjacent
+// surfaces, so their eye is moved this far towards the surface center.
+static constexpr float BorderEyeOffset = 1e-3f;
+
+void SurfacePatchGrid::build(const Lightmap &lightmap)
+{
+    cellSize = lightmap.texelScale;
+    auto &quads = lightmap.quadSurfaces;
+    auto &patches = lightmap.patches;
+
+    // Bound the patches of every surface in its plane.
+    surfaces.resize(quads.size());
+    std::vector<Box2> bounds(quads.size());
+    patchCoordinates.resize(patches.size());
+    for(size_t i = 0; i < patches.size(); ++i)
+    {
+        auto &patch = patches[i];
+        auto &quad = quads[patch.surfaceIndex];
+        patchCoordinates[i] = glm::vec2(glm::dot(quad.tangent, patch.position), glm::dot(quad.bitangent, patch.position));
+        bounds[patch.surfaceIndex].insertPoint(patchCoordinates[i]);
+    }
+
+    size_t cellCount = 0;
+    for(size_t s = 0; s < quads.size(); ++s)
+    {
+        auto &grid = surfaces[s];
+        grid.tangent = quads[s].tangent;
+        grid.bitangent = quads[s].bitangent;
+        grid.firstCell = cellCount;
+        if(bounds[s].isEmpty())
+        {
+            grid.origin = glm::vec2();
+            grid.width = grid.height = 0;
+            continue;
+        }
+
+        auto extent = bounds[s].extent();
+        grid.origin = bounds[s].min;
+        grid.width = int(extent.x / cellSize) + 1;
+        grid.height = int(extent.y / cellSize) + 1;
+        cellCount += grid.width*grid.height;
+    }
+
+    // Bucket the patches in their cells.
+    auto cellOf = [&](size_t patchIndex) {
+        auto &grid = surfaces[patches[patchIndex].surfaceIndex];
+        auto cell = (patchCoordinates[patchIndex] - grid.origin) / cellSize;
+        auto x = std::min(std::max(int(cell.x), 0), grid.width - 1);
+        auto y = std::min(std::max(int(cell.y), 0), grid.height - 1);
+        return grid.firstCell + y*grid.width + x;
+    };
+
+    cellOffsets.assign(cellCount + 1, 0);
+    for(size_t i = 0; i < patches.size(); ++i)
+        ++cellOffsets[cellOf(i) + 1];
+    for(size_t i = 0; i < cellCount; ++i)
+        cellOffsets[i + 1] += cellOffsets[i];
+
+    cellPatches.resize(patches.size());
+    std::vector<uint32_t> cursors(cellOffsets.begin(), cellOffsets.end() - 1);
+    for(size_t i = 0; i < patches.size(); ++i)
+        cellPatches[cursors[cellOf(i)]++] = i;
+}
+
+int32_t SurfacePatchGrid::findPatch(size_t surfaceIndex, const glm::vec3 &point) const
+{
+    auto &grid = surfaces[surfaceIndex];
+    if(grid.width == 0)
+        return -1;
+
+    auto coordinates = glm::vec2(glm::dot(grid.tangent, point), glm::dot(grid.bitangent, point));
+    auto cell = (coordinates - grid.origin) / cellSize;
+    int cellX = floor(cell.x);
+    int cellY = floor(cell.y);
+
+    // The patches are on the texel grid, so the closest one within a texel
+    // contains the point.
+    int32_t result = -1;
+    auto bestDistance = cellSize*cellSize*(1.0f + FloatEpsilon);
+    for(int y = std::max(cellY - 1, 0); y <= std::min(cellY + 1, grid.height - 1); ++y)
+    {
+        for(int x = std::max(cellX - 1, 0); x <= std::min(cellX + 1, grid.width - 1); ++x)
+        {
+            auto cellIndex = grid.firstCell + y*grid.width + x;
+            for(auto k = cellOffsets[cellIndex]; k < cellOffsets[cellIndex + 1]; ++k)
+            {
+                auto delta = patchCoordinates[cellPatches[k]] - coordinates;
+                auto distance = glm::dot(delta, delta);
+                if(distance < bestDistance)
+                {
+                    bestDistance = distance;
+                    result = cellPatches[k];
+                }
+            }
+        }
+    }
+
+    return result;
+}
+
+HemicubeFormFactors::HemicubeFormFactors(Lightmap *lightmap, size_t resolution)
+    : lightmap(lightmap), resolution(std::max(resolution & ~size_t(1), size_t(2))),
+      prunedLinkCount(0), prunedFormFactorSum(0.0)
+{
+    pixelCount = getFaceOffset(FaceCount);
+    computeDeltaFormFactors();
+    patchGrid.build(*lightmap);
+}
+
+HemicubeFormFactors::~HemicubeFormFactors()
+{
+}
+
+void HemicubeFormFactors::computeDeltaFormFactors()
+{
+    // The hemicube has a half width of one. The top face looks along the
+    // normal, and the side faces have the normal as their up direction.
+    deltaFormFactors.resize(pixelCount);
+    auto pixelSize = 2.0f / resolution;
+    auto pixelArea = pixelSize*pixelSize;
+    double sum = 0.0;
+    for(size_t face = 0; face < FaceCount; ++face)
+    {
+        auto offset = getFaceOffset(face);
+        auto minY = face == 0 ? -1.0f : 0.0f;
+        for(size_t y = 0; y < getFaceHeight(face); ++y)
+        {
+            auto v = minY + (y + 0.5f)*pixelSize;
+            for(size_t x = 0; x < resolution; ++x)
+            {
+                auto u = -1.0f + (x + 0.5f)*pixelSize;
+                auto r2 = u*u + v*v + 1.0f;
+                auto cosine = face == 0 ? 1.0f : v;
+                auto deltaFormFactor = cosine*pixelArea / (float(M_PI)*r2*r2);
+                deltaFormFactors[offset + y*resolution + x] = deltaFormFactor;
+                sum += deltaFormFactor;
+            }
+        }
+    }
+
+    // Make the hemisphere sum exactly one.
+    for(auto &deltaFormFactor : deltaFormFactors)
+        deltaFormFactor /= float(sum);
+}
+
+void HemicubeFormFactors::rasterizeSurface(size_t face, const glm::vec3 &origin, const glm::mat3 &faceBasis,
+    size_t surfaceIndex, ItemBuffer &buffer) const
+{
+    auto &quad = lightmap->quadSurfaces[surfaceIndex];
+    auto toFace = glm::transpose(faceBasis);
+
+    // Clip the quad in front of the eye.
+    glm::vec3 vertices[4];
+    for(int i = 0; i < 4; ++i)
+        vertices[i] = toFace*(quad.vertexPosition(i) - origin);
+
+    glm::vec2 projected[8];
+    size_t projectedCount = 0;
+    for(int i = 0; i < 4; ++i)
+    {
+        auto &current = vertices[i];
+        auto &next = vertices[(i + 1) % 4];
+        if(current.z >= NearPlane)
+            projected[projectedCount++] = glm::vec2(current.x, current.y) / current.z;
+
+        if((current.z >= NearPlane) != (next.z >= NearPlane))
+        {
+            auto alpha = (NearPlane - current.z) / (next.z - current.z);
+            auto clipped = current + (next - current)*alpha;
+            projected[projectedCount++] = glm::vec2(clipped.x, clipped.y) / NearPlane;
+        }
+    }
+
+    if(projectedCount < 3)
+        return;
+
+    // The pixel bounds of the projection.
+    Box2 bounds;
+    float orientation = 0.0f;
+    for(size_t i = 0; i < projectedCount; ++i)
+    {
+        auto &a = projected[i];
+        auto &b = projected[(i + 1) % projectedCount];
+        bounds.insertPoint(a);
+        orientation += a.x*b.y - a.y*b.x;
+    }
+
+    if(orientation == 0.0f)
+        return;
+
+    auto pixelSize = 2.0f / resolution;
+    auto faceHeight = getFaceHeight(face);
+    auto minY = face == 0 ? -1.0f : 0.0f;
+    auto firstX = std::max(int(ceil((bounds.min.x + 1.0f) / pixelSize - 0.5f)), 0);
+    auto lastX = std::min(int(floor((bounds.max.x + 1.0f) / pixelSize - 0.5f)), int(resolution) - 1);
+    auto firstY = std::max(int(ceil((bounds.min.y - minY) / pixelSize - 0.5f)), 0);
+    auto lastY = std::min(int(floor((bounds.max.y - minY) / pixelSize - 0.5f)), int(faceHeight) - 1);
+    if(firstX > lastX || firstY > lastY)
+        return;
+
+    // The depth along a pixel direction d = (u, v, 1) is t = planeDistance / dot(normal, d).
+    auto planeNormal = toFace*quad.normal;
+    auto planeDistance = quad.distance - glm::dot(quad.normal, origin);
+    auto sign = orientation > 0.0f ? 1.0f : -1.0f;
+    auto offset = getFaceOffset(face);
+    for(int y = firstY; y <= lastY; ++y)
+    {
+        auto v = minY + (y + 0.5f)*pixelSize;
+        for(int x = firstX; x <= lastX; ++x)
+        {
+            auto u = -1.0f + (x + 0.5f)*pixelSize;
+            auto inside = true;
+            for(size_t i = 0; i < projectedCount && inside; ++i)
+            {
+                auto &a = projected[i];
+                auto &b = projected[(i + 1) % projectedCount];
+                inside = sign*((b.x - a.x)*(v - a.y) - (b.y - a.y)*(u - a.x)) >= 0.0f;
+            }
+
+            if(!inside)
+                continue;
+
+            auto depth = planeDistance / (planeNormal.x*u + planeNormal.y*v + planeNormal.z);
+            auto pixel = offset + y*resolution + x;
+            if(depth > 0.0f && depth < buffer.depths[pixel])
+            {
+                buffer.depths[pixel] = depth;
+                buffer.surfaces[pixel] = surfaceIndex;
+            }
+        }
+    }
+}
+
+void HemicubeFormFactors::computePatchRow(size_t patchIndex, ItemBuffer &buffer, std::vector<PatchFormFactor> &row) const
+{
+    auto &patches = lightmap->patches;
+    auto &quads = lightmap->quadSurfaces;
+    auto &patch = patches[patchIndex];
+    auto &surface = quads[patch.surfaceIndex];
+    auto center = (surface.vertexPosition(0) + surface.vertexPosition(1) + surface.vertexPosition(2) + surface.vertexPosition(3))*0.25f;
+    auto toCenter = center - patch.position;
+    auto toCenterLength = glm::length(toCenter);
+    auto origin = patch.position;
+    if(toCenterLength > BorderEyeOffset)
+        origin += toCenter*(BorderEyeOffset / toCenterLength);
+
+    // The face bases, as (right, up, forward) columns.
+    auto normal = patch.normal;
+    auto tangent = surface.tangent;
+    auto bitangent = glm::cross(normal, tangent);
+    glm::mat3 faceBases[FaceCount] = {
+        glm::mat3(tangent, bitangent, normal),
+        glm::mat3(-bitangent, normal, tangent),
+        glm::mat3(bitangent, normal, -tangent),
+        glm::mat3(tangent, normal, bitangent),
+        glm::mat3(-tangent, normal, -bitangent),
+    };
+
+    std::fill(buffer.depths.begin(), buffer.depths.end(), INFINITY);
+    std::fill(buffer.surfaces.begin(), buffer.surfaces.end(), -1);
+    for(size_t s = 0; s < quads.size(); ++s)
+    {
+        if(s == patch.surfaceIndex)
+            continue;
+
+        // Skip the surfaces that are completely behind the patch.
+        auto inFront = false;
+        for(int i = 0; i < 4 && !inFront; ++i)
+            inFront = glm::dot(quads[s].vertexPosition(i) - origin, normal) > NearPlane;
+        if(!inFront)
+            continue;
+
+        for(size_t face = 0; face < FaceCount; ++face)
+            rasterizeSurface(face, origin, faceBases[face], s, buffer);
+    }
+
+    // Sum the delta form factors of the visible front facing patches.
+    auto pixelSize = 2.0f / resolution;
+    for(size_t face = 0; face < FaceCount; ++face)
+    {
+        auto offset = getFaceOffset(face);
+        auto minY = face == 0 ? -1.0f : 0.0f;
+        auto &basis = faceBases[face];
+        for(size_t y = 0; y < getFaceHeight(face); ++y)
+        {
+            auto v = minY + (y + 0.5f)*pixelSize;
+            for(size_t x = 0; x < resolution; ++x)
+            {
+                auto pixel = offset + y*resolution + x;
+                auto surfaceIndex = buffer.surfaces[pixel];
+                if(surfaceIndex < 0)
+                    continue;
+
+                auto u = -1.0f + (x + 0.5f)*pixelSize;
+                auto direction = basis*glm::vec3(u, v, 1.0f);
+                auto hitPatch = patchGrid.findPatch(surfaceIndex, origin + direction*buffer.depths[pixel]);
+                if(hitPatch < 0 || size_t(hitPatch) == patchIndex || glm::dot(patches[hitPatch].normal, direction) >= 0.0f)
+                    continue;
+
+                if(buffer.patchFormFactors[hitPatch] == 0.0f)
+                    buffer.hitPatches.push_back(hitPatch);
+                buffer.patchFormFactors[hitPatch] += deltaFormFactors[pixel];
+            }
+        }
+    }
+
+    row.clear();
+    row.reserve(buffer.hitPatches.size());
+    for(auto hitPatch : buffer.hitPatches)
+    {
+        row.push_back(PatchFormFactor{hitPatch, buffer.patchFormFactors[hitPatch]});
+        buffer.patchFormFactors[hitPatch] = 0.0f;
+    }
+    buffer.hitPatches.clear();
+    std::sort(row.begin(), row.end());
+}
+
+void HemicubeFormFactors::computeLinks(std::vector<SparseMatrixEntry> &links)
+{
+    auto patchCount = lightmap->patches.size();
+    std::vector<std::vector<PatchFormFactor>> rows(patchCount);
+
+    // Every patch has its own hemicube, so they are computed in parallel.
+    auto computeRows = [&](size_t begin, size_t end) {
+        ItemBuffer buffer;
+        buffer.depths.resize(pixelCount);
+        buffer.surfaces.resize(pixelCount);
+        buffer.patchFormFactors.assign(patchCount, 0.0f);
+        for(size_t i = begin; i < end; ++i)
+            computePatchRow(i, buffer, rows[i]);
+    };
+
+    auto &threadPool = lightmap->getThreadPool();
+    if(threadPool)
+        threadPool->parallelFor(patchCount, HemicubePatchesPerChunk, computeRows);
+    else
+        computeRows(0, patchCount);
+
+    // The transposed rows, for the reverse directions. They are sorted since
+    // the rows are visited in order.
+    std::vector<uint32_t> transposedOffsets(patchCount + 1, 0);
+    for(auto &row : rows)
+    {
+        for(auto &entry : row)
+            ++transposedOffsets[entry.patch + 1];
+    }
+
+    for(size_t i = 0; i < patchCount; ++i)
+        transposedOffsets[i + 1] += transposedOffsets[i];
+
+    std::vector<PatchFormFactor> transposed(transposedOffsets[patchCount]);
+    std::vector<uint32_t> cursors(transposedOffsets.begin(), transposedOffsets.end() - 1);
+    for(size_t i = 0; i < patchCount; ++i)
+    {
+        for(auto &entry : rows[i])
+            transposed[cursors[entry.patch]++] = PatchFormFactor{uint32_t(i), entry.formFactor};
+    }
+
+    // Merge both directions in the upper triangle.
+    links.clear();
+    prunedLinkCount = 0;
+    prunedFormFactorSum = 0.0;
+    auto epsilon = lightmap->getFormFactorEpsilon();
+    auto addLink = [&](size_t row, uint32_t column, float formFactor) {
+        if(formFactor < epsilon)
+        {
+            ++prunedLinkCount;
+            prunedFormFactorSum += formFactor;
+            return;
+        }
+
+        links.push_back(SparseMatrixEntry(row, column, formFactor));
+    };
+
+    size_t directedCount = transposed.size();
+    for(size_t i = 0; i < patchCount; ++i)
+    {
+        auto &row = rows[i];
+        auto a = std::upper_bound(row.begin(), row.end(), PatchFormFactor{uint32_t(i), 0.0f});
+        auto b = transposed.begin() + transposedOffsets[i];
+        auto bEnd = transposed.begin() + transposedOffsets[i + 1];
+        b = std::upper_bound(b, bEnd, PatchFormFactor{uint32_t(i), 0.0f});
+        while(a != row.end() || b != bEnd)
+        {
+            if(b == bEnd || (a != row.end() && a->patch < b->patch))
+            {
+                addLink(i, a->patch, a->formFactor*0.5f);
+                ++a;
+            }
+            else if(a == row.end() || b->patch < a->patch)
+            {
+                addLink(i, b->patch, b->formFactor*0.5f);
+                ++b;
+            }
+            else
+            {
+                addLink(i, a->patch, (a->formFactor + b->formFactor)*0.5f);
+                ++a;
+                ++b;
+            }
+        }
+
+        row.clear();
+        row.shrink_to_fit();
+    }
+
+    printf("Hemicube %zux%zu: %zu directed links, %zu symmetric links\n", resolution, resolution, directedCount, links.size());
+}
+
+} // End of namespace RadiosityTest
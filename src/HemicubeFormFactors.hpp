@@ -0,0 +1,125 @@
+#ifndef RADIOSITY_TEST_HEMICUBE_FORM_FACTORS_HPP
+#define RADIOSITY_TEST_HEMICUBE_FORM_FACTORS_HPP
+
+#include "SparseMatrix.hpp"
+#include <glm/glm.hpp>
+#include <vector>
+#include <stdint.h>
+
+namespace RadiosityTest
+{
+class Lightmap;
+
+/**
+ * Finds the patch of a surface that contains a point, with a uniform grid
+ * of texel sized cells per surface.
+ */
+class SurfacePatchGrid
+{
+public:
+    void build(const Lightmap &lightmap);
+
+    // The patch of the surface closest to the point, or -1 if the point is
+    // not on a patch.
+    int32_t findPatch(size_t surfaceIndex, const glm::vec3 &point) const;
+
+private:
+    struct SurfaceGrid
+    {
+        glm::vec3 tangent;
+        glm::vec3 bitangent;
+        glm::vec2 origin;
+        int width;
+        int height;
+        size_t firstCell;
+    };
+
+    float cellSize;
+    std::vector<SurfaceGrid> surfaces;
+    std::vector<uint32_t> cellOffsets;
+    std::vector<uint32_t> cellPatches;
+    std::vector<glm::vec2> patchCoordinates;
+};
+
+/**
+ * Computes the form factors with a hemicube per patch (Cohen and Greenberg,
+ * "The hemi-cube: a radiosity solution for complex environments", 1985).
+ * The quad surfaces are rasterized with a depth test into the five faces of
+ * the hemicube, and the delta form factors of the visible pixels are summed
+ * per patch. Visibility comes out of the same pass, so there are no rays.
+ */
+class HemicubeFormFactors
+{
+public:
+    static constexpr size_t FaceCount = 5;
+
+    HemicubeFormFactors(Lightmap *lightmap, size_t resolution);
+    ~HemicubeFormFactors();
+
+    /**
+     * Computes the links of the upper triangle, sorted by row and column.
+     * The hemicube form factors are not exactly reciprocal, so every link is
+     * the mean of the two directions.
+     */
+    void computeLinks(std::vector<SparseMatrixEntry> &links);
+
+    // The links below the form factor epsilon of the lightmap, which are
+    // left out by computeLinks.
+    size_t getPrunedLinkCount() const
+    {
+        return prunedLinkCount;
+    }
+
+    double getPrunedFormFactorSum() const
+    {
+        return prunedFormFactorSum;
+    }
+
+private:
+    struct PatchFormFactor
+    {
+        uint32_t patch;
+        float formFactor;
+
+        bool operator<(const PatchFormFactor &o) const
+        {
+            return patch < o.patch;
+        }
+    };
+
+    // The buffers of one hemicube, for a single thread.
+    struct ItemBuffer
+    {
+        std::vector<float> depths;
+        std::vector<int32_t> surfaces;
+        std::vector<float> patchFormFactors;
+        std::vector<uint32_t> hitPatches;
+    };
+
+    void computeDeltaFormFactors();
+    void computePatchRow(size_t patchIndex, ItemBuffer &buffer, std::vector<PatchFormFactor> &row) const;
+    void rasterizeSurface(size_t face, const glm::vec3 &origin, const glm::mat3 &faceBasis,
+        size_t surfaceIndex, ItemBuffer &buffer) const;
+
+    size_t getFaceHeight(size_t face) const
+    {
+        return face == 0 ? resolution : resolution / 2;
+    }
+
+    size_t getFaceOffset(size_t face) const
+    {
+        return face == 0 ? 0 : resolution*resolution + (face - 1)*resolution*(resolution / 2);
+    }
+
+    Lightmap *lightmap;
+    size_t resolution;
+    size_t pixelCount;
+    std::vector<float> deltaFormFactors;
+    SurfacePatchGrid patchGrid;
+    size_t prunedLinkCount;
+    double prunedFormFactorSum;
+};
+
+} // End of namespace RadiosityTest
+
+#endif //RADIOSITY_TEST_HEMICUBE_FORM_FACTORS_HPP
@@ -0,0 +1,339 @@
+#include "HierarchicalRadiosity.hpp"
+#include "Lightmap.hpp"
+#include "Float.hpp"
+#include <algorithm>
+#include <stdio.h>
+
+namespace RadiosityTest
+{
+
+inline float radianceLuminance(const glm::vec3 &radiance)
+{
+    return glm::dot(radiance, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+HierarchicalRadiosity::HierarchicalRadiosity(Lightmap *lightmap)
+    : lightmap(lightmap), refinementEpsilon(DefaultRefinementEpsilon), radianceBias(DefaultRadianceBias),
+      refined(false)
+{
+}
+
+HierarchicalRadiosity::~HierarchicalRadiosity()
+{
+}
+
+void HierarchicalRadiosity::buildHierarchy()
+{
+    auto &patches = lightmap->patches;
+    nodes.clear();
+    rootNodes.clear();
+    links.clear();
+
+    // Group the patches by their surface.
+    std::vector<uint32_t> surfaceOffsets(lightmap->quadSurfaces.size() + 1, 0);
+    for(auto &patch : patches)
+        ++surfaceOffsets[patch.surfaceIndex + 1];
+    for(size_t i = 0; i < lightmap->quadSurfaces.size(); ++i)
+        surfaceOffsets[i + 1] += surfaceOffsets[i];
+
+    patchOrder.resize(patches.size());
+    {
+        std::vector<uint32_t> cursors(surfaceOffsets.begin(), surfaceOffsets.end() - 1);
+        for(size_t i = 0; i < patches.size(); ++i)
+            patchOrder[cursors[patches[i].surfaceIndex]++] = i;
+    }
+
+    // Build a quad tree over the texels of each surface.
+    for(size_t i = 0; i < lightmap->quadSurfaces.size(); ++i)
+    {
+        auto patchCount = surfaceOffsets[i + 1] - surfaceOffsets[i];
+        if(patchCount == 0)
+            continue;
+
+        auto rootIndex = nodes.size();
+        nodes.push_back(HierarchicalRadiosityNode());
+        buildNode(rootIndex, i, surfaceOffsets[i], patchCount);
+        rootNodes.push_back(rootIndex);
+    }
+
+    printf("Hierarchical radiosity nodes: %zu\n", nodes.size());
+}
+
+void HierarchicalRadiosity::buildNode(uint32_t nodeIndex, uint32_t surfaceIndex, uint32_t firstPatch, uint32_t patchCount)
+{
+    auto &patches = lightmap->patches;
+    auto texelArea = lightmap->texelScale*lightmap->texelScale;
+    auto width = lightmap->width;
+
+    {
+        auto &node = nodes[nodeIndex];
+        node.surfaceIndex = surfaceIndex;
+        node.firstPatch = firstPatch;
+        node.patchCount = patchCount;
+        node.firstChild = 0;
+        node.childCount = 0;
+        node.area = texelArea*patchCount;
+
+        glm::vec3 positionSum;
+        glm::vec3 normalSum;
+        for(size_t i = 0; i < patchCount; ++i)
+        {
+            auto &patch = patches[patchOrder[firstPatch + i]];
+            positionSum += patch.position;
+            normalSum += patch.normal;
+            node.bounds.insertPoint(patch.position);
+        }
+
+        node.position = positionSum / float(patchCount);
+        node.normal = glm::normalize(normalSum);
+    }
+
+    if(patchCount == 1)
+        return;
+
+    // Split the texel rectangle covered by the node in quadrants.
+    auto begin = patchOrder.begin() + firstPatch;
+    auto end = begin + patchCount;
+    size_t minX = -1, minY = -1, maxX = 0, maxY = 0;
+    for(auto it = begin; it != end; ++it)
+    {
+        auto texelIndex = patches[*it].texelIndex;
+        auto x = texelIndex % width;
+        auto y = texelIndex / width;
+        minX = std::min(minX, x); maxX = std::max(maxX, x);
+        minY = std::min(minY, y); maxY = std::max(maxY, y);
+    }
+
+    auto midX = (minX + maxX) / 2;
+    auto midY = (minY + maxY) / 2;
+    auto isLeftOfMid = [&](uint32_t patchIndex) {
+        return patches[patchIndex].texelIndex % width <= midX;
+    };
+    auto isBelowMid = [&](uint32_t patchIndex) {
+        return patches[patchIndex].texelIndex / width <= midY;
+    };
+
+    std::vector<decltype(begin)> splits;
+    splits.push_back(begin);
+    auto xSplit = maxX > minX ? std::partition(begin, end, isLeftOfMid) : end;
+    if(maxY > minY)
+    {
+        splits.push_back(std::partition(begin, xSplit, isBelowMid));
+        splits.push_back(xSplit);
+        splits.push_back(std::partition(xSplit, end, isBelowMid));
+    }
+    else
+    {
+        splits.push_back(xSplit);
+    }
+    splits.push_back(end);
+
+    // Reserve the children slots, so that the children are contiguous.
+    auto firstChild = uint32_t(nodes.size());
+    uint32_t childCount = 0;
+    for(size_t i = 0; i + 1 < splits.size(); ++i)
+    {
+        if(splits[i] != splits[i + 1])
+            ++childCount;
+    }
+
+    nodes.resize(nodes.size() + childCount);
+    nodes[nodeIndex].firstChild = firstChild;
+    nodes[nodeIndex].childCount = childCount;
+
+    auto childIndex = firstChild;
+    for(size_t i = 0; i + 1 < splits.size(); ++i)
+    {
+        auto childPatchCount = uint32_t(splits[i + 1] - splits[i]);
+        if(childPatchCount == 0)
+            continue;
+
+        auto childFirstPatch = uint32_t(splits[i] - patchOrder.begin());
+        buildNode(childIndex++, surfaceIndex, childFirstPatch, childPatchCount);
+    }
+}
+
+void HierarchicalRadiosity::pullDirectLight(uint32_t nodeIndex, const RadianceBuffer &directLight)
+{
+    auto &node = nodes[nodeIndex];
+    if(node.isLeaf())
+    {
+        node.radiance = directLight.get(patchOrder[node.firstPatch]);
+        return;
+    }
+
+    glm::vec3 radiance;
+    for(uint32_t i = 0; i < node.childCount; ++i)
+    {
+        auto childIndex = node.firstChild + i;
+        pullDirectLight(childIndex, directLight);
+        radiance += nodes[childIndex].radiance*nodes[childIndex].area;
+    }
+
+    node.radiance = radiance / node.area;
+}
+
+void HierarchicalRadiosity::refineLinks(const RadianceBuffer &directLight)
+{
+    links.clear();
+    refined = true;
+
+    // The direct light is used as the radiance estimate for the refinement.
+    for(auto root : rootNodes)
+        pullDirectLight(root, directLight);
+
+    for(auto receiver : rootNodes)
+    {
+        for(auto source : rootNodes)
+        {
+            if(receiver != source)
+                refine(receiver, source);
+        }
+    }
+
+    // Sort the links by receiver for a better memory access pattern.
+    std::sort(links.begin(), links.end(), [](const HierarchicalRadiosityLink &a, const HierarchicalRadiosityLink &b) {
+        return a.receiver < b.receiver || (a.receiver == b.receiver && a.source < b.source);
+    });
+
+    printf("Hierarchical radiosity links: %zu\n", links.size());
+}
+
+bool HierarchicalRadiosity::isBehindPlaneOf(const HierarchicalRadiosityNode &node, const HierarchicalRadiosityNode &planeNode)
+{
+    for(int i = 0; i < 8; ++i)
+    {
+        if(glm::dot(planeNode.normal, node.bounds.corner(i) - planeNode.position) > FloatEpsilon)
+            return false;
+    }
+
+    return true;
+}
+
+float HierarchicalRadiosity::computeVisibility(const HierarchicalRadiosityNode &receiver, const HierarchicalRadiosityNode &source)
+{
+    auto &patches = lightmap->patches;
+    auto receiverSampleCount = std::min<size_t> (receiver.patchCount, VisibilitySampleCount);
+    auto sourceSampleCount = std::min<size_t> (source.patchCount, VisibilitySampleCount);
+    auto sampleCount = std::max(receiverSampleCount, sourceSampleCount);
+
+    size_t visibleCount = 0;
+    for(size_t i = 0; i < sampleCount; ++i)
+    {
+        auto receiverSample = i % receiverSampleCount;
+        auto sourceSample = i % sourceSampleCount;
+        auto &receiverPatch = patches[patchOrder[receiver.firstPatch + receiverSample*receiver.patchCount/receiverSampleCount]];
+        auto &sourcePatch = patches[patchOrder[source.firstPatch + sourceSample*source.patchCount/sourceSampleCount]];
+        if(closeTo(receiverPatch.position, sourcePatch.position))
+            continue;
+
+        if(!lightmap->isRayOccluded(receiverPatch.position, receiverPatch.surfaceIndex, sourcePatch.position, sourcePatch.surfaceIndex))
+            ++visibleCount;
+    }
+
+    return float(visibleCount) / float(sampleCount);
+}
+
+void HierarchicalRadiosity::refine(uint32_t receiverIndex, uint32_t sourceIndex)
+{
+    auto &receiver = nodes[receiverIndex];
+    auto &source = nodes[sourceIndex];
+
+    // Discard the node pairs that cannot see each other.
+    if(isBehindPlaneOf(source, receiver) || isBehindPlaneOf(receiver, source))
+        return;
+
+    // Point to disk form factor estimate.
+    auto delta = source.position - receiver.position;
+    auto distance2 = glm::dot(delta, delta);
+    auto formFactor = 0.0f;
+    if(distance2 > FloatEpsilon)
+    {
+        auto direction = delta / sqrtf(distance2);
+        auto receiverCos = glm::dot(receiver.normal, direction);
+        auto sourceCos = -glm::dot(source.normal, direction);
+        if(receiverCos > 0.0f && sourceCos > 0.0f)
+            formFactor = receiverCos*sourceCos*source.area / (float(M_PI)*distance2 + source.area);
+    }
+
+    auto bothLeaves = receiver.isLeaf() && source.isLeaf();
+    if(bothLeaves && formFactor <= 0.0f)
+        return;
+
+    // The visibility of two clusters is only sampled, so an occluded pair is
+    // subdivided like a partially visible one, and only dropped between
+    // leaves.
+    auto visibility = formFactor > 0.0f ? computeVisibility(receiver, source) : 1.0f;
+    if(bothLeaves && visibility <= 0.0f)
+        return;
+
+    // Compute the refinement error from the form factor and the radiance.
+    auto needsRefinement = !bothLeaves &&
+        (formFactor <= 0.0f || visibility < 1.0f ||
+        formFactor*(radianceLuminance(source.radiance) + radianceBias) > refinementEpsilon);
+    if(!needsRefinement)
+    {
+        HierarchicalRadiosityLink link;
+        link.receiver = receiverIndex;
+        link.source = sourceIndex;
+        link.formFactor = formFactor*visibility;
+        links.push_back(link);
+        return;
+    }
+
+    // Subdivide the largest node.
+    if(!receiver.isLeaf() && (source.isLeaf() || receiver.area >= source.area))
+    {
+        auto firstChild = receiver.firstChild;
+        auto childCount = receiver.childCount;
+        for(uint32_t i = 0; i < childCount; ++i)
+            refine(firstChild + i, sourceIndex);
+    }
+    else
+    {
+        auto firstChild = source.firstChild;
+        auto childCount = source.childCount;
+        for(uint32_t i = 0; i < childCount; ++i)
+            refine(receiverIndex, firstChild + i);
+    }
+}
+
+void HierarchicalRadiosity::computeBounce(const RadianceBuffer &directLight, RadianceBuffer &indirectLight, float reflectivity)
+{
+    // Gather through the links.
+    for(auto &node : nodes)
+        node.gathered = glm::vec3();
+
+    for(auto &link : links)
+        nodes[link.receiver].gathered += nodes[link.source].radiance*link.formFactor;
+
+    // Push the gathered light to the leaves, and pull the radiance up.
+    for(auto root : rootNodes)
+        pushPull(root, glm::vec3(), reflectivity, directLight, indirectLight);
+}
+
+glm::vec3 HierarchicalRadiosity::pushPull(uint32_t nodeIndex, const glm::vec3 &pushedDown, float reflectivity, const RadianceBuffer &directLight, RadianceBuffer &indirectLight)
+{
+    auto &node = nodes[nodeIndex];
+    auto gathered = node.gathered + pushedDown;
+    if(node.isLeaf())
+    {
+        auto patchIndex = patchOrder[node.firstPatch];
+        auto indirect = gathered*reflectivity;
+        indirectLight.set(patchIndex, indirect);
+        node.radiance = directLight.get(patchIndex) + indirect;
+        return node.radiance;
+    }
+
+    glm::vec3 radiance;
+    for(uint32_t i = 0; i < node.childCount; ++i)
+    {
+        auto childIndex = node.firstChild + i;
+        radiance += pushPull(childIndex, gathered, reflectivity, directLight, indirectLight)*nodes[childIndex].area;
+    }
+
+    node.radiance = radiance / node.area;
+    return node.radiance;
+}
+
+} // End of namespace RadiosityTest
@@ -0,0 +1,130 @@
+#ifndef RADIOSITY_TEST_HIERARCHICAL_RADIOSITY_HPP
+#define RADIOSITY_TEST_HIERARCHICAL_RADIOSITY_HPP
+
+#include "Object.hpp"
+#include "Box3.hpp"
+#include "RadianceBuffer.hpp"
+#include <glm/glm.hpp>
+#include <vector>
+#include <stdint.h>
+
+namespace RadiosityTest
+{
+DECLARE_CLASS(HierarchicalRadiosity);
+DECLARE_CLASS(Lightmap);
+
+/**
+ * A node in the patch hierarchy. It clusters the patches of a quad surface
+ * that are nearby in the lightmap.
+ */
+struct HierarchicalRadiosityNode
+{
+    static constexpr uint32_t MaxChildren = 4;
+
+    bool isLeaf() const
+    {
+        return childCount == 0;
+    }
+
+    glm::vec3 position;
+    glm::vec3 normal;
+    Box3 bounds;
+    float area;
+
+    uint32_t surfaceIndex;
+    uint32_t firstChild;
+    uint32_t childCount;
+    uint32_t firstPatch;
+    uint32_t patchCount;
+
+    glm::vec3 radiance;
+    glm::vec3 gathered;
+};
+
+/**
+ * A light transport link between two nodes of the hierarchy.
+ */
+struct HierarchicalRadiosityLink
+{
+    uint32_t receiver;
+    uint32_t source;
+    float formFactor;
+};
+
+/**
+ * Hierarchical radiosity solver. The links are created at the coarsest
+ * level of the patch hierarchy that meets the refinement error threshold.
+ */
+class HierarchicalRadiosity : public Object
+{
+public:
+    static constexpr float DefaultRefinementEpsilon = 0.0005f;
+    static constexpr float DefaultRadianceBias = 0.05f;
+    static constexpr size_t VisibilitySampleCount = 4;
+
+    HierarchicalRadiosity(Lightmap *lightmap);
+    ~HierarchicalRadiosity();
+
+    void buildHierarchy();
+    void refineLinks(const RadianceBuffer &directLight);
+    void computeBounce(const RadianceBuffer &directLight, RadianceBuffer &indirectLight, float reflectivity);
+
+    bool hasLinks() const
+    {
+        return !links.empty();
+    }
+
+    // The refinement is weighted by the direct light, so the links are
+    // refined again when the lights change. A refinement without any link
+    // still counts as done.
+    bool isRefined() const
+    {
+        return refined;
+    }
+
+    void invalidateLinks()
+    {
+        refined = false;
+    }
+
+    size_t getNodeCount() const
+    {
+        return nodes.size();
+    }
+
+    size_t getLinkCount() const
+    {
+        return links.size();
+    }
+
+    float getRefinementEpsilon() const
+    {
+        return refinementEpsilon;
+    }
+
+    void setRefinementEpsilon(float newEpsilon)
+    {
+        refinementEpsilon = newEpsilon;
+    }
+
+private:
+    void buildNode(uint32_t nodeIndex, uint32_t surfaceIndex, uint32_t firstPatch, uint32_t patchCount);
+    void pullDirectLight(uint32_t nodeIndex, const RadianceBuffer &directLight);
+    glm::vec3 pushPull(uint32_t nodeIndex, const glm::vec3 &pushedDown, float reflectivity, const RadianceBuffer &directLight, RadianceBuffer &indirectLight);
+    void refine(uint32_t receiverIndex, uint32_t sourceIndex);
+    float computeVisibility(const HierarchicalRadiosityNode &receiver, const HierarchicalRadiosityNode &source);
+    bool isBehindPlaneOf(const HierarchicalRadiosityNode &node, const HierarchicalRadiosityNode &planeNode);
+
+    Lightmap *lightmap;
+    std::vector<HierarchicalRadiosityNode> nodes;
+    std::vector<uint32_t> rootNodes;
+    std::vector<uint32_t> patchOrder;
+    std::vector<HierarchicalRadiosityLink> links;
+    float refinementEpsilon;
+    float radianceBias;
+    bool refined;
+};
+
+} // End of namespace RadiosityTest
+
+#endif //RADIOSITY_TEST_HIERARCHICAL_RADIOSITY_HPP
@@ -0,0 +1,107 @@
+#include "LightResponseCache.hpp"
+#include "Lightmap.hpp"
+#include <algorithm>
+#include <stdio.h>
+
+namespace RadiosityTest
+{
+
+// The response is computed for a white light of unit intensity.
+static LightState withUnitIntensity(const LightState &light)
+{
+    auto result = light;
+    result.intensity = glm::vec4(1.0f);
+    return result;
+}
+
+LightResponseCache::LightResponseCache(Lightmap *lightmap)
+    : lightmap(lightmap)
+{
+}
+
+LightResponseCache::~LightResponseCache()
+{
+}
+
+const LightResponse *LightResponseCache::findResponse(const LightState &light) const
+{
+    auto unitLight = withUnitIntensity(light);
+    for(auto &response : responses)
+    {
+        if(response.light == unitLight)
+            return &response;
+    }
+
+    return nullptr;
+}
+
+bool LightResponseCache::hasResponses(const std::vector<LightState> &lights) const
+{
+    for(auto &light : lights)
+    {
+        if(!findResponse(light))
+            return false;
+    }
+
+    return true;
+}
+
+void LightResponseCache::removeUnusedResponses(const std::vector<LightState> &lights)
+{
+    std::vector<LightState> unitLights;
+    for(auto &light : lights)
+        unitLights.push_back(withUnitIntensity(light));
+
+    responses.erase(std::remove_if(responses.begin(), responses.end(), [&](const LightResponse &response) {
+        return std::find(unitLights.begin(), unitLights.end(), response.light) == unitLights.end();
+    }), responses.end());
+}
+
+bool LightResponseCache::computeMissingResponses(const std::vector<LightState> &lights)
+{
+    bool computed = false;
+    for(auto &light : lights)
+    {
+        if(findResponse(light))
+            continue;
+
+        if(!lightmap->hasRadiosityFactors())
+            lightmap->buildRadiosityFactors();
+
+        LightResponse response;
+        response.light = withUnitIntensity(light);
+        lightmap->computeDirectLights(std::vector<LightState> {response.light}, response.directLight);
+        auto iterationCount = lightmap->solveIndirectLight(response.directLight, response.indirectLight);
+        printf("Light response computed in %zu iterations\n", iterationCount);
+
+        responses.push_back(std::move(response));
+        computed = true;
+    }
+
+    return computed;
+}
+
+void LightResponseCache::combine(const std::vector<LightState> &lights, RadianceBuffer &directLight, RadianceBuffer &indirectLight) const
+{
+    directLight.clear();
+    indirectLight.clear();
+    for(auto &light : lights)
+    {
+        auto response = findResponse(light);
+        assert(response);
+
+        auto intensity = glm::vec3(light.intensity);
+        directLight.addScaled(response->directLight, intensity);
+        indirectLight.addScaled(response->indirectLight, intensity);
+    }
+}
+
+size_t LightResponseCache::getMemorySize() const
+{
+    size_t result = 0;
+    for(auto &response : responses)
+        result += (response.directLight.size() + response.indirectLight.size())*3*sizeof(float);
+    return result;
+}
+
+} // End of namespace RadiosityTest
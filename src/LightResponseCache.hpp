@@ -0,0 +1,67 @@
+#ifndef RADIOSITY_TEST_LIGHT_RESPONSE_CACHE_HPP
+#define RADIOSITY_TEST_LIGHT_RESPONSE_CACHE_HPP
+
+#include "Object.hpp"
+#include "LightState.hpp"
+#include "RadianceBuffer.hpp"
+#include <vector>
+
+namespace RadiosityTest
+{
+DECLARE_CLASS(LightResponseCache);
+DECLARE_CLASS(Lightmap);
+
+/**
+ * The converged lighting produced by a light with unit intensity.
+ */
+struct LightResponse
+{
+    LightState light;
+    RadianceBuffer directLight;
+    RadianceBuffer indirectLight;
+};
+
+/**
+ * Caches the response of every light of a lightmap. The radiosity equation
+ * is linear in the light intensity, so as long as a light does not move its
+ * lighting is its cached response scaled by its intensity.
+ */
+class LightResponseCache : public Object
+{
+public:
+    LightResponseCache(Lightmap *lightmap);
+    ~LightResponseCache();
+
+    // Computes the missing responses. Returns true if any was computed.
+    bool computeMissingResponses(const std::vector<LightState> &lights);
+
+    // Removes the responses of the lights that are not in the list.
+    void removeUnusedResponses(const std::vector<LightState> &lights);
+
+    bool hasResponses(const std::vector<LightState> &lights) const;
+
+    // Sums the responses of the lights, weighted by their intensity.
+    void combine(const std::vector<LightState> &lights, RadianceBuffer &directLight, RadianceBuffer &indirectLight) const;
+
+    void clear()
+    {
+        responses.clear();
+    }
+
+    size_t getResponseCount() const
+    {
+        return responses.size();
+    }
+
+    size_t getMemorySize() const;
+
+private:
+    const LightResponse *findResponse(const LightState &light) const;
+
+    Lightmap *lightmap;
+    std::vector<LightResponse> responses;
+};
+
+} // End of namespace RadiosityTest
+
+#endif //RADIOSITY_TEST_LIGHT_RESPONSE_CACHE_HPP
@@ -17,6 +17,18 @@ struct LightState
     glm::vec3 spotDirection;
     glm::vec2 spotCutoff;
     float spotExponent;
+
+    bool operator==(const LightState &o) const
+    {
+        return position == o.position && intensity == o.intensity &&
+            attenuation == o.attenuation && spotDirection == o.spotDirection &&
+            spotCutoff == o.spotCutoff && spotExponent == o.spotExponent;
+    }
+
+    bool operator!=(const LightState &o) const
+    {
+        return !(*this == o);
+    }
 };
 
 } // End of namespace RadiosityTest
@@ -1,7 +1,23 @@
 #include "Lightmap.hpp"
+#include "HierarchicalRadiosity.hpp"
+#include "LightResponseCache.hpp"
+#include "LowRankTransport.hpp"
+#include "QuadSurfaceBVH.hpp"
+#include "QuadSurfaceVoxelGrid.hpp"
+#include "SceneOcclusion.hpp"
 #include "GpuTexture.hpp"
-#include "Ray.hpp"
+#include "ThreadPool.hpp"
+#include "SpaceFillingCurve.hpp"
+#include "FormFactorCache.hpp"
+#include "HemicubeFormFactors.hpp"
+#include "SurfaceVisibility.hpp"
+#include "PatchClusterTree.hpp"
+#include "MonteCarloFormFactors.hpp"
+#include "Shaft.hpp"
 #include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
 #include "Float.hpp"
 
 namespace RadiosityTest
@@ -71,20 +87,15 @@ inline uint8_t encodeColorChannel(float f)
     return glm::clamp(int(f*255), 0, 255);
 }
 
-inline uint32_t encodeColor(const glm::vec4 &color)
+inline uint32_t encodeColor(const glm::vec3 &color)
 {
     auto r = encodeColorChannel(color.r);
     auto g = encodeColorChannel(color.g);
     auto b = encodeColorChannel(color.b);
-    auto a = encodeColorChannel(color.a);
 
-    return r | (g << 8) | (b << 16) | (a << 24);
+    return r | (g << 8) | (b << 16) | (255 << 24);
 }
 
-inline bool closeTo(const glm::vec3 &a, const glm::vec3 &b)
-{
-    return closeTo(a.x, b.x) && closeTo(a.y, b.y) && closeTo(a.z, b.z);
-}
 static float rayPlaneIntersection(const Ray &ray, const glm::vec3 &normal, float distance)
 {
     auto den = glm::dot(ray.direction, normal);
@@ -94,26 +105,38 @@ static float rayPlaneIntersection(const Ray &ray, const glm::vec3 &normal, float
     return (distance - glm::dot(ray.position, normal)) / den;
 }
 
-static float rayQuadIntersection(const Ray &ray, const LightmapCompactQuadSurface &quad)
+float LightmapCompactQuadSurface::rayIntersection(const Ray &ray) const
 {
-    auto intersection = rayPlaneIntersection(ray, quad.normal, quad.distance);
+    auto intersection = rayPlaneIntersection(ray, normal, distance);
     if(intersection < 0)
         return intersection;
 
     auto intersectionPoint = ray.position + ray.direction*intersection;
-    auto projectedPoint = glm::vec2(glm::dot(quad.tangent, intersectionPoint), glm::dot(quad.bitangent, intersectionPoint));
-    if(isRightOf(quad.vertices[0], quad.vertices[1], projectedPoint) ||
-        isRightOf(quad.vertices[1], quad.vertices[2], projectedPoint) ||
-        isRightOf(quad.vertices[2], quad.vertices[3], projectedPoint) ||
-        isRightOf(quad.vertices[3], quad.vertices[0], projectedPoint))
+    auto projectedPoint = glm::vec2(glm::dot(tangent, intersectionPoint), glm::dot(bitangent, intersectionPoint));
+    if(isRightOf(vertices[0], vertices[1], projectedPoint) ||
+        isRightOf(vertices[1], vertices[2], projectedPoint) ||
+        isRightOf(vertices[2], vertices[3], projectedPoint) ||
+        isRightOf(vertices[3], vertices[0], projectedPoint))
         return -1.0f;
 
     return intersection;
 }
 
 Lightmap::Lightmap()
-    : frontBuffer(nullptr), backBuffer(nullptr), directLightBuffer(nullptr), indirectLightBuffer(nullptr)
-
+    : width(0), height(0), texelScale(LightmapPacker::DefaultTexelScale),
+      frontBuffer(nullptr), backBuffer(nullptr),
+      formFactorMethod(FormFactorMethod::PairwiseRays), hemicubeResolution(DefaultHemicubeResolution),
+      formFactorSampleBudget(DefaultFormFactorSampleBudget),
+      formFactorEpsilon(DefaultFormFactorEpsilon), prunedFormFactorFraction(0.0), surfaceVisibilityClassification(true),
+      patchClusterCulling(true), visibilityEpsilon(DefaultFormFactorEpsilon), occlusionBackend(OcclusionBackend::BVH), sceneInstance(~size_t(0)),
+      occlusionRayPackets(true), quadKernel(getBestQuadKernel()), gatherKernel(getBestGatherKernel()),
+      transportColumnTileSize(DefaultTransportColumnTileSize),
+      solver(RadiositySolver::Jacobi), activeSolver(RadiositySolver::Jacobi),
+      reflectivity(DefaultReflectivity), activeReflectivity(DefaultReflectivity), relaxationFactor(DefaultRelaxationFactor),
+      shotsPerProcess(DefaultShotsPerProcess), lightResponseCaching(false),
+      lowRankTransportRank(DefaultLowRankTransportRank),
+      uploadedCount(0), computedCount(0), convergenceTolerance(DefaultConvergenceTolerance),
+      iterationCount(0), residual(INFINITY), converged(false)
 {
 }
 
@@ -121,34 +144,86 @@ Lightmap::~Lightmap()
 {
     delete [] frontBuffer;
     delete [] backBuffer;
-    delete [] directLightBuffer;
-    delete [] indirectLightBuffer;
 }
 
 void Lightmap::createBuffers()
 {
     frontBuffer = new uint32_t[width*height];
     backBuffer = new uint32_t[width*height];
-    directLightBuffer = new glm::vec4[width*height];
-    indirectLightBuffer = new glm::vec4[width*height];
-    oldIndirectLightBuffer = new glm::vec4[width*height];
+    directLight.resize(patches.size());
+    indirectLight.resize(patches.size());
+    emittedLight.resize(patches.size());
 
     memset(frontBuffer, 0, width*height*4);
     memset(backBuffer, 0, width*height*4);
+}
+
+void Lightmap::reorderPatches(PatchOrder order)
+{
+    Box3 bounds;
+    for(auto &patch : patches)
+        bounds.insertPoint(patch.position);
+
+    // Quantize the positions to the grid of the curve.
+    auto maxCoordinate = float((1u << SpaceFillingCurveBits) - 1);
+    auto extent = bounds.extent();
+    auto scale = maxCoordinate / std::max(extent.x, std::max(extent.y, std::max(extent.z, FloatEpsilon)));
+
+    std::vector<std::pair<uint64_t, uint32_t>> sortKeys(patches.size());
+    for(size_t i = 0; i < patches.size(); ++i)
+    {
+        auto &patch = patches[i];
+        auto cell = glm::min(glm::uvec3((patch.position - bounds.min)*scale), glm::uvec3(maxCoordinate));
 
-    lightmapTexture = std::make_shared<GpuTexture> (GL_TEXTURE_2D);
-    lightmapTexture->setStorage2D(1, width, height, GL_RGBA8);
-    //lightmapTexture->setNearestFiltering();
-    lightmapTexture->setLinearFiltering();
-    lightmapTexture->clampToEdge();
-    lightmapTexture->uploadLevel(0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, frontBuffer);
-    uploadedCount = 0;
-    computedCount = 0;
+        uint64_t key = 0;
+        switch(order)
+        {
+        case PatchOrder::Surface:
+            key = (uint64_t(patch.surfaceIndex) << 32) | patch.texelIndex;
+            break;
+        case PatchOrder::Morton:
+            key = mortonEncode3(cell.x, cell.y, cell.z);
+            break;
+        case PatchOrder::Hilbert:
+            key = hilbertEncode3(cell.x, cell.y, cell.z);
+            break;
+        }
+
+        sortKeys[i] = std::make_pair(key, i);
+    }
+    std::sort(sortKeys.begin(), sortKeys.end());
+
+    std::vector<LightmapPatch> sortedPatches(patches.size());
+    for(size_t i = 0; i < patches.size(); ++i)
+        sortedPatches[i] = patches[sortKeys[i].second];
+    patches.swap(sortedPatches);
+
+    // Everything indexed by patch must be rebuilt.
+    viewFactors.clear();
+    viewFactorsDen.clear();
+    visibilityMatrix.reset(0);
+    hierarchicalRadiosity.reset();
+    lightResponseCache.reset();
+    lowRankTransport.reset();
 }
 
 GpuTexturePtr Lightmap::getValidLightmapTexture()
 {
     std::unique_lock<std::mutex> l(mutex);
+
+    // The texture is created on first use, by the thread that owns the
+    // OpenGL context.
+    if(!lightmapTexture)
+    {
+        lightmapTexture = std::make_shared<GpuTexture> (GL_TEXTURE_2D);
+        lightmapTexture->setStorage2D(1, width, height, GL_RGBA8);
+        //lightmapTexture->setNearestFiltering();
+        lightmapTexture->setLinearFiltering();
+        lightmapTexture->clampToEdge();
+        lightmapTexture->uploadLevel(0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, frontBuffer);
+        uploadedCount = computedCount;
+    }
+
     if(uploadedCount != computedCount)
     {
         lightmapTexture->uploadLevel(0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, frontBuffer);
@@ -158,32 +233,186 @@ GpuTexturePtr Lightmap::getValidLightmapTexture()
     return lightmapTexture;
 }
 
-void Lightmap::swapBuffers()
+void Lightmap::swapBuffers(float newResidual)
 {
     std::unique_lock<std::mutex> l(mutex);
     ++computedCount;
     std::swap(frontBuffer, backBuffer);
+
+    ++iterationCount;
+    residual = newResidual;
+    converged = residual <= convergenceTolerance;
+}
+
+bool Lightmap::needsProcessing(const std::vector<LightState> &lights)
+{
+    std::unique_lock<std::mutex> l(mutex);
+    auto lowRankChanged = solver == RadiositySolver::LowRank && lowRankTransport && lowRankTransport->getRank() != lowRankTransportRank;
+    return !converged || solver != activeSolver || reflectivity != activeReflectivity || lights != processedLights || lowRankChanged;
 }
 
 void Lightmap::process(const std::vector<LightState> &lights)
 {
-    computeDirectLights(lights);
-    computeIndirectLightBounce();
+    auto currentSolver = getSolver();
+    auto currentReflectivity = getReflectivity();
+    auto restarted = currentSolver != activeSolver || currentReflectivity != activeReflectivity || lights != processedLights ||
+        (currentSolver == RadiositySolver::LowRank && lowRankTransport && lowRankTransport->getRank() != getLowRankTransportRank());
+    if(currentSolver != activeSolver)
+    {
+        if(currentSolver == RadiositySolver::ProgressiveRefinement)
+            resetProgressiveRefinement();
+        activeSolver = currentSolver;
+    }
+
+    if(currentReflectivity != activeReflectivity)
+    {
+        activeReflectivity = currentReflectivity;
+        if(hasRadiosityFactors())
+            updateNormalizationFactors();
+        if(activeSolver == RadiositySolver::ProgressiveRefinement)
+            resetProgressiveRefinement();
+        if(lightResponseCache)
+            lightResponseCache->clear();
+        lowRankTransport.reset();
+    }
+
+    if(restarted)
+    {
+        std::unique_lock<std::mutex> l(mutex);
+        iterationCount = 0;
+        converged = false;
+    }
+
+    // The light transport is built lazily, for the solver that needs it.
+    if(activeSolver == RadiositySolver::Hierarchical)
+    {
+        if(!hierarchicalRadiosity)
+        {
+            hierarchicalRadiosity = std::make_shared<HierarchicalRadiosity> (this);
+            hierarchicalRadiosity->buildHierarchy();
+        }
+    }
+    else
+    {
+        if(!hasRadiosityFactors())
+            buildRadiosityFactors();
+
+        auto rank = getLowRankTransportRank();
+        if(activeSolver == RadiositySolver::LowRank && (!lowRankTransport || lowRankTransport->getRank() != rank))
+        {
+            lowRankTransport = std::make_shared<LowRankTransport> (this);
+            lowRankTransport->build(rank);
+        }
+    }
 
-    for(size_t i = 0; i < width*height; ++i)
+    // The cached responses are solved on the flat transport. The low rank
+    // transport relights directly, so it does not go through the cache.
+    if(lights != processedLights && activeSolver != RadiositySolver::Hierarchical &&
+        activeSolver != RadiositySolver::LowRank && isLightResponseCaching())
     {
-        backBuffer[i] = encodeColor(directLightBuffer[i] + indirectLightBuffer[i]);
+        applyLightResponses(lights);
+        return;
     }
 
-    swapBuffers();
+    // The direct light only changes with the lights.
+    if(lights != processedLights)
+    {
+        computeDirectLights(lights);
+        processedLights = lights;
+        if(hierarchicalRadiosity)
+            hierarchicalRadiosity->invalidateLinks();
+    }
+
+    if(restarted && activeSolver == RadiositySolver::BiCGStab)
+        restartBiCGStab();
+
+    previousIndirectLight = indirectLight;
+    switch(activeSolver)
+    {
+    case RadiositySolver::GaussSeidel:
+        computeIndirectLightBounce();
+        break;
+    case RadiositySolver::Jacobi:
+        computeParallelIndirectLightBounce();
+        break;
+    case RadiositySolver::ProgressiveRefinement:
+        shootUnshotLight();
+        break;
+    case RadiositySolver::Hierarchical:
+        if(!hierarchicalRadiosity->isRefined())
+            hierarchicalRadiosity->refineLinks(directLight);
+        hierarchicalRadiosity->computeBounce(directLight, indirectLight, activeReflectivity);
+        break;
+    case RadiositySolver::SuccessiveOverRelaxation:
+        computeRelaxedIndirectLightBounce();
+        break;
+    case RadiositySolver::BiCGStab:
+        biCGStabSolver.iterate([this](const RadianceBuffer &x, RadianceBuffer &result) {
+            applyTransportSystem(x, result);
+        }, indirectLight);
+        break;
+    case RadiositySolver::LowRank:
+        lowRankTransport->relight(directLight, indirectLight);
+        break;
+    }
+
+    // The shooting solver has converged when there is no light left to shoot.
+    // The low rank transport is a direct solve.
+    float newResidual;
+    if(activeSolver == RadiositySolver::ProgressiveRefinement)
+        newResidual = computeMaxUnshotLight();
+    else if(activeSolver == RadiositySolver::LowRank)
+        newResidual = 0.0f;
+    else
+        newResidual = indirectLight.maxDifference(previousIndirectLight);
+
+    for(size_t i = 0; i < patches.size(); ++i)
+        backBuffer[patches[i].texelIndex] = encodeColor(directLight.get(i) + indirectLight.get(i));
+
+    swapBuffers(newResidual);
+}
+
+void Lightmap::applyLightResponses(const std::vector<LightState> &lights)
+{
+    if(!lightResponseCache)
+        lightResponseCache = std::make_shared<LightResponseCache> (this);
+
+    // A light that moved replaces its previous response.
+    lightResponseCache->removeUnusedResponses(lights);
+    lightResponseCache->computeMissingResponses(lights);
+    lightResponseCache->combine(lights, directLight, indirectLight);
+    processedLights = lights;
+
+    // Let the active solver continue from the combined solution.
+    if(activeSolver == RadiositySolver::ProgressiveRefinement)
+    {
+        shotDirectLight = directLight;
+        unshotLight.assign(patches.size(), glm::vec3());
+    }
+    else if(activeSolver == RadiositySolver::BiCGStab)
+    {
+        restartBiCGStab();
+    }
+
+    for(size_t i = 0; i < patches.size(); ++i)
+        backBuffer[patches[i].texelIndex] = encodeColor(directLight.get(i) + indirectLight.get(i));
+
+    swapBuffers(0.0f);
 }
 
 void Lightmap::computeDirectLights(const std::vector<LightState> &lights)
+{
+    computeDirectLights(lights, directLight);
+}
+
+void Lightmap::computeDirectLights(const std::vector<LightState> &lights, RadianceBuffer &result)
 {
     // Direct lights
-    for(auto &patch : patches)
+    result.resize(patches.size());
+    for(size_t i = 0; i < patches.size(); ++i)
     {
-        glm::vec4 lightColor;
+        auto &patch = patches[i];
+        glm::vec3 lightColor;
         for(auto &light : lights)
         {
             if(light.position.w == 1.0)
@@ -208,141 +437,1088 @@ void Lightmap::computeDirectLights(const std::vector<LightState> &lights)
 
                 auto lightAttenuation = spotFactor / (light.attenuation.x + light.attenuation.y*lightDistance + light.attenuation.z*(lightDistance*lightDistance));
                 auto lightAmount = NdotL*lightAttenuation;
-                lightColor += lightAmount*light.intensity;
+                lightColor += lightAmount*glm::vec3(light.intensity);
             }
         }
 
-        directLightBuffer[patch.texelIndex] = lightColor;
+        result.set(i, lightColor);
     }
 }
 
 void Lightmap::computeIndirectLightBounce()
 {
-    auto columns = patches.size();
-#if 0
-    // Parallel iterative bounce
-    auto row = 0;
-    std::swap(oldIndirectLightBuffer, indirectLightBuffer);
-    memset(indirectLightBuffer, 0, sizeof(indirectLightBuffer[0])*width*height);
-    for(size_t i = 0; i < patches.size(); ++i, row += columns)
+    // Sequential iterative bounce. This is a sparse matrix-vector product
+    // over the transport links that is updated in place.
+    for(size_t i = 0; i < patches.size(); ++i)
     {
-        auto &sourcePatch = patches[i];
-        auto sourceNormalizationFactor = viewFactorsDen[i];
-
-        indirectLightBuffer[sourcePatch.texelIndex] += oldIndirectLightBuffer[sourcePatch.texelIndex]*sourceNormalizationFactor;
+        auto normalizationFactor = viewFactorsDen[i];
 
-        for(size_t j = i + 1; j < patches.size(); ++j)
+        float r = 0.0f, g = 0.0f, b = 0.0f;
+        auto rowEnd = viewFactors.rowEnd(i);
+        for(size_t k = viewFactors.rowBegin(i); k < rowEnd; ++k)
         {
-            auto &destPatch = patches[j];
-            auto destNormalizationFactor = viewFactorsDen[i];
+            auto j = viewFactors.columns[k];
+            auto factor = viewFactors.values[k];
+            r += (indirectLight.red[j] + directLight.red[j])*factor;
+            g += (indirectLight.green[j] + directLight.green[j])*factor;
+            b += (indirectLight.blue[j] + directLight.blue[j])*factor;
+        }
+
+        indirectLight.red[i] = r*normalizationFactor;
+        indirectLight.green[i] = g*normalizationFactor;
+        indirectLight.blue[i] = b*normalizationFactor;
+    }
+}
+
+void Lightmap::gatherTransport(const RadianceBuffer &emission, RadianceBuffer &result)
+{
+    // Every row only reads the emission, so the rows are independent and
+    // the result does not depend on the thread count.
+    result.resize(patches.size());
+    auto gatherRows = [&](size_t begin, size_t end) {
+        gatherTransportRows(gatherKernel, viewFactors, viewFactorsDen, emission, result, begin, end);
+    };
+
+    if(threadPool)
+        threadPool->parallelFor(patches.size(), GatherRowsPerChunk, gatherRows);
+    else
+        gatherRows(0, patches.size());
+}
 
-            size_t index = row + j;
-            auto factor = viewFactors[index];
+void Lightmap::gatherTransposedTransport(const RadianceBuffer &emission, RadianceBuffer &result)
+{
+    // T = D F, with D diagonal and F symmetric, so T^t x = F (D x).
+    scaledEmission.resize(patches.size());
+    for(size_t i = 0; i < patches.size(); ++i)
+    {
+        auto scale = viewFactorsDen[i];
+        scaledEmission.red[i] = emission.red[i]*scale;
+        scaledEmission.green[i] = emission.green[i]*scale;
+        scaledEmission.blue[i] = emission.blue[i]*scale;
+    }
 
-            auto sourceFactor = factor*sourceNormalizationFactor;
-            auto destFactor = factor*destNormalizationFactor;
+    unitRowScale.resize(patches.size(), 1.0f);
+    result.resize(patches.size());
+    auto gatherRows = [&](size_t begin, size_t end) {
+        gatherTransportRows(gatherKernel, viewFactors, unitRowScale, scaledEmission, result, begin, end);
+    };
+
+    if(threadPool)
+        threadPool->parallelFor(patches.size(), GatherRowsPerChunk, gatherRows);
+    else
+        gatherRows(0, patches.size());
+}
+
+void Lightmap::computeParallelIndirectLightBounce()
+{
+    emittedLight.setSum(directLight, indirectLight);
+    gatherTransport(emittedLight, indirectLight);
+}
 
-            indirectLightBuffer[sourcePatch.texelIndex] += (oldIndirectLightBuffer[destPatch.texelIndex] + directLightBuffer[destPatch.texelIndex])*sourceFactor;
-            indirectLightBuffer[destPatch.texelIndex] += (oldIndirectLightBuffer[sourcePatch.texelIndex] + directLightBuffer[sourcePatch.texelIndex])*destFactor;
+void Lightmap::computeRelaxedIndirectLightBounce()
+{
+    // Gauss-Seidel step, extrapolated by the relaxation factor.
+    auto omega = getRelaxationFactor();
+    for(size_t i = 0; i < patches.size(); ++i)
+    {
+        auto normalizationFactor = viewFactorsDen[i];
+
+        float r = 0.0f, g = 0.0f, b = 0.0f;
+        auto rowEnd = viewFactors.rowEnd(i);
+        for(size_t k = viewFactors.rowBegin(i); k < rowEnd; ++k)
+        {
+            auto j = viewFactors.columns[k];
+            auto factor = viewFactors.values[k];
+            r += (indirectLight.red[j] + directLight.red[j])*factor;
+            g += (indirectLight.green[j] + directLight.green[j])*factor;
+            b += (indirectLight.blue[j] + directLight.blue[j])*factor;
         }
+
+        indirectLight.red[i] += omega*(r*normalizationFactor - indirectLight.red[i]);
+        indirectLight.green[i] += omega*(g*normalizationFactor - indirectLight.green[i]);
+        indirectLight.blue[i] += omega*(b*normalizationFactor - indirectLight.blue[i]);
     }
-#else
-    // Sequential iterative bounce
-    auto row = 0;
-    for(size_t i = 0; i < patches.size(); ++i, row += columns)
+}
+
+void Lightmap::applyTransportSystem(const RadianceBuffer &x, RadianceBuffer &result, bool transposed)
+{
+    // The indirect light solves (I - T) x = T d.
+    if(transposed)
+        gatherTransposedTransport(x, result);
+    else
+        gatherTransport(x, result);
+    for(size_t i = 0; i < x.size(); ++i)
     {
-        auto &receivingPatch = patches[i];
-        auto &normalizationFactor = viewFactorsDen[i];
-        auto &dest = indirectLightBuffer[receivingPatch.texelIndex];
+        result.red[i] = x.red[i] - result.red[i];
+        result.green[i] = x.green[i] - result.green[i];
+        result.blue[i] = x.blue[i] - result.blue[i];
+    }
+}
+
+size_t Lightmap::solveIndirectLight(const RadianceBuffer &direct, RadianceBuffer &indirect, bool transposed)
+{
+    auto transportSystem = [this, transposed](const RadianceBuffer &x, RadianceBuffer &result) {
+        applyTransportSystem(x, result, transposed);
+    };
+
+    RadianceBuffer transportedDirect;
+    RadianceBuffer previousIndirect;
+    if(transposed)
+        gatherTransposedTransport(direct, transportedDirect);
+    else
+        gatherTransport(direct, transportedDirect);
+    indirect.resize(patches.size());
+    indirect.clear();
+
+    auto tolerance = getConvergenceTolerance();
+    BiCGStabSolver solver;
+    solver.restart(transportSystem, transportedDirect, indirect);
+    for(size_t i = 1; i <= MaxSolveIterations; ++i)
+    {
+        previousIndirect = indirect;
+        solver.iterate(transportSystem, indirect);
+        if(indirect.maxDifference(previousIndirect) <= tolerance)
+            return i;
+    }
+
+    return MaxSolveIterations;
+}
+
+void Lightmap::restartBiCGStab()
+{
+    gatherTransport(directLight, transportedDirectLight);
+    biCGStabSolver.restart([this](const RadianceBuffer &x, RadianceBuffer &result) {
+        applyTransportSystem(x, result);
+    }, transportedDirectLight, indirectLight);
+}
+
+void Lightmap::clearIndirectLight()
+{
+    indirectLight.clear();
+}
 
-        glm::vec4 value;
-        for(size_t j = 0; j < columns; ++j)
+void Lightmap::resetProgressiveRefinement()
+{
+    indirectLight.clear();
+    shotDirectLight.resize(patches.size());
+    shotDirectLight.clear();
+    unshotLight.assign(patches.size(), glm::vec3());
+}
+
+/**
+ * The differential area form factor between two patches without occlusion,
+ * or zero when they do not face each other. The area of the destination is
+ * in the denominator, so it stays bounded for close patches.
+ */
+static float computePatchFormFactor(const LightmapPatch &sourcePatch, const LightmapPatch &destPatch, float patchArea)
+{
+    if(closeTo(destPatch.position, sourcePatch.position))
+        return 0.0f;
+
+    auto patchVector = destPatch.position - sourcePatch.position;
+    auto distance2 = glm::dot(patchVector, patchVector);
+    auto patchDirection = patchVector / sqrtf(distance2);
+    auto destPatchVisibilityFactor = glm::dot(-patchDirection, destPatch.normal);
+    if(destPatchVisibilityFactor < 0)
+        return 0.0f;
+
+    auto sourcePatchVisibilityFactor = glm::dot(patchDirection, sourcePatch.normal);
+    if(sourcePatchVisibilityFactor < 0)
+        return 0.0f;
+
+    return destPatchVisibilityFactor*sourcePatchVisibilityFactor*patchArea / (float(M_PI)*distance2 + patchArea);
+}
+
+// The patches are grouped in blocks for finding the brightest unshot patch.
+static constexpr size_t PriorityBlockSize = 64;
+
+inline float unshotLightPriority(const glm::vec3 &unshot)
+{
+    return fabs(unshot.r) + fabs(unshot.g) + fabs(unshot.b);
+}
+
+void Lightmap::shootUnshotLight()
+{
+    // The system is linear, so a change on the direct light is injected as
+    // signed unshot light. This lets a light change converge from the current
+    // solution instead of starting from scratch.
+    std::vector<float> priorities(patches.size());
+    for(size_t i = 0; i < patches.size(); ++i)
+    {
+        auto direct = directLight.get(i);
+        unshotLight[i] += direct - shotDirectLight.get(i);
+        shotDirectLight.set(i, direct);
+        priorities[i] = unshotLightPriority(unshotLight[i]);
+    }
+
+    // A shot changes the priorities of all its receivers, so they are kept up
+    // to date with the maximum of every block of patches. Only the blocks
+    // whose maximum went down are searched again.
+    auto blockCount = (patches.size() + PriorityBlockSize - 1) / PriorityBlockSize;
+    std::vector<float> blockMaxima(blockCount, 0.0f);
+    std::vector<uint8_t> staleBlocks(blockCount, 1);
+
+    // Shoot from the patch with the most unshot light.
+    for(size_t shotCount = 0; shotCount < shotsPerProcess; ++shotCount)
+    {
+        size_t bestBlock = 0;
+        for(size_t block = 0; block < blockCount; ++block)
         {
-            auto &emitionPatch = patches[j];
-            auto &emition = indirectLightBuffer[emitionPatch.texelIndex];
+            if(staleBlocks[block])
+            {
+                auto begin = priorities.begin() + block*PriorityBlockSize;
+                auto end = priorities.begin() + std::min(patches.size(), (block + 1)*PriorityBlockSize);
+                blockMaxima[block] = *std::max_element(begin, end);
+                staleBlocks[block] = 0;
+            }
 
-            auto factor = viewFactors[row + j]*normalizationFactor;
-            value += (emition + directLightBuffer[emitionPatch.texelIndex])*factor;
+            if(blockMaxima[block] > blockMaxima[bestBlock])
+                bestBlock = block;
         }
 
-        dest = value;
+        if(blockCount == 0 || blockMaxima[bestBlock] <= FloatEpsilon)
+            break;
+
+        auto blockBegin = priorities.begin() + bestBlock*PriorityBlockSize;
+        auto blockEnd = priorities.begin() + std::min(patches.size(), (bestBlock + 1)*PriorityBlockSize);
+        auto sourceIndex = size_t(std::max_element(blockBegin, blockEnd) - priorities.begin());
+        auto shotLight = unshotLight[sourceIndex];
+        unshotLight[sourceIndex] = glm::vec3();
+        priorities[sourceIndex] = 0.0f;
+        staleBlocks[bestBlock] = 1;
+
+        // The transport is symmetric, so the row of the source holds the
+        // links towards all of its receivers.
+        auto rowEnd = viewFactors.rowEnd(sourceIndex);
+        for(size_t k = viewFactors.rowBegin(sourceIndex); k < rowEnd; ++k)
+        {
+            auto receiverIndex = viewFactors.columns[k];
+            auto receivedLight = shotLight*(viewFactors.values[k]*viewFactorsDen[receiverIndex]);
+            indirectLight.add(receiverIndex, receivedLight);
+            unshotLight[receiverIndex] += receivedLight;
+
+            // The signed light of a light change can lower a priority.
+            auto block = receiverIndex / PriorityBlockSize;
+            auto oldPriority = priorities[receiverIndex];
+            auto priority = unshotLightPriority(unshotLight[receiverIndex]);
+            priorities[receiverIndex] = priority;
+            if(priority >= blockMaxima[block])
+                blockMaxima[block] = priority;
+            else if(oldPriority >= blockMaxima[block])
+                staleBlocks[block] = 1;
+        }
     }
-#endif
+}
 
+float Lightmap::computeMaxUnshotLight()
+{
+    float result = 0.0f;
+    for(auto &unshot : unshotLight)
+        result = std::max(result, std::max(fabsf(unshot.r), std::max(fabsf(unshot.g), fabsf(unshot.b))));
+    return result;
 }
 
 void Lightmap::computeRadiosityFactors()
 {
-    // TODO: Use sparse matrices.
-    viewFactors.resize(patches.size()*patches.size());
-    auto columns = patches.size();
-    auto occlusionCount = 0;
-    auto visibleCount = 0;
+    // Only the non-zero links of the upper triangle are collected, sorted by
+    // row and column. The symmetric matrix is built from them afterwards.
+    std::vector<SparseMatrixEntry> links;
+    size_t prunedCount = 0;
+    double prunedFormFactorSum = 0.0;
+    if(formFactorMethod == FormFactorMethod::Hemicube)
+    {
+        HemicubeFormFactors hemicube(this, hemicubeResolution);
+        hemicube.computeLinks(links);
+        prunedCount = hemicube.getPrunedLinkCount();
+        prunedFormFactorSum = hemicube.getPrunedFormFactorSum();
+
+        // The hemicube only rasterizes the quads of this lightmap, so the
+        // other instances of the scene are tested with a ray per link.
+        if(sceneOcclusion)
+        {
+            links.erase(std::remove_if(links.begin(), links.end(), [&](const SparseMatrixEntry &link) {
+                return link.row != link.column && isRayOccludedByScene(patches[link.row].position, patches[link.column].position);
+            }), links.end());
+        }
+    }
+    else
+    {
+        computePairwiseLinks(links, prunedCount, prunedFormFactorSum);
+    }
+
+    // The links are symmetric, so the sums of the upper triangle are
+    // proportional to the sums of the whole matrix.
+    double formFactorSum = prunedFormFactorSum;
+    for(auto &link : links)
+        formFactorSum += link.value;
+    prunedFormFactorFraction = formFactorSum > 0.0 ? prunedFormFactorSum / formFactorSum : 0.0;
+
+    viewFactors.buildSymmetricFromUpperTriangle(patches.size(), links);
+    viewFactors.buildColumnTiles(transportColumnTileSize);
+    links.clear();
+    links.shrink_to_fit();
+
+    buildVisibilityFromTransport();
+    updateNormalizationFactors();
+    printf("Pruned links: %zu below %g (%.3f%% of the form factor sum)\n", prunedCount, formFactorEpsilon,
+        prunedFormFactorFraction*100.0);
+    printf("Transport links: %zu (%zu KB)\n", viewFactors.getNonZeroCount(), viewFactors.getMemorySize() / 1024);
+}
+
+void Lightmap::computePairwiseLinks(std::vector<SparseMatrixEntry> &links, size_t &prunedCount, double &prunedFormFactorSum)
+{
+    // Every row has its own list, so the rows are computed in parallel
+    // without sharing any output.
+    std::vector<std::vector<SparseMatrixEntry>> rowLinks(patches.size());
+    std::vector<double> rowPrunedFormFactorSums(patches.size(), 0.0);
+    std::atomic<size_t> occlusionCount(0);
+    std::atomic<size_t> visibleCount(0);
+    std::atomic<size_t> prunedLinkCount(0);
+    std::atomic<size_t> rayCount(0);
+
+    // The patch pairs of the fully visible and fully occluded surface tiles
+    // do not need rays, and the others only test a few candidate quads. The
+    // Monte Carlo samples cover the whole texels, so their tiles are padded
+    // by half a texel.
+    auto monteCarlo = formFactorMethod == FormFactorMethod::MonteCarlo;
+    auto classification = surfaceVisibilityClassification || monteCarlo;
+    SurfaceVisibility surfaceVisibility(SurfaceVisibility::DefaultTileSize, monteCarlo ? texelScale*0.5f : 0.0f);
+    if(classification)
+        surfaceVisibility.build(*this);
+
+    std::unique_ptr<MonteCarloFormFactors> monteCarloFormFactors;
+    if(monteCarlo)
+    {
+        monteCarloFormFactors.reset(new MonteCarloFormFactors(*this, surfaceVisibility, formFactorSampleBudget));
+        printf("Monte Carlo form factors: %zu samples per partial pair for %zu partial pairs\n",
+            monteCarloFormFactors->getSamplesPerPair(), surfaceVisibility.getPartialPatchPairCount());
+    }
+
+    // The destinations of a row are only searched in the leaf clusters that
+    // may face the leaf of its source. Without the culling, a single cluster
+    // holds every patch.
+    PatchClusterTree clusterTree;
+    clusterTree.build(patches, patchClusterCulling ? PatchClusterTree::DefaultLeafSize : patches.size());
+    std::atomic<size_t> facingLeafCount(0);
+
+    // All the patches have the area of a texel, so the form factors are
+    // symmetric.
+    auto patchArea = texelScale*texelScale;
+
+    auto computeRows = [&](size_t begin, size_t end) {
+        std::vector<uint32_t> destinations;
+        std::vector<float> formFactors;
+        std::vector<uint8_t> occluded;
+        std::vector<uint32_t> rayDestinations;
+        std::vector<uint32_t> rayIndices;
+        std::vector<uint8_t> rayOccluded;
+        size_t rowsOcclusionCount = 0;
+        size_t rowsVisibleCount = 0;
+        size_t rowsPrunedCount = 0;
+        size_t rowsRayCount = 0;
+        size_t rowsFacingLeafCount = 0;
+        std::vector<uint32_t> facingLeaves;
+        uint32_t sourceLeaf = ~uint32_t(0);
+        for(size_t i = begin; i < end; ++i)
+        {
+            auto &sourcePatch = patches[i];
+            auto &row = rowLinks[i];
+
+            // The consecutive rows usually share their source leaf.
+            auto leaf = clusterTree.findLeaf(i);
+            if(leaf != sourceLeaf)
+            {
+                sourceLeaf = leaf;
+                facingLeaves.clear();
+                clusterTree.findFacingLeaves(clusterTree.getNode(leaf), i + 1, facingLeaves);
+                rowsFacingLeafCount += facingLeaves.size();
+            }
+
+            destinations.clear();
+            formFactors.clear();
+            rayDestinations.clear();
+            rayIndices.clear();
+            // The source patch is a cluster of its own, with a single normal.
+            PatchCluster sourceCluster;
+            sourceCluster.bounds = Box3(sourcePatch.position, sourcePatch.position);
+            sourceCluster.coneAxis = sourcePatch.normal;
+            sourceCluster.coneSpread = 0.0f;
+            for(auto facingLeaf : facingLeaves)
+            {
+                auto &destCluster = clusterTree.getNode(facingLeaf);
+                if(patchClusterCulling && !PatchClusterTree::canFace(sourceCluster, destCluster))
+                    continue;
+
+                for(size_t j = std::max(size_t(destCluster.begin), i + 1); j < destCluster.end; ++j)
+                {
+                    auto &destPatch = patches[j];
+
+                    auto formFactor = computePatchFormFactor(sourcePatch, destPatch, patchArea);
+                    if(formFactor <= 0.0f)
+                        continue;
+
+                    // The links that are too weak are not worth their rays. They
+                    // are accounted as visible, so the pruned sum is an upper
+                    // bound.
+                    if(formFactor < formFactorEpsilon)
+                    {
+                        ++rowsPrunedCount;
+                        rowPrunedFormFactorSums[i] += formFactor;
+                        continue;
+                    }
+
+                    auto pairVisibility = classification ?
+                        surfaceVisibility.getPatchPair(i, j) : SurfacePairVisibility::Partial;
+                    if(pairVisibility == SurfacePairVisibility::NotFacing)
+                        continue;
+
+                    if(pairVisibility == SurfacePairVisibility::Occluded)
+                    {
+                        ++rowsOcclusionCount;
+                        continue;
+                    }
+
+                    // The partial pairs test the occluder candidates of their
+                    // tiles. Without the classification, every pair is traced
+                    // through the whole scene below. The Monte Carlo samples
+                    // replace the single centre ray.
+                    if(pairVisibility == SurfacePairVisibility::Partial && monteCarlo)
+                    {
+                        formFactor = monteCarloFormFactors->estimate(i, j, rowsRayCount);
+                        if(formFactor <= 0.0f)
+                        {
+                            ++rowsOcclusionCount;
+                            continue;
+                        }
+                    }
+                    else if(pairVisibility == SurfacePairVisibility::Partial && classification)
+                    {
+                        ++rowsRayCount;
+                        if(surfaceVisibility.isRayOccluded(Ray::fromEndPoints(sourcePatch.position, destPatch.position), i, j))
+                        {
+                            ++rowsOcclusionCount;
+                            continue;
+                        }
+                    }
+
+                    destinations.push_back(j);
+                    formFactors.push_back(formFactor);
+                    if(pairVisibility == SurfacePairVisibility::Partial && !classification)
+                    {
+                        rayDestinations.push_back(j);
+                        rayIndices.push_back(destinations.size() - 1);
+                    }
+                }
+            }
+
+            // Discard the patches that are occluded
+            computePatchOcclusion(i, rayDestinations, rayOccluded);
+            occluded.assign(destinations.size(), 0);
+            for(size_t k = 0; k < rayIndices.size(); ++k)
+                occluded[rayIndices[k]] = rayOccluded[k];
+            rowsRayCount += rayDestinations.size();
+
+            // The classification only knows the quads of this lightmap.
+            rowsRayCount += computeSceneOcclusion(i, destinations, occluded);
+
+            for(size_t k = 0; k < destinations.size(); ++k)
+            {
+                if(occluded[k])
+                {
+                    ++rowsOcclusionCount;
+                    continue;
+                }
+
+                ++rowsVisibleCount;
+                row.push_back(SparseMatrixEntry(i, destinations[k], formFactors[k]));
+            }
+        }
+
+        occlusionCount += rowsOcclusionCount;
+        visibleCount += rowsVisibleCount;
+        prunedLinkCount += rowsPrunedCount;
+        rayCount += rowsRayCount;
+        facingLeafCount += rowsFacingLeafCount;
+    };
+
+    // The rows get shorter as i grows, so the chunks are balanced by work
+    // stealing.
+    if(threadPool)
+        threadPool->parallelForWorkStealing(patches.size(), FormFactorRowsPerChunk, computeRows);
+    else
+        computeRows(0, patches.size());
+
+    size_t linkCount = 0;
+    for(auto &row : rowLinks)
+        linkCount += row.size();
+
+    links.clear();
+    links.reserve(linkCount);
+    for(auto &row : rowLinks)
+    {
+        links.insert(links.end(), row.begin(), row.end());
+        row.clear();
+        row.shrink_to_fit();
+    }
+
+    prunedCount = prunedLinkCount;
+    prunedFormFactorSum = 0.0;
+    for(auto sum : rowPrunedFormFactorSums)
+        prunedFormFactorSum += sum;
+
+    printf("Patch clusters: %zu leaves, %zu facing leaves visited\n", clusterTree.getLeafCount(), facingLeafCount.load());
+    printf("Visible: %zu Occluded patches: %zu Rays: %zu\n", visibleCount.load(), occlusionCount.load(), rayCount.load());
+}
+
+void Lightmap::buildRadiosityFactors()
+{
+    if(formFactorCacheDirectory.empty())
+    {
+        computeRadiosityFactors();
+        return;
+    }
+
+    FormFactorCache cache(formFactorCacheDirectory);
+    auto key = FormFactorCache::computeKey(*this);
+    if(cache.load(key, texelScale, patches.size(), viewFactors))
+    {
+        viewFactors.buildColumnTiles(transportColumnTileSize);
+        buildVisibilityFromTransport();
+        updateNormalizationFactors();
+        printf("Loaded the form factors from '%s': %zu links\n", cache.getFileName(key).c_str(), viewFactors.getNonZeroCount());
+        return;
+    }
+
+    computeRadiosityFactors();
+    cache.store(key, texelScale, viewFactors);
+}
+
+void Lightmap::moveQuadSurfaces(const std::vector<uint32_t> &quadIndices, const glm::mat4 &transform)
+{
+    // The transform is rigid, so the quads keep their shape and their
+    // patches keep their area.
+    auto rotation = glm::mat3(transform);
+    std::vector<Box3> changedRegions;
+    std::vector<uint8_t> movedQuads(quadSurfaces.size(), 0);
+    for(auto index : quadIndices)
+    {
+        if(index >= quadSurfaces.size() || movedQuads[index])
+            continue;
+
+        auto &quad = quadSurfaces[index];
+        changedRegions.push_back(quad.computeBounds());
+
+        glm::vec3 positions[4];
+        for(int i = 0; i < 4; ++i)
+            positions[i] = glm::vec3(transform*glm::vec4(quad.vertexPosition(i), 1.0f));
+
+        quad.normal = glm::normalize(rotation*quad.normal);
+        quad.tangent = glm::normalize(rotation*quad.tangent);
+        quad.bitangent = glm::normalize(rotation*quad.bitangent);
+        quad.distance = 0.0f;
+        for(int i = 0; i < 4; ++i)
+        {
+            quad.distance += glm::dot(quad.normal, positions[i])*0.25f;
+            quad.vertices[i] = glm::vec2(glm::dot(quad.tangent, positions[i]), glm::dot(quad.bitangent, positions[i]));
+        }
+
+        changedRegions.push_back(quad.computeBounds());
+        movedQuads[index] = 1;
+    }
 
+    std::vector<uint8_t> movedPatches(patches.size(), 0);
     for(size_t i = 0; i < patches.size(); ++i)
     {
-        auto &sourcePatch = patches[i];
-        viewFactors[i*columns + i]  = 1.0f;
+        auto &patch = patches[i];
+        if(!movedQuads[patch.surfaceIndex])
+            continue;
+
+        patch.position = glm::vec3(transform*glm::vec4(patch.position, 1.0f));
+        patch.normal = quadSurfaces[patch.surfaceIndex].normal;
+        movedPatches[i] = 1;
+    }
+
+    applyQuadSurfaceChanges(changedRegions, movedPatches);
+}
+
+size_t Lightmap::addOccluderQuadSurfaces(const std::vector<LightmapCompactQuadSurface> &occluders)
+{
+    auto firstIndex = quadSurfaces.size();
+    std::vector<Box3> changedRegions;
+    for(auto &occluder : occluders)
+    {
+        quadSurfaces.push_back(occluder);
+        changedRegions.push_back(occluder.computeBounds());
+    }
 
-        for(size_t j = i + 1; j < patches.size(); ++j)
+    applyQuadSurfaceChanges(changedRegions, std::vector<uint8_t> (patches.size(), 0));
+    return firstIndex;
+}
+
+void Lightmap::removeOccluderQuadSurfaces(std::vector<uint32_t> quadIndices)
+{
+    std::vector<uint8_t> lightmapped(quadSurfaces.size(), 0);
+    for(auto &patch : patches)
+        lightmapped[patch.surfaceIndex] = 1;
+
+    // The indices are removed from the last one, so the others stay valid.
+    std::sort(quadIndices.begin(), quadIndices.end());
+    quadIndices.erase(std::unique(quadIndices.begin(), quadIndices.end()), quadIndices.end());
+    std::vector<Box3> changedRegions;
+    for(auto it = quadIndices.rbegin(); it != quadIndices.rend(); ++it)
+    {
+        auto index = *it;
+        if(index >= quadSurfaces.size())
+            continue;
+        if(lightmapped[index])
         {
-            auto &destPatch = patches[j];
+            printf("Quad surface %u has lightmap patches, so it is not removed\n", index);
+            continue;
+        }
 
-            // Compute the visibility factor
-            if(closeTo(destPatch.position, sourcePatch.position))
-                continue;
+        changedRegions.push_back(quadSurfaces[index].computeBounds());
+        quadSurfaces.erase(quadSurfaces.begin() + index);
+        for(auto &patch : patches)
+        {
+            if(patch.surfaceIndex > index)
+                --patch.surfaceIndex;
+        }
+    }
 
-            auto patchDirection = glm::normalize(destPatch.position - sourcePatch.position);
-            auto destPatchVisibilityFactor = glm::dot(-patchDirection, destPatch.normal);
-            if(destPatchVisibilityFactor < 0)
-                continue;
+    applyQuadSurfaceChanges(changedRegions, std::vector<uint8_t> (patches.size(), 0));
+}
 
-            auto sourcePatchVisibilityFactor = glm::dot(patchDirection, sourcePatch.normal);
-            if(sourcePatchVisibilityFactor < 0)
-                continue;
+void Lightmap::applyQuadSurfaceChanges(const std::vector<Box3> &changedRegions, const std::vector<uint8_t> &movedPatches)
+{
+    buildOcclusionStructures();
+    updateRadiosityFactors(changedRegions, movedPatches);
 
-            auto visibilityFactor = destPatchVisibilityFactor*sourcePatchVisibilityFactor;
+    // The other lightmaps of the scene see the new quads too.
+    if(sceneOcclusion)
+        sceneOcclusion->updateLightmapQuads(this, changedRegions);
+}
 
-            // Discard the patches that are occluded
-            if(isRayOccluded(sourcePatch.position, sourcePatch.surfaceIndex, destPatch.position, destPatch.surfaceIndex))
+void Lightmap::setSceneOcclusion(const SceneOcclusionPtr &newSceneOcclusion, size_t newSceneInstance)
+{
+    sceneOcclusion = newSceneOcclusion;
+    sceneInstance = newSceneInstance;
+
+    // The scene shares the BVH, whatever the backend is.
+    buildOcclusionBackend();
+
+    // The other objects may occlude anything, so the links are built again.
+    {
+        std::unique_lock<std::mutex> l(mutex);
+        processedLights.clear();
+    }
+    viewFactors.clear();
+    viewFactorsDen.clear();
+    visibilityMatrix.reset(0);
+    hierarchicalRadiosity.reset();
+    discardSolvedTransport();
+}
+
+void Lightmap::updateSceneOcclusion(const std::vector<Box3> &changedRegions)
+{
+    updateRadiosityFactors(changedRegions, std::vector<uint8_t> (patches.size(), 0));
+}
+
+static bool segmentIntersectsBox(const glm::vec3 &start, const glm::vec3 &end, const Box3 &box)
+{
+    auto delta = end - start;
+    auto minDistance = 0.0f;
+    auto maxDistance = 1.0f;
+    for(int axis = 0; axis < 3; ++axis)
+    {
+        if(delta[axis] == 0.0f)
+        {
+            if(start[axis] < box.min[axis] || start[axis] > box.max[axis])
+                return false;
+            continue;
+        }
+
+        auto first = (box.min[axis] - start[axis]) / delta[axis];
+        auto second = (box.max[axis] - start[axis]) / delta[axis];
+        minDistance = std::max(minDistance, std::min(first, second));
+        maxDistance = std::min(maxDistance, std::max(first, second));
+        if(minDistance > maxDistance)
+            return false;
+    }
+
+    return true;
+}
+
+void Lightmap::updateRadiosityFactors(const std::vector<Box3> &changedRegions, const std::vector<uint8_t> &movedPatches)
+{
+    // The direct light changes with the geometry.
+    {
+        std::unique_lock<std::mutex> l(mutex);
+        processedLights.clear();
+    }
+    hierarchicalRadiosity.reset();
+    discardSolvedTransport();
+
+    if(!hasRadiosityFactors())
+        return;
+
+    // Only the pairwise rays give a link from a single pair. The hemicube
+    // and the Monte Carlo estimates are computed again for the whole scene.
+    if(formFactorMethod != FormFactorMethod::PairwiseRays)
+    {
+        computeRadiosityFactors();
+        return;
+    }
+
+    // The regions are padded, since the rays are tested with a tolerance.
+    std::vector<Box3> regions(changedRegions);
+    for(auto &region : regions)
+    {
+        region.min -= FloatEpsilon;
+        region.max += FloatEpsilon;
+    }
+
+    // A pair of leaf clusters is only visited when the shaft between them
+    // enters a changed region, or when one of them has moved patches.
+    PatchClusterTree clusterTree;
+    clusterTree.build(patches);
+    std::vector<uint8_t> movedLeaves(clusterTree.getLeafCount(), 0);
+    for(size_t i = 0; i < clusterTree.getLeafCount(); ++i)
+    {
+        auto &leaf = clusterTree.getNode(clusterTree.getLeaf(i));
+        for(auto j = leaf.begin; j < leaf.end && !movedLeaves[i]; ++j)
+            movedLeaves[i] = movedPatches[j];
+    }
+
+    // The tested pairs go through the same visibility test as a full build,
+    // so the patched links are the links of a rebuild.
+    SurfaceVisibility surfaceVisibility;
+    if(surfaceVisibilityClassification)
+        surfaceVisibility.build(*this);
+
+    // The new values of the pairs that were tested, zero for the removed
+    // links. Every row only has the pairs of the upper triangle.
+    std::vector<std::vector<SparseMatrixEntry>> rowUpdates(patches.size());
+    std::atomic<size_t> testedPairCount(0);
+    std::atomic<size_t> rayCount(0);
+    auto patchArea = texelScale*texelScale;
+    auto updateRows = [&](size_t begin, size_t end) {
+        std::vector<uint32_t> touchedLeaves;
+        std::vector<uint32_t> destinations;
+        std::vector<float> formFactors;
+        std::vector<uint8_t> occluded;
+        std::vector<uint32_t> rayDestinations;
+        std::vector<uint32_t> rayIndices;
+        std::vector<uint8_t> rayOccluded;
+        size_t sourceLeafIndex = ~size_t(0);
+        size_t rowsTestedPairCount = 0;
+        size_t rowsRayCount = 0;
+        for(size_t i = begin; i < end; ++i)
+        {
+            auto &sourcePatch = patches[i];
+            auto leafIndex = clusterTree.findLeafIndex(i);
+            if(leafIndex != sourceLeafIndex)
             {
-                ++occlusionCount;
-                continue;
+                sourceLeafIndex = leafIndex;
+                touchedLeaves.clear();
+                auto &sourceLeaf = clusterTree.getNode(clusterTree.getLeaf(leafIndex));
+                for(size_t k = leafIndex; k < clusterTree.getLeafCount(); ++k)
+                {
+                    auto &leaf = clusterTree.getNode(clusterTree.getLeaf(k));
+                    auto touched = movedLeaves[leafIndex] || movedLeaves[k];
+                    if(!touched)
+                    {
+                        Shaft shaft;
+                        shaft.build(sourceLeaf.bounds, leaf.bounds);
+                        for(size_t r = 0; r < regions.size() && !touched; ++r)
+                            touched = !shaft.isBoxOutside(regions[r]);
+                    }
+
+                    if(touched)
+                        touchedLeaves.push_back(k);
+                }
             }
 
-            ++visibleCount;
-            viewFactors[i*columns + j] = viewFactors[j*columns + i] = visibilityFactor;
+            auto &updates = rowUpdates[i];
+            destinations.clear();
+            formFactors.clear();
+            rayDestinations.clear();
+            rayIndices.clear();
+            for(auto k : touchedLeaves)
+            {
+                auto &leaf = clusterTree.getNode(clusterTree.getLeaf(k));
+                for(size_t j = std::max(size_t(leaf.begin), i + 1); j < leaf.end; ++j)
+                {
+                    auto &destPatch = patches[j];
+                    auto affected = movedPatches[i] || movedPatches[j];
+                    for(size_t r = 0; r < regions.size() && !affected; ++r)
+                        affected = segmentIntersectsBox(sourcePatch.position, destPatch.position, regions[r]);
+                    if(!affected)
+                        continue;
+
+                    ++rowsTestedPairCount;
+                    updates.push_back(SparseMatrixEntry(i, j, 0.0f));
+                    auto formFactor = computePatchFormFactor(sourcePatch, destPatch, patchArea);
+                    if(formFactor <= 0.0f || formFactor < formFactorEpsilon)
+                        continue;
+
+                    auto pairVisibility = surfaceVisibilityClassification ?
+                        surfaceVisibility.getPatchPair(i, j) : SurfacePairVisibility::Partial;
+                    if(pairVisibility == SurfacePairVisibility::NotFacing || pairVisibility == SurfacePairVisibility::Occluded)
+                        continue;
+
+                    if(pairVisibility == SurfacePairVisibility::Partial && surfaceVisibilityClassification)
+                    {
+                        ++rowsRayCount;
+                        if(surfaceVisibility.isRayOccluded(Ray::fromEndPoints(sourcePatch.position, destPatch.position), i, j))
+                            continue;
+                    }
+
+                    destinations.push_back(j);
+                    formFactors.push_back(formFactor);
+                    if(pairVisibility == SurfacePairVisibility::Partial && !surfaceVisibilityClassification)
+                    {
+                        rayDestinations.push_back(j);
+                        rayIndices.push_back(destinations.size() - 1);
+                    }
+                }
+            }
+
+            computePatchOcclusion(i, rayDestinations, rayOccluded);
+            occluded.assign(destinations.size(), 0);
+            for(size_t k = 0; k < rayIndices.size(); ++k)
+                occluded[rayIndices[k]] = rayOccluded[k];
+            rowsRayCount += rayDestinations.size();
+            rowsRayCount += computeSceneOcclusion(i, destinations, occluded);
+
+            // Both lists are sorted by column.
+            size_t updateIndex = 0;
+            for(size_t k = 0; k < destinations.size(); ++k)
+            {
+                while(updates[updateIndex].column != destinations[k])
+                    ++updateIndex;
+                if(!occluded[k])
+                    updates[updateIndex].value = formFactors[k];
+            }
         }
+
+        testedPairCount += rowsTestedPairCount;
+        rayCount += rowsRayCount;
+    };
+
+    if(threadPool)
+        threadPool->parallelForWorkStealing(patches.size(), FormFactorRowsPerChunk, updateRows);
+    else
+        updateRows(0, patches.size());
+
+    // Patch the tested pairs in both triangles.
+    viewFactors.updateSymmetricEntries(rowUpdates);
+    viewFactors.buildColumnTiles(transportColumnTileSize);
+    for(auto &updates : rowUpdates)
+    {
+        for(auto &update : updates)
+            visibilityMatrix.set(update.row, update.column, update.value > 0.0f);
     }
 
-    // Compute the view factor normalization constants
-    size_t rowStart = 0;
+    updateNormalizationFactors();
+    printf("Updated links: %zu pairs tested, %zu rays, %zu transport links\n", testedPairCount.load(), rayCount.load(),
+        viewFactors.getNonZeroCount());
+}
+
+void Lightmap::rebuildTransportFromVisibility()
+{
+    if(visibilityMatrix.getPatchCount() != patches.size())
+        return;
+
+    // The bits do not know the pairs that were pruned before their rays.
+    if(formFactorEpsilon < visibilityEpsilon)
+    {
+        printf("The form factor epsilon %g is below the visibility epsilon %g, computing the form factors again\n",
+            formFactorEpsilon, visibilityEpsilon);
+        computeRadiosityFactors();
+        discardSolvedTransport();
+        return;
+    }
+
+    // A single pass over the visible pairs, in the order of the links.
+    std::vector<SparseMatrixEntry> links;
+    links.reserve(visibilityMatrix.getVisibleCount());
+    auto patchArea = texelScale*texelScale;
+    for(size_t i = 0; i < patches.size(); ++i)
+    {
+        visibilityMatrix.forEachVisibleAfter(i, [&](size_t j) {
+            auto formFactor = computePatchFormFactor(patches[i], patches[j], patchArea);
+            if(formFactor > 0.0f && formFactor >= formFactorEpsilon)
+                links.push_back(SparseMatrixEntry(i, j, formFactor));
+        });
+    }
+
+    viewFactors.buildSymmetricFromUpperTriangle(patches.size(), links);
+    viewFactors.buildColumnTiles(transportColumnTileSize);
+    updateNormalizationFactors();
+    discardSolvedTransport();
+    printf("Rebuilt links from the visibility: %zu visible pairs, %zu transport links\n", visibilityMatrix.getVisibleCount(),
+        viewFactors.getNonZeroCount());
+}
+
+void Lightmap::buildVisibilityFromTransport()
+{
+    visibilityMatrix.reset(patches.size());
+    visibilityEpsilon = formFactorEpsilon;
+    for(size_t i = 0; i < patches.size(); ++i)
+    {
+        for(size_t k = viewFactors.rowBegin(i); k < viewFactors.rowEnd(i); ++k)
+        {
+            if(viewFactors.columns[k] > i)
+                visibilityMatrix.set(i, viewFactors.columns[k], true);
+        }
+    }
+}
+
+void Lightmap::discardSolvedTransport()
+{
+    // Everything that was solved with the previous links is stale.
+    {
+        std::unique_lock<std::mutex> l(mutex);
+        converged = false;
+    }
+    if(lightResponseCache)
+        lightResponseCache->clear();
+    lowRankTransport.reset();
+    if(activeSolver == RadiositySolver::ProgressiveRefinement)
+        resetProgressiveRefinement();
+}
+
+void Lightmap::updateNormalizationFactors()
+{
+    // The form factors are physical, so the rows reflect what they sum to.
+    // The energy of the pruned links and of the open directions is lost, like
+    // in the hierarchical solver. Only the rows whose discretization sums
+    // above one are scaled down, so no patch reflects more than it receives.
     viewFactorsDen.resize(patches.size());
-    for(size_t i = 0; i < patches.size(); ++i, rowStart += columns)
+    for(size_t i = 0; i < patches.size(); ++i)
+    {
+        auto rowSum = viewFactors.rowSum(i);
+        viewFactorsDen[i] = rowSum > 1.0f ? activeReflectivity / rowSum : activeReflectivity;
+    }
+}
+
+void Lightmap::computePatchOcclusion(size_t sourceIndex, const std::vector<uint32_t> &destinations, std::vector<uint8_t> &occluded)
+{
+    auto &sourcePatch = patches[sourceIndex];
+    occluded.assign(destinations.size(), 0);
+    if(!occlusionRayPackets || occlusionBackend != OcclusionBackend::BVH || !quadSurfaceBVH)
+    {
+        for(size_t k = 0; k < destinations.size(); ++k)
+        {
+            auto &destPatch = patches[destinations[k]];
+            occluded[k] = isRayOccludedByQuads(Ray::fromEndPoints(sourcePatch.position, destPatch.position),
+                sourcePatch.surfaceIndex, destPatch.surfaceIndex);
+        }
+        return;
+    }
+
+    // All the rays start on the source patch. Grouping them by direction
+    // octant gives coherent packets. The destinations are in patch order, so
+    // a counting sort also keeps the rays of a surface together.
+    uint32_t octantOffsets[9] = {};
+    std::vector<uint8_t> octants(destinations.size());
+    for(size_t k = 0; k < destinations.size(); ++k)
+    {
+        octants[k] = directionOctant(patches[destinations[k]].position - sourcePatch.position);
+        ++octantOffsets[octants[k] + 1];
+    }
+
+    for(size_t octant = 0; octant < 8; ++octant)
+        octantOffsets[octant + 1] += octantOffsets[octant];
+
+    std::vector<uint32_t> rayOrder(destinations.size());
+    uint32_t octantCursors[8];
+    std::copy(octantOffsets, octantOffsets + 8, octantCursors);
+    for(size_t k = 0; k < destinations.size(); ++k)
+        rayOrder[octantCursors[octants[k]]++] = k;
+
+    RayPacket packet;
+    uint32_t packetRays[RayPacket::MaxSize];
+    auto tracePacket = [&]() {
+        auto occludedMask = quadSurfaceBVH->computeOccludedRays(packet);
+        for(size_t i = 0; i < packet.size; ++i)
+            occluded[packetRays[i]] = (occludedMask >> i) & 1;
+        packet.clear();
+    };
+
+    for(size_t octant = 0; octant < 8; ++octant)
     {
-        float viewFactorSum = 0;
-        for(size_t j = 0; j < columns; ++j)
-            viewFactorSum += viewFactors[rowStart + j];
-        viewFactorsDen[i] = Reflectivity / viewFactorSum;
+        // A packet does not cross octants.
+        for(size_t k = octantOffsets[octant]; k < octantOffsets[octant + 1]; ++k)
+        {
+            if(packet.isFull())
+                tracePacket();
+
+            auto rayIndex = rayOrder[k];
+            auto &destPatch = patches[destinations[rayIndex]];
+            packetRays[packet.size] = rayIndex;
+            packet.add(Ray::fromEndPoints(sourcePatch.position, destPatch.position), sourcePatch.surfaceIndex, destPatch.surfaceIndex);
+        }
+
+        if(packet.size > 0)
+            tracePacket();
     }
+}
+
+size_t Lightmap::computeSceneOcclusion(size_t sourceIndex, const std::vector<uint32_t> &destinations, std::vector<uint8_t> &occluded)
+{
+    if(!sceneOcclusion)
+        return 0;
+
+    size_t rayCount = 0;
+    for(size_t k = 0; k < destinations.size(); ++k)
+    {
+        if(occluded[k])
+            continue;
 
-    printf("Visible: %d Occluded patches: %d\n", visibleCount, occlusionCount);
-    auto f = fopen("radFactors.bin", "w");
-    fwrite(&viewFactors[0], 4*viewFactors.size(), 1, f);
-    fclose(f);
+        ++rayCount;
+        occluded[k] = isRayOccludedByScene(patches[sourceIndex].position, patches[destinations[k]].position);
+    }
+
+    return rayCount;
 }
 
 bool Lightmap::isRayOccluded(glm::vec3 startPoint, size_t startSurfaceIndex,
     glm::vec3 endPoint, size_t endSurfaceIndex)
 {
-    auto ray = Ray::fromEndPoints(startPoint, endPoint);
+    return isRayOccludedByQuads(Ray::fromEndPoints(startPoint, endPoint), startSurfaceIndex, endSurfaceIndex) ||
+        isRayOccludedByScene(startPoint, endPoint);
+}
+
+bool Lightmap::isRayOccludedByScene(const glm::vec3 &startPoint, const glm::vec3 &endPoint) const
+{
+    if(!sceneOcclusion)
+        return false;
+
+    // The other instances are found in world space.
+    auto &transform = sceneOcclusion->getInstance(sceneInstance).transform;
+    auto ray = Ray::fromEndPoints(glm::vec3(transform*glm::vec4(startPoint, 1.0f)), glm::vec3(transform*glm::vec4(endPoint, 1.0f)));
+    return sceneOcclusion->isOccluded(ray, sceneInstance);
+}
+
+bool Lightmap::isRayOccludedByQuads(const Ray &ray, size_t startSurfaceIndex, size_t endSurfaceIndex)
+{
+    if(occlusionBackend == OcclusionBackend::BVH && quadSurfaceBVH)
+        return quadSurfaceBVH->isOccluded(ray, startSurfaceIndex, endSurfaceIndex);
+    if(occlusionBackend == OcclusionBackend::VoxelGrid && quadSurfaceVoxelGrid)
+        return quadSurfaceVoxelGrid->isOccluded(ray, startSurfaceIndex, endSurfaceIndex);
+
+    if(quadKernel != QuadKernel::Scalar && packedQuadSurfaces.size() == quadSurfaces.size())
+        return packedQuadSurfaces.anyHit(quadKernel, ray, 0, quadSurfaces.size(),
+            int32_t(startSurfaceIndex), int32_t(endSurfaceIndex));
+
     for(size_t i = 0; i < quadSurfaces.size(); ++i)
     {
         if(i == startSurfaceIndex || i == endSurfaceIndex)
             continue;
 
         auto &surface = quadSurfaces[i];
-        auto result = rayQuadIntersection(ray, surface);
+        auto result = surface.rayIntersection(ray);
         if(result > 0.0 && result < ray.maxDistance)
             return true;
     }
@@ -350,10 +1526,68 @@ bool Lightmap::isRayOccluded(glm::vec3 startPoint, size_t startSurfaceIndex,
     return false;
 }
 
+void Lightmap::buildOcclusionStructures()
+{
+    packedQuadSurfaces.clear();
+    quadSurfaceBVH.reset();
+    quadSurfaceVoxelGrid.reset();
+    buildOcclusionBackend();
+}
+
+void Lightmap::setOcclusionBackend(OcclusionBackend newBackend)
+{
+    occlusionBackend = newBackend;
+    buildOcclusionBackend();
+}
+
+void Lightmap::buildOcclusionBackend()
+{
+    // The BVH has its own packed quads in its leaf order.
+    if(occlusionBackend != OcclusionBackend::BruteForce)
+        packedQuadSurfaces.clear();
+    else if(packedQuadSurfaces.size() != quadSurfaces.size())
+        packedQuadSurfaces.build(quadSurfaces);
+
+    if(occlusionBackend != OcclusionBackend::BVH && !sceneOcclusion)
+        quadSurfaceBVH.reset();
+    else
+        getSharedQuadSurfaceBVH();
+
+    if(occlusionBackend != OcclusionBackend::VoxelGrid)
+    {
+        quadSurfaceVoxelGrid.reset();
+    }
+    else if(!quadSurfaceVoxelGrid)
+    {
+        quadSurfaceVoxelGrid = std::make_shared<QuadSurfaceVoxelGrid> ();
+        quadSurfaceVoxelGrid->build(quadSurfaces);
+    }
+}
+
+const QuadSurfaceBVHPtr &Lightmap::getSharedQuadSurfaceBVH()
+{
+    if(!quadSurfaceBVH)
+    {
+        quadSurfaceBVH = std::make_shared<QuadSurfaceBVH> ();
+        quadSurfaceBVH->setQuadKernel(quadKernel);
+        quadSurfaceBVH->build(quadSurfaces);
+    }
+
+    return quadSurfaceBVH;
+}
+
+void Lightmap::setQuadKernel(QuadKernel newQuadKernel)
+{
+    quadKernel = isQuadKernelSupported(newQuadKernel) ? newQuadKernel : getBestQuadKernel();
+    if(quadSurfaceBVH)
+        quadSurfaceBVH->setQuadKernel(quadKernel);
+}
+
 
 LightmapPacker::LightmapPacker()
 {
     texelScale = DefaultTexelScale;
+    patchOrder = PatchOrder::Surface;
 }
 
 LightmapPacker::~LightmapPacker()
@@ -469,8 +1703,10 @@ LightmapPtr LightmapPacker::buildLightMap()
     auto lightmap = std::make_shared<Lightmap> ();
     lightmap->width = lightmapWidth;
     lightmap->height = lightmapHeight;
+    lightmap->texelScale = texelScale;
 
     buildLightMapPatchesFor(lightmap);
+    lightmap->reorderPatches(patchOrder);
     printf("Patch count %zu\n", lightmap->patches.size());
 
     // Normalize the lightmap texture coordinates
@@ -517,8 +1753,7 @@ LightmapPtr LightmapPacker::buildLightMap()
         //printf("Surface bitangent: %f %f %f\n", dest.bitangent.x, dest.bitangent.y, dest.bitangent.z);
     }
 
-    // Compute the radiosity factors.
-    lightmap->computeRadiosityFactors();
+    lightmap->buildOcclusionStructures();
 
     // Create the lightmap buffers
     lightmap->createBuffers();
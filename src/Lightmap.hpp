@@ -3,11 +3,20 @@
 
 #include "Object.hpp"
 #include "Box2.hpp"
+#include "Box3.hpp"
+#include "Ray.hpp"
 #include "GenericVertex.hpp"
 #include "LightState.hpp"
+#include "SparseMatrix.hpp"
+#include "RadianceBuffer.hpp"
+#include "RadiosityKernels.hpp"
+#include "BiCGStabSolver.hpp"
+#include "PackedQuadSurfaces.hpp"
+#include "VisibilityMatrix.hpp"
 #include <glm/glm.hpp>
 #include <vector>
 #include <mutex>
+#include <string>
 
 namespace RadiosityTest
 {
@@ -15,6 +24,13 @@ DECLARE_CLASS(LightmapPatch);
 DECLARE_CLASS(Lightmap);
 DECLARE_CLASS(LightmapPacker);
 DECLARE_CLASS(GpuTexture);
+DECLARE_CLASS(HierarchicalRadiosity);
+DECLARE_CLASS(ThreadPool);
+DECLARE_CLASS(LightResponseCache);
+DECLARE_CLASS(LowRankTransport);
+DECLARE_CLASS(QuadSurfaceBVH);
+DECLARE_CLASS(QuadSurfaceVoxelGrid);
+DECLARE_CLASS(SceneOcclusion);
 
 /**
  * A lightmap patch
@@ -34,6 +50,22 @@ public:
 class LightmapCompactQuadSurface
 {
 public:
+    // The distance along the ray to the quad, or a negative value on a miss.
+    float rayIntersection(const Ray &ray) const;
+
+    glm::vec3 vertexPosition(int index) const
+    {
+        return normal*distance + tangent*vertices[index].x + bitangent*vertices[index].y;
+    }
+
+    Box3 computeBounds() const
+    {
+        Box3 result;
+        for(int i = 0; i < 4; ++i)
+            result.insertPoint(vertexPosition(i));
+        return result;
+    }
+
     glm::vec2 vertices[4];
 
     glm::vec3 normal;
@@ -42,26 +74,215 @@ public:
     float distance;
 };
 
+/**
+ * The method used for finding the occluders of a ray.
+ */
+enum class OcclusionBackend
+{
+    // Tests every quad surface, packed for the SIMD kernels.
+    BruteForce = 0,
+
+    // Traverses a bounding volume hierarchy over the quad surfaces.
+    BVH,
+
+    // Walks a voxel grid over the quad surfaces, which takes less memory
+    // than the BVH.
+    VoxelGrid,
+};
+
+/**
+ * The method used for computing the form factors.
+ */
+enum class FormFactorMethod
+{
+    // A ray between every pair of facing patches.
+    PairwiseRays = 0,
+
+    // Rasterizes the surfaces into a hemicube around every patch.
+    Hemicube,
+
+    // Like the pairwise rays, with stratified samples over both texels for
+    // the partially visible pairs.
+    MonteCarlo,
+};
+
+/**
+ * The algorithm used for solving the radiosity equation.
+ */
+enum class RadiositySolver
+{
+    // Gathers the light of every link on each pass, in place.
+    GaussSeidel = 0,
+
+    // Gathers from the previous pass. The rows are computed in parallel.
+    Jacobi,
+
+    // Shoots the unshot light of the brightest patches first.
+    ProgressiveRefinement,
+
+    // Gathers through links between the levels of a patch hierarchy.
+    Hierarchical,
+
+    // Gauss-Seidel with successive over-relaxation.
+    SuccessiveOverRelaxation,
+
+    // Biconjugate gradient stabilized Krylov solver.
+    BiCGStab,
+
+    // Relights through a low rank factorization of the converged transport.
+    LowRank,
+};
+
+/**
+ * The order of the lightmap patches, which is also the order of the rows and
+ * columns of the transport matrix.
+ */
+enum class PatchOrder
+{
+    // Surface by surface, in texel scan line order.
+    Surface = 0,
+
+    // Along a 3D Morton (Z-order) curve over the patch positions.
+    Morton,
+
+    // Along a 3D Hilbert curve over the patch positions.
+    Hilbert,
+};
+
 /**
  * A lightmap
  */
 class Lightmap : public Object
 {
 public:
-    static constexpr float Reflectivity = 0.8f;
+    static constexpr float DefaultReflectivity = 0.8f;
+    static constexpr float DefaultRelaxationFactor = 1.3f;
+    static constexpr size_t DefaultShotsPerProcess = 256;
+    static constexpr size_t GatherRowsPerChunk = 64;
+    static constexpr size_t FormFactorRowsPerChunk = 4;
+    static constexpr size_t DefaultHemicubeResolution = 64;
+
+    // The rays of the Monte Carlo form factors, spread over the partially
+    // visible patch pairs.
+    static constexpr size_t DefaultFormFactorSampleBudget = 16u << 20;
+
+    // The links that transport less than this share of the energy of a
+    // patch are dropped when the form factors are built.
+    static constexpr float DefaultFormFactorEpsilon = 1e-5f;
+    static constexpr float DefaultConvergenceTolerance = 0.1f / 255.0f;
+    static constexpr size_t MaxSolveIterations = 100;
+    static constexpr size_t DefaultLowRankTransportRank = 32;
+
+    // 16384 columns of the three radiance channels take 192 KB, which stays
+    // in a typical L2 cache.
+    static constexpr size_t DefaultTransportColumnTileSize = 16384;
 
     Lightmap();
     ~Lightmap();
 
     void createBuffers();
+
+    // Sorts the patches. It must be done before building the light transport.
+    void reorderPatches(PatchOrder order);
+    bool needsProcessing(const std::vector<LightState> &lights);
     void process(const std::vector<LightState> &lights);
     void computeRadiosityFactors();
 
+    // Loads the form factors from the cache when they are in it. Otherwise
+    // they are computed and stored in the cache.
+    void buildRadiosityFactors();
+
+    /**
+     * Edits the quad surfaces after the form factors are built. Only the
+     * links of the moved patches and of the patch pairs whose segment
+     * crosses the old or the new bounds of the changed quads are computed
+     * again, with the same visibility test as a full build. Moving quads
+     * with many patches costs close to a full build, since all their pairs
+     * are tested. The other form factor methods compute all the links again.
+     * The patches belong to the packed texels, so the added and removed
+     * quads are occluders without patches.
+     */
+    void moveQuadSurfaces(const std::vector<uint32_t> &quadIndices, const glm::mat4 &transform);
+    size_t addOccluderQuadSurfaces(const std::vector<LightmapCompactQuadSurface> &occluders);
+    void removeOccluderQuadSurfaces(std::vector<uint32_t> quadIndices);
+
+    /**
+     * Makes the lightmap an instance of a scene occlusion, so the other
+     * instances occlude its links and its lights. The links and the direct
+     * light are computed again on the next process. The edits of the quads
+     * are passed on to the other lightmaps of the scene.
+     */
+    void setSceneOcclusion(const SceneOcclusionPtr &newSceneOcclusion, size_t newSceneInstance);
+
+    // Traces again the links that cross the changed regions, which are in
+    // mesh space, after other instances moved relative to this one. Like the
+    // quad edits, only the pairwise rays are patched in place.
+    void updateSceneOcclusion(const std::vector<Box3> &changedRegions);
+
+    const SceneOcclusionPtr &getSceneOcclusion() const
+    {
+        return sceneOcclusion;
+    }
+
+    size_t getSceneInstance() const
+    {
+        return sceneInstance;
+    }
+
+    /**
+     * Builds the links again from the visibility of the patch pairs, without
+     * any ray. It follows a larger form factor epsilon or a change of the
+     * geometric term. The pairs below the epsilon of the build were never
+     * traced, so an epsilon below it computes the form factors again. The
+     * links get the pairwise kernel whatever the method that found their
+     * visibility was.
+     */
+    void rebuildTransportFromVisibility();
+
+    // The pairs that have a link, kept apart from their form factors.
+    const VisibilityMatrix &getVisibilityMatrix() const
+    {
+        return visibilityMatrix;
+    }
+
+    void computeDirectLights(const std::vector<LightState> &lights);
+    void computeDirectLights(const std::vector<LightState> &lights, RadianceBuffer &result);
+    void computeIndirectLightBounce();
+    void computeParallelIndirectLightBounce();
+    void computeRelaxedIndirectLightBounce();
+    void clearIndirectLight();
+
+    // Computes result = T*emission, where T is the normalized transport.
+    void gatherTransport(const RadianceBuffer &emission, RadianceBuffer &result);
+
+    // Computes result = T^t*emission.
+    void gatherTransposedTransport(const RadianceBuffer &emission, RadianceBuffer &result);
+
+    // Solves the indirect light of a direct light until it converges, or the
+    // same system with the transposed transport. Returns the number of
+    // iterations.
+    size_t solveIndirectLight(const RadianceBuffer &direct, RadianceBuffer &indirect, bool transposed = false);
+
+    bool hasRadiosityFactors() const
+    {
+        return viewFactorsDen.size() == patches.size();
+    }
+
+    // Tests the quads of this lightmap, and then the other instances of the
+    // scene occlusion.
+    bool isRayOccluded(glm::vec3 startPoint, size_t startSurfaceIndex,
+        glm::vec3 endPoint, size_t endSurfaceIndex = -1);
+
+    // Builds the acceleration structures of the occlusion queries. It must
+    // be done again when the quad surfaces change.
+    void buildOcclusionStructures();
+
     size_t width;
     size_t height;
+    float texelScale;
     std::vector<LightmapPatch> patches;
     std::vector<LightmapCompactQuadSurface> quadSurfaces;
-    std::vector<float> viewFactors;
+    SparseMatrix viewFactors;
     std::vector<float> viewFactorsDen;
 
     uint32_t *getFrontBuffer() const
@@ -81,23 +302,381 @@ public:
 
     GpuTexturePtr getValidLightmapTexture();
 
-private:
-    bool isRayOccluded(glm::vec3 startPoint, size_t startSurfaceIndex,
-        glm::vec3 endPoint, size_t endSurfaceIndex = -1);
+    const RadianceBuffer &getDirectLight() const
+    {
+        return directLight;
+    }
 
-    void computeDirectLights(const std::vector<LightState> &lights);
-    void computeIndirectLightBounce();
-    void swapBuffers();
+    const RadianceBuffer &getIndirectLight() const
+    {
+        return indirectLight;
+    }
+
+    RadiositySolver getSolver()
+    {
+        std::unique_lock<std::mutex> l(mutex);
+        return solver;
+    }
+
+    void setSolver(RadiositySolver newSolver)
+    {
+        std::unique_lock<std::mutex> l(mutex);
+        solver = newSolver;
+    }
+
+    const ThreadPoolPtr &getThreadPool() const
+    {
+        return threadPool;
+    }
+
+    void setThreadPool(const ThreadPoolPtr &newThreadPool)
+    {
+        threadPool = newThreadPool;
+    }
+
+    float getReflectivity()
+    {
+        std::unique_lock<std::mutex> l(mutex);
+        return reflectivity;
+    }
+
+    void setReflectivity(float newReflectivity)
+    {
+        std::unique_lock<std::mutex> l(mutex);
+        reflectivity = newReflectivity;
+    }
+
+    // Caches the converged response of every light, so a change that only
+    // affects the light intensities does not need a new solve. The
+    // hierarchical and the low rank solvers do not use the cache.
+    bool isLightResponseCaching()
+    {
+        std::unique_lock<std::mutex> l(mutex);
+        return lightResponseCaching;
+    }
+
+    void setLightResponseCaching(bool enabled)
+    {
+        std::unique_lock<std::mutex> l(mutex);
+        lightResponseCaching = enabled;
+    }
+
+    const LightResponseCachePtr &getLightResponseCache() const
+    {
+        return lightResponseCache;
+    }
+
+    // The rank of the transport factorization used by the LowRank solver.
+    size_t getLowRankTransportRank()
+    {
+        std::unique_lock<std::mutex> l(mutex);
+        return lowRankTransportRank;
+    }
+
+    void setLowRankTransportRank(size_t newRank)
+    {
+        std::unique_lock<std::mutex> l(mutex);
+        lowRankTransportRank = newRank;
+    }
+
+    const LowRankTransportPtr &getLowRankTransport() const
+    {
+        return lowRankTransport;
+    }
+
+    // The over-relaxation factor (omega) used by SuccessiveOverRelaxation.
+    float getRelaxationFactor()
+    {
+        std::unique_lock<std::mutex> l(mutex);
+        return relaxationFactor;
+    }
+
+    void setRelaxationFactor(float newRelaxationFactor)
+    {
+        std::unique_lock<std::mutex> l(mutex);
+        relaxationFactor = newRelaxationFactor;
+    }
+
+    // The solver stops once a pass changes the radiance by less than this.
+    float getConvergenceTolerance()
+    {
+        std::unique_lock<std::mutex> l(mutex);
+        return convergenceTolerance;
+    }
+
+    void setConvergenceTolerance(float newTolerance)
+    {
+        std::unique_lock<std::mutex> l(mutex);
+        convergenceTolerance = newTolerance;
+    }
+
+    size_t getIterationCount()
+    {
+        std::unique_lock<std::mutex> l(mutex);
+        return iterationCount;
+    }
+
+    // The largest radiance change of the last pass.
+    float getResidual()
+    {
+        std::unique_lock<std::mutex> l(mutex);
+        return residual;
+    }
+
+    bool isConverged()
+    {
+        std::unique_lock<std::mutex> l(mutex);
+        return converged;
+    }
+
+    // The column tile size of the transport gather. Zero disables the tiles.
+    size_t getTransportColumnTileSize() const
+    {
+        return transportColumnTileSize;
+    }
+
+    void setTransportColumnTileSize(size_t newTileSize)
+    {
+        transportColumnTileSize = newTileSize;
+        if(hasRadiosityFactors())
+            viewFactors.buildColumnTiles(transportColumnTileSize);
+    }
+
+    const std::string &getFormFactorCacheDirectory() const
+    {
+        return formFactorCacheDirectory;
+    }
+
+    // An empty directory disables the form factor cache.
+    void setFormFactorCacheDirectory(const std::string &newDirectory)
+    {
+        formFactorCacheDirectory = newDirectory;
+    }
+
+    FormFactorMethod getFormFactorMethod() const
+    {
+        return formFactorMethod;
+    }
+
+    // It takes effect on the next form factor computation.
+    void setFormFactorMethod(FormFactorMethod newMethod)
+    {
+        formFactorMethod = newMethod;
+    }
+
+    size_t getHemicubeResolution() const
+    {
+        return hemicubeResolution;
+    }
+
+    void setHemicubeResolution(size_t newResolution)
+    {
+        hemicubeResolution = newResolution;
+    }
+
+    size_t getFormFactorSampleBudget() const
+    {
+        return formFactorSampleBudget;
+    }
+
+    // The samples per pair are the largest power of two that keeps the rays
+    // of all the partial pairs within the budget.
+    void setFormFactorSampleBudget(size_t newBudget)
+    {
+        formFactorSampleBudget = newBudget;
+    }
+
+    float getFormFactorEpsilon() const
+    {
+        return formFactorEpsilon;
+    }
+
+    // Zero keeps every visible link. It takes effect on the next form
+    // factor computation.
+    void setFormFactorEpsilon(float newEpsilon)
+    {
+        formFactorEpsilon = newEpsilon;
+    }
+
+    // The share of the form factor sum that was pruned by the last form
+    // factor computation. The pruned links are not given back to the other
+    // links of their rows, so this is the share of the transported energy
+    // that is lost.
+    double getPrunedFormFactorFraction() const
+    {
+        return prunedFormFactorFraction;
+    }
+
+    bool getSurfaceVisibilityClassification() const
+    {
+        return surfaceVisibilityClassification;
+    }
+
+    // Classifies the surface pairs before the pairwise rays, so only the
+    // partially visible ones need a ray per patch pair.
+    void setSurfaceVisibilityClassification(bool newClassification)
+    {
+        surfaceVisibilityClassification = newClassification;
+    }
+
+    bool getPatchClusterCulling() const
+    {
+        return patchClusterCulling;
+    }
+
+    // Rejects the patch clusters that can never face each other before the
+    // pairwise tests. The links are the same either way.
+    void setPatchClusterCulling(bool newCulling)
+    {
+        patchClusterCulling = newCulling;
+    }
+
+    OcclusionBackend getOcclusionBackend() const
+    {
+        return occlusionBackend;
+    }
+
+    // Builds the structure of the new backend when it is missing, and frees
+    // the structures of the other backends.
+    void setOcclusionBackend(OcclusionBackend newBackend);
+
+    const QuadSurfaceBVHPtr &getQuadSurfaceBVH() const
+    {
+        return quadSurfaceBVH;
+    }
+
+    // The BVH that the scene occlusion shares with the other lightmaps. It
+    // is built on demand for the other backends, and kept while the
+    // lightmap is in a scene occlusion.
+    const QuadSurfaceBVHPtr &getSharedQuadSurfaceBVH();
+
+    const QuadSurfaceVoxelGridPtr &getQuadSurfaceVoxelGrid() const
+    {
+        return quadSurfaceVoxelGrid;
+    }
+
+    // Only kept for the brute force backend.
+    const PackedQuadSurfaces &getPackedQuadSurfaces() const
+    {
+        return packedQuadSurfaces;
+    }
+
+    bool getOcclusionRayPackets() const
+    {
+        return occlusionRayPackets;
+    }
+
+    // Traces the form factor rays in packets through the BVH.
+    void setOcclusionRayPackets(bool newOcclusionRayPackets)
+    {
+        occlusionRayPackets = newOcclusionRayPackets;
+    }
+
+    QuadKernel getQuadKernel() const
+    {
+        return quadKernel;
+    }
+
+    // The kernel of the brute force occlusion tests and of the BVH leaves.
+    void setQuadKernel(QuadKernel newQuadKernel);
+
+    GatherKernel getGatherKernel() const
+    {
+        return gatherKernel;
+    }
+
+    void setGatherKernel(GatherKernel newGatherKernel)
+    {
+        gatherKernel = isGatherKernelSupported(newGatherKernel) ? newGatherKernel : getBestGatherKernel();
+    }
+
+    size_t getShotsPerProcess() const
+    {
+        return shotsPerProcess;
+    }
+
+    void setShotsPerProcess(size_t newShotsPerProcess)
+    {
+        shotsPerProcess = newShotsPerProcess;
+    }
+
+private:
+    void updateNormalizationFactors();
+    void buildOcclusionBackend();
+    void computePairwiseLinks(std::vector<SparseMatrixEntry> &links, size_t &prunedCount, double &prunedFormFactorSum);
+    void updateRadiosityFactors(const std::vector<Box3> &changedRegions, const std::vector<uint8_t> &movedPatches);
+    void applyQuadSurfaceChanges(const std::vector<Box3> &changedRegions, const std::vector<uint8_t> &movedPatches);
+    void buildVisibilityFromTransport();
+    void discardSolvedTransport();
+    void computePatchOcclusion(size_t sourceIndex, const std::vector<uint32_t> &destinations, std::vector<uint8_t> &occluded);
+    size_t computeSceneOcclusion(size_t sourceIndex, const std::vector<uint32_t> &destinations, std::vector<uint8_t> &occluded);
+    bool isRayOccludedByQuads(const Ray &ray, size_t startSurfaceIndex, size_t endSurfaceIndex);
+    bool isRayOccludedByScene(const glm::vec3 &startPoint, const glm::vec3 &endPoint) const;
+    void applyTransportSystem(const RadianceBuffer &x, RadianceBuffer &result, bool transposed = false);
+    void restartBiCGStab();
+    void applyLightResponses(const std::vector<LightState> &lights);
+    void resetProgressiveRefinement();
+    void shootUnshotLight();
+    float computeMaxUnshotLight();
+    void swapBuffers(float newResidual);
 
     uint32_t *frontBuffer;
     uint32_t *backBuffer;
-    glm::vec4 *directLightBuffer;
-    glm::vec4 *indirectLightBuffer;
-    glm::vec4 *oldIndirectLightBuffer;
     GpuTexturePtr lightmapTexture;
+
+    // Per patch radiance buffers.
+    RadianceBuffer directLight;
+    RadianceBuffer indirectLight;
+    RadianceBuffer emittedLight;
+    RadianceBuffer previousIndirectLight;
+    std::vector<LightState> processedLights;
+
+    ThreadPoolPtr threadPool;
+    std::string formFactorCacheDirectory;
+    FormFactorMethod formFactorMethod;
+    size_t hemicubeResolution;
+    size_t formFactorSampleBudget;
+    float formFactorEpsilon;
+    double prunedFormFactorFraction;
+    bool surfaceVisibilityClassification;
+    bool patchClusterCulling;
+    VisibilityMatrix visibilityMatrix;
+    float visibilityEpsilon;
+    OcclusionBackend occlusionBackend;
+    QuadSurfaceBVHPtr quadSurfaceBVH;
+    QuadSurfaceVoxelGridPtr quadSurfaceVoxelGrid;
+    SceneOcclusionPtr sceneOcclusion;
+    size_t sceneInstance;
+    PackedQuadSurfaces packedQuadSurfaces;
+    bool occlusionRayPackets;
+    QuadKernel quadKernel;
+    GatherKernel gatherKernel;
+    size_t transportColumnTileSize;
+    RadiositySolver solver;
+    RadiositySolver activeSolver;
+    float reflectivity;
+    float activeReflectivity;
+    float relaxationFactor;
+    BiCGStabSolver biCGStabSolver;
+    RadianceBuffer transportedDirectLight;
+    RadianceBuffer scaledEmission;
+    std::vector<float> unitRowScale;
+    size_t shotsPerProcess;
+    RadianceBuffer shotDirectLight;
+    std::vector<glm::vec3> unshotLight;
+    HierarchicalRadiosityPtr hierarchicalRadiosity;
+    bool lightResponseCaching;
+    LightResponseCachePtr lightResponseCache;
+    size_t lowRankTransportRank;
+    LowRankTransportPtr lowRankTransport;
+
     std::mutex mutex;
     int uploadedCount;
     int computedCount;
+    float convergenceTolerance;
+    size_t iterationCount;
+    float residual;
+    bool converged;
 };
 
 struct LightmapQuadSurface
@@ -128,6 +707,16 @@ public:
 
     LightmapPtr buildLightMap();
 
+    PatchOrder getPatchOrder() const
+    {
+        return patchOrder;
+    }
+
+    void setPatchOrder(PatchOrder newPatchOrder)
+    {
+        patchOrder = newPatchOrder;
+    }
+
     void applyTexcoordsTo(GenericVertex *vertices)
     {
         for(auto &surface : quadSurfaces)
@@ -149,6 +738,7 @@ private:
     std::vector<LightmapQuadSurface> quadSurfaces;
     std::vector<bool> usedTexels;
     float texelScale;
+    PatchOrder patchOrder;
 };
 
 } // End of namespace RadiosityTest
@@ -0,0 +1,1371 @@
+#include "GenericMesh.hpp"
+#include "Lightmap.hpp"
+#include "ThreadPool.hpp"
+#include "LightResponseCache.hpp"
+#include "LowRankTransport.hpp"
+#include "QuadSurfaceBVH.hpp"
+#include "QuadSurfaceVoxelGrid.hpp"
+#include "SceneOcclusion.hpp"
+#include "FormFactorCache.hpp"
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+#include <thread>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+using namespace RadiosityTest;
+
+/**
+ * Benchmark options.
+ */
+struct BenchmarkOptions
+{
+    BenchmarkOptions()
+        : scene("demo"), cubeCount(9), passes(20), threads(1), reflectivity(Lightmap::DefaultReflectivity),
+          relaxationFactor(Lightmap::DefaultRelaxationFactor), targetResidual(0.1f / 255.0f), maxPasses(500),
+          columnTileSize(Lightmap::DefaultTransportColumnTileSize), rank(Lightmap::DefaultLowRankTransportRank),
+          cacheDirectory(".") {}
+
+    std::string scene;
+    size_t cubeCount;
+    size_t passes;
+    size_t threads;
+    float reflectivity;
+    float relaxationFactor;
+    float targetResidual;
+    size_t maxPasses;
+    size_t columnTileSize;
+    size_t rank;
+    std::string cacheDirectory;
+    std::vector<std::string> benchmarks;
+};
+
+static BenchmarkOptions options;
+
+// The comparisons that must match exactly and did not. The exit code is not
+// zero when there are any.
+static size_t failedCheckCount = 0;
+
+static void requireNoDifferentLinks(const char *name, size_t differentCount)
+{
+    if(differentCount == 0)
+        return;
+
+    printf("  FAILED: %s has %zu different links\n", name, differentCount);
+    ++failedCheckCount;
+}
+
+static double currentTimeInMilliseconds()
+{
+    auto now = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli> (now.time_since_epoch()).count();
+}
+
+static LightmapPtr buildDemoRoom()
+{
+    return GenericMeshBuilder()
+        // Add the walls
+        .identity()
+        .translate(0, 1.0, 0)
+        .addCubeInterior(glm::vec3(4.0, 2.0, 4.0))
+
+        // Add a cube
+        .identity()
+        .translate(0, 0.30, 0)
+        .addCube(glm::vec3(0.6, 0.6, 0.6))
+        .buildLightmap();
+}
+
+static LightmapPtr buildGeneratedRoom(size_t cubeCount)
+{
+    GenericMeshBuilder builder;
+    builder
+        .identity()
+        .translate(0, 1.5, 0)
+        .addCubeInterior(glm::vec3(8.0, 3.0, 8.0));
+
+    // Lay the cubes on a grid over the floor.
+    auto gridSize = size_t(ceil(sqrt(double(cubeCount))));
+    auto spacing = 7.0f / float(gridSize);
+    for(size_t i = 0; i < cubeCount; ++i)
+    {
+        auto x = -3.5f + spacing*(float(i % gridSize) + 0.5f);
+        auto z = -3.5f + spacing*(float(i / gridSize) + 0.5f);
+        auto size = spacing*0.5f;
+        builder
+            .identity()
+            .translate(x, size*0.5f, z)
+            .addCube(glm::vec3(size, size, size));
+    }
+
+    return builder.buildLightmap();
+}
+
+static LightmapPtr buildScene()
+{
+    auto startTime = currentTimeInMilliseconds();
+    auto lightmap = options.scene == "generated" ? buildGeneratedRoom(options.cubeCount) : buildDemoRoom();
+    printf("Scene '%s': %zu patches, %zu quads, built in %.2f ms\n", options.scene.c_str(),
+        lightmap->patches.size(), lightmap->quadSurfaces.size(), currentTimeInMilliseconds() - startTime);
+    return lightmap;
+}
+
+static std::vector<LightState> sceneLights()
+{
+    LightState spotLight;
+    spotLight.position = glm::vec4(0.0f, 1.5f, -0.5f, 1.0f);
+    spotLight.intensity = glm::vec4(1.0f, 1.0f, 1.0f, 1.0f);
+    spotLight.attenuation = glm::vec3(1.0f, 0.0f, 3.0f);
+    spotLight.spotDirection = glm::vec3(0.0f, -1.0f, 0.0f);
+    spotLight.spotCutoff = glm::cos(glm::vec2(70, 60)*float(M_PI/180.0));
+    spotLight.spotExponent = 1.0f;
+    return std::vector<LightState> {spotLight};
+}
+
+static void prepareTransport(const LightmapPtr &lightmap)
+{
+    if(lightmap->hasRadiosityFactors())
+        return;
+
+    auto startTime = currentTimeInMilliseconds();
+    lightmap->computeRadiosityFactors();
+    printf("Form factors built in %.2f ms\n", currentTimeInMilliseconds() - startTime);
+}
+
+static void printPassTiming(const char *name, double totalTime, size_t linkCount)
+{
+    auto passTime = totalTime / options.passes;
+    printf("  %-24s %10.3f ms/pass %10.1f Mlinks/s\n", name, passTime, linkCount / (passTime*1000.0));
+}
+
+/**
+ * Compares the transport gather kernels against the original array of
+ * structures loop, which gathers vec4 radiance through the texel indices.
+ */
+static void benchmarkGather(const LightmapPtr &lightmap)
+{
+    prepareTransport(lightmap);
+    lightmap->computeDirectLights(sceneLights());
+
+    auto &patches = lightmap->patches;
+    auto &transport = lightmap->viewFactors;
+    auto linkCount = transport.getNonZeroCount();
+    printf("Gather benchmark: %zu links, %zu passes\n", linkCount, options.passes);
+
+    // Original loop, over texel indexed vec4 buffers.
+    {
+        auto &directLight = lightmap->getDirectLight();
+        std::vector<glm::vec4> direct(lightmap->width*lightmap->height);
+        std::vector<glm::vec4> indirect(direct.size());
+        std::vector<glm::vec4> oldIndirect(direct.size());
+        for(size_t i = 0; i < patches.size(); ++i)
+            direct[patches[i].texelIndex] = glm::vec4(directLight.get(i), 0.0f);
+
+        auto startTime = currentTimeInMilliseconds();
+        for(size_t pass = 0; pass < options.passes; ++pass)
+        {
+            indirect.swap(oldIndirect);
+            for(size_t i = 0; i < patches.size(); ++i)
+            {
+                auto normalizationFactor = lightmap->viewFactorsDen[i];
+                glm::vec4 value;
+                for(size_t k = transport.rowBegin(i); k < transport.rowEnd(i); ++k)
+                {
+                    auto emitionTexel = patches[transport.columns[k]].texelIndex;
+                    value += (oldIndirect[emitionTexel] + direct[emitionTexel])*(transport.values[k]*normalizationFactor);
+                }
+                indirect[patches[i].texelIndex] = value;
+            }
+        }
+        printPassTiming("AoS texel loop", currentTimeInMilliseconds() - startTime, linkCount);
+    }
+
+    // Structure of arrays kernels.
+    ThreadPoolPtr threadPool;
+    if(options.threads != 1)
+        threadPool = std::make_shared<ThreadPool> (options.threads);
+    lightmap->setThreadPool(threadPool);
+
+    RadianceBuffer scalarResult;
+    for(auto kernel : {GatherKernel::Scalar, GatherKernel::SSE, GatherKernel::AVX2})
+    {
+        if(!isGatherKernelSupported(kernel))
+        {
+            printf("  %-24s not enabled in this build\n", getGatherKernelName(kernel));
+            continue;
+        }
+
+        lightmap->setGatherKernel(kernel);
+        lightmap->clearIndirectLight();
+
+        auto startTime = currentTimeInMilliseconds();
+        for(size_t pass = 0; pass < options.passes; ++pass)
+            lightmap->computeParallelIndirectLightBounce();
+        printPassTiming(getGatherKernelName(kernel), currentTimeInMilliseconds() - startTime, linkCount);
+
+        if(kernel == GatherKernel::Scalar)
+            scalarResult = lightmap->getIndirectLight();
+        else
+            printf("  %-24s max difference with scalar: %g\n", "", lightmap->getIndirectLight().maxDifference(scalarResult));
+    }
+}
+
+/**
+ * The largest per channel value of |T*(direct + indirect) - indirect|. Unlike
+ * the change between passes, this residual means the same for every solver.
+ */
+static float computeTrueResidual(const LightmapPtr &lightmap)
+{
+    RadianceBuffer emission;
+    RadianceBuffer gathered;
+    emission.setSum(lightmap->getDirectLight(), lightmap->getIndirectLight());
+    lightmap->gatherTransport(emission, gathered);
+    return gathered.maxDifference(lightmap->getIndirectLight());
+}
+
+/**
+ * Counts the passes that every solver needs for reaching the same residual.
+ */
+static void benchmarkSolvers(const LightmapPtr &lightmap)
+{
+    ThreadPoolPtr threadPool;
+    if(options.threads != 1)
+        threadPool = std::make_shared<ThreadPool> (options.threads);
+    lightmap->setThreadPool(threadPool);
+    lightmap->setReflectivity(options.reflectivity);
+    lightmap->setRelaxationFactor(options.relaxationFactor);
+
+    // The solvers stop on their own estimate, so it is disabled here.
+    lightmap->setConvergenceTolerance(0.0f);
+    prepareTransport(lightmap);
+
+    auto lights = sceneLights();
+    printf("Solver benchmark: reflectivity %.2f, omega %.2f, target residual %g, at most %zu passes\n",
+        options.reflectivity, options.relaxationFactor, options.targetResidual, options.maxPasses);
+
+    std::pair<RadiositySolver, const char *> solvers[] = {
+        {RadiositySolver::GaussSeidel, "Gauss-Seidel"},
+        {RadiositySolver::Jacobi, "Jacobi"},
+        {RadiositySolver::SuccessiveOverRelaxation, "SOR"},
+        {RadiositySolver::BiCGStab, "BiCGSTAB"},
+    };
+
+    for(auto &solver : solvers)
+    {
+        // Changing the lights restarts the solve from a dark scene.
+        lightmap->setSolver(solver.first);
+        lightmap->clearIndirectLight();
+        lightmap->process(std::vector<LightState> ());
+
+        size_t passes = 0;
+        float residual = 0.0f;
+        double solveTime = 0.0;
+        do
+        {
+            auto startTime = currentTimeInMilliseconds();
+            lightmap->process(lights);
+            solveTime += currentTimeInMilliseconds() - startTime;
+
+            ++passes;
+            residual = computeTrueResidual(lightmap);
+        } while(residual > options.targetResidual && passes < options.maxPasses);
+
+        printf("  %-24s %5zu passes %10.2f ms %10.3f ms/pass residual %g\n", solver.second, passes, solveTime,
+            passes ? solveTime / passes : 0.0, residual);
+    }
+}
+
+/**
+ * The number of distinct cache lines of one emission channel touched by
+ * every row of the transport, on average. It estimates the cache misses of
+ * the gather when the emission does not fit in the cache.
+ */
+static double computeCacheLinesPerRow(const SparseMatrix &transport)
+{
+    const size_t FloatsPerCacheLine = 64 / sizeof(float);
+
+    size_t lineCount = 0;
+    for(size_t i = 0; i < transport.getRowCount(); ++i)
+    {
+        size_t lastLine = -1;
+        for(size_t k = transport.rowBegin(i); k < transport.rowEnd(i); ++k)
+        {
+            auto line = transport.columns[k] / FloatsPerCacheLine;
+            if(line != lastLine)
+                ++lineCount;
+            lastLine = line;
+        }
+    }
+
+    return double(lineCount) / std::max(transport.getRowCount(), size_t(1));
+}
+
+/**
+ * Compares the patch orders, with and without the column tiles.
+ */
+static void benchmarkOrdering(const LightmapPtr &lightmap)
+{
+    ThreadPoolPtr threadPool;
+    if(options.threads != 1)
+        threadPool = std::make_shared<ThreadPool> (options.threads);
+    lightmap->setThreadPool(threadPool);
+
+    auto lights = sceneLights();
+    printf("Ordering benchmark: %zu passes, column tile size %zu\n", options.passes, options.columnTileSize);
+
+    std::pair<PatchOrder, const char *> orders[] = {
+        {PatchOrder::Surface, "Surface"},
+        {PatchOrder::Morton, "Morton"},
+        {PatchOrder::Hilbert, "Hilbert"},
+    };
+
+    for(auto &order : orders)
+    {
+        lightmap->reorderPatches(order.first);
+        lightmap->setTransportColumnTileSize(options.columnTileSize);
+
+        auto startTime = currentTimeInMilliseconds();
+        lightmap->computeRadiosityFactors();
+        auto formFactorTime = currentTimeInMilliseconds() - startTime;
+
+        auto &transport = lightmap->viewFactors;
+        auto linkCount = transport.getNonZeroCount();
+        printf("%s order: form factors %.2f ms, %.1f cache lines per row (%.1f links per row)\n", order.second,
+            formFactorTime, computeCacheLinesPerRow(transport), double(linkCount) / lightmap->patches.size());
+
+        lightmap->computeDirectLights(lights);
+        for(auto tileSize : {size_t(0), options.columnTileSize})
+        {
+            lightmap->setTransportColumnTileSize(tileSize);
+            lightmap->clearIndirectLight();
+
+            startTime = currentTimeInMilliseconds();
+            for(size_t pass = 0; pass < options.passes; ++pass)
+                lightmap->computeParallelIndirectLightBounce();
+            printPassTiming(transport.hasColumnTiles() ? "Tiled gather" : "Row gather",
+                currentTimeInMilliseconds() - startTime, linkCount);
+        }
+    }
+}
+
+/**
+ * Times the light intensity edits with the cached light responses, and
+ * compares the result with a solve from scratch.
+ */
+static void benchmarkLightResponses(const LightmapPtr &lightmap)
+{
+    ThreadPoolPtr threadPool;
+    if(options.threads != 1)
+        threadPool = std::make_shared<ThreadPool> (options.threads);
+    lightmap->setThreadPool(threadPool);
+    prepareTransport(lightmap);
+
+    auto lights = sceneLights();
+    LightState pointLight;
+    pointLight.position = glm::vec4(1.5f, 1.8f, 1.5f, 1.0f);
+    pointLight.intensity = glm::vec4(0.5f, 0.5f, 0.5f, 1.0f);
+    pointLight.attenuation = glm::vec3(1.0f, 0.0f, 1.0f);
+    pointLight.spotCutoff = glm::vec2(-1.0f);
+    pointLight.spotExponent = 1.0f;
+    lights.push_back(pointLight);
+
+    lightmap->setLightResponseCaching(true);
+    auto startTime = currentTimeInMilliseconds();
+    lightmap->process(lights);
+    printf("Light responses: %zu lights precomputed in %.2f ms (%zu KB)\n", lights.size(),
+        currentTimeInMilliseconds() - startTime, lightmap->getLightResponseCache()->getMemorySize() / 1024);
+
+    // Animate the intensities.
+    startTime = currentTimeInMilliseconds();
+    for(size_t pass = 0; pass < options.passes; ++pass)
+    {
+        auto t = float(pass) / options.passes;
+        lights[0].intensity = glm::vec4(1.0f, 1.0f - 0.5f*t, 0.5f + 0.5f*t, 1.0f);
+        lights[1].intensity = glm::vec4(0.2f + t, 0.2f + t, 0.2f + t, 1.0f);
+        lightmap->process(lights);
+    }
+    printf("  %-24s %10.3f ms/edit\n", "Intensity edit", (currentTimeInMilliseconds() - startTime) / options.passes);
+
+    auto combinedLight = lightmap->getIndirectLight();
+    combinedLight.addScaled(lightmap->getDirectLight(), glm::vec3(1.0f));
+
+    // Solve the last lights from scratch.
+    RadianceBuffer directLight;
+    RadianceBuffer indirectLight;
+    startTime = currentTimeInMilliseconds();
+    lightmap->computeDirectLights(lights, directLight);
+    auto iterationCount = lightmap->solveIndirectLight(directLight, indirectLight);
+    printf("  %-24s %10.3f ms (%zu iterations)\n", "Full solve", currentTimeInMilliseconds() - startTime, iterationCount);
+
+    indirectLight.addScaled(directLight, glm::vec3(1.0f));
+    printf("  %-24s %g\n", "Max difference", combinedLight.maxDifference(indirectLight));
+}
+
+static double computeRelativeError(const RadianceBuffer &value, const RadianceBuffer &reference)
+{
+    double error = 0.0, norm = 0.0;
+    for(size_t i = 0; i < reference.size(); ++i)
+    {
+        auto difference = value.get(i) - reference.get(i);
+        auto referenceValue = reference.get(i);
+        error += glm::dot(difference, difference);
+        norm += glm::dot(referenceValue, referenceValue);
+    }
+
+    return norm > 0.0 ? sqrt(error / norm) : 0.0;
+}
+
+/**
+ * Builds the low rank transport with several ranks, and compares its
+ * relighting with the full solve for a static and a moving light.
+ */
+static void benchmarkLowRank(const LightmapPtr &lightmap)
+{
+    ThreadPoolPtr threadPool;
+    if(options.threads != 1)
+        threadPool = std::make_shared<ThreadPool> (options.threads);
+    lightmap->setThreadPool(threadPool);
+    prepareTransport(lightmap);
+
+    // The reference solutions.
+    std::vector<std::pair<const char *, std::vector<LightState>>> lightSets;
+    lightSets.push_back(std::make_pair("Spot light", sceneLights()));
+    {
+        auto lights = sceneLights();
+        lights[0].position = glm::vec4(1.2f, 1.2f, 0.8f, 1.0f);
+        lights[0].spotDirection = glm::normalize(glm::vec3(-1.0f, -1.0f, -0.5f));
+        lightSets.push_back(std::make_pair("Moved spot light", lights));
+    }
+
+    std::vector<RadianceBuffer> directLights(lightSets.size());
+    std::vector<RadianceBuffer> referenceLights(lightSets.size());
+    double solveTime = 0.0;
+    for(size_t i = 0; i < lightSets.size(); ++i)
+    {
+        lightmap->computeDirectLights(lightSets[i].second, directLights[i]);
+        auto startTime = currentTimeInMilliseconds();
+        lightmap->solveIndirectLight(directLights[i], referenceLights[i]);
+        solveTime += currentTimeInMilliseconds() - startTime;
+    }
+    printf("Low rank benchmark: full solve %.3f ms per light set\n", solveTime / lightSets.size());
+
+    for(auto rank : {options.rank / 4, options.rank / 2, options.rank, options.rank*2})
+    {
+        if(rank == 0)
+            continue;
+
+        LowRankTransport transport(lightmap.get());
+        auto startTime = currentTimeInMilliseconds();
+        transport.build(rank);
+        printf("Rank %zu: built in %.2f ms, %zu KB\n", rank, currentTimeInMilliseconds() - startTime,
+            transport.getMemorySize() / 1024);
+
+        RadianceBuffer indirectLight;
+        for(size_t i = 0; i < lightSets.size(); ++i)
+        {
+            startTime = currentTimeInMilliseconds();
+            for(size_t pass = 0; pass < options.passes; ++pass)
+                transport.relight(directLights[i], indirectLight);
+            auto relightTime = (currentTimeInMilliseconds() - startTime) / options.passes;
+
+            printf("  %-24s %10.3f ms/relight  max error %g  relative error %g\n", lightSets[i].first, relightTime,
+                indirectLight.maxDifference(referenceLights[i]), computeRelativeError(indirectLight, referenceLights[i]));
+        }
+    }
+}
+
+/**
+ * Compares the occlusion backends on the form factors and the direct light.
+ */
+static void benchmarkOcclusion(const LightmapPtr &lightmap)
+{
+    auto lights = sceneLights();
+    printf("Occlusion benchmark: %zu quads\n", lightmap->quadSurfaces.size());
+
+    // The classified pairs only test their candidate quads, whatever the
+    // backend, so every pair is traced through the backend here.
+    lightmap->setSurfaceVisibilityClassification(false);
+
+    std::pair<OcclusionBackend, const char *> backends[] = {
+        {OcclusionBackend::BruteForce, "Brute force"},
+        {OcclusionBackend::BVH, "BVH"},
+        {OcclusionBackend::VoxelGrid, "Voxel grid"},
+    };
+
+    RadianceBuffer referenceDirectLight;
+    size_t referenceLinkCount = 0;
+    for(auto &backend : backends)
+    {
+        lightmap->setOcclusionBackend(backend.first);
+
+        auto startTime = currentTimeInMilliseconds();
+        lightmap->computeRadiosityFactors();
+        auto formFactorTime = currentTimeInMilliseconds() - startTime;
+
+        RadianceBuffer directLight;
+        startTime = currentTimeInMilliseconds();
+        lightmap->computeDirectLights(lights, directLight);
+        auto directLightTime = currentTimeInMilliseconds() - startTime;
+
+        auto linkCount = lightmap->viewFactors.getNonZeroCount();
+        printf("  %-24s form factors %10.2f ms  direct light %8.3f ms  %zu links\n", backend.second,
+            formFactorTime, directLightTime, linkCount);
+
+        if(backend.first == OcclusionBackend::BruteForce)
+        {
+            referenceDirectLight = directLight;
+            referenceLinkCount = linkCount;
+        }
+        else
+        {
+            printf("  %-24s link count difference %td, direct light difference %g\n", "",
+                ptrdiff_t(linkCount) - ptrdiff_t(referenceLinkCount), directLight.maxDifference(referenceDirectLight));
+        }
+    }
+}
+
+/**
+ * Compares the quad intersection kernels, as the brute force occlusion test
+ * and as the BVH leaf test.
+ */
+static void benchmarkQuadKernels(const LightmapPtr &lightmap)
+{
+    printf("Quad kernel benchmark: %zu quads\n", lightmap->quadSurfaces.size());
+
+    // The classified pairs do not use the kernel of the backend.
+    lightmap->setSurfaceVisibilityClassification(false);
+
+    QuadKernel kernels[] = {QuadKernel::Scalar, QuadKernel::SSE, QuadKernel::AVX2, QuadKernel::AVX512};
+    size_t leafQuadCounts[] = {QuadSurfaceBVH::DefaultMaxLeafQuadCount, PackedQuadGroup::LaneCount};
+
+    size_t referenceLinkCount = 0;
+    double referenceTime = 0.0;
+    auto measure = [&](const char *backendName, QuadKernel kernel, size_t leafQuadCount) {
+        lightmap->setQuadKernel(kernel);
+        auto startTime = currentTimeInMilliseconds();
+        lightmap->computeRadiosityFactors();
+        auto formFactorTime = currentTimeInMilliseconds() - startTime;
+
+        auto linkCount = lightmap->viewFactors.getNonZeroCount();
+        if(referenceTime == 0.0)
+        {
+            referenceLinkCount = linkCount;
+            referenceTime = formFactorTime;
+        }
+
+        char name[64];
+        if(leafQuadCount)
+            snprintf(name, sizeof(name), "%s %s, leaf %zu", backendName, getQuadKernelName(kernel), leafQuadCount);
+        else
+            snprintf(name, sizeof(name), "%s %s", backendName, getQuadKernelName(kernel));
+        printf("  %-28s form factors %10.2f ms  speedup %6.2fx  link count difference %td\n", name,
+            formFactorTime, referenceTime / formFactorTime, ptrdiff_t(linkCount) - ptrdiff_t(referenceLinkCount));
+    };
+
+    lightmap->setOcclusionBackend(OcclusionBackend::BruteForce);
+    for(auto kernel : kernels)
+    {
+        if(isQuadKernelSupported(kernel))
+            measure("Brute force", kernel, 0);
+    }
+
+    lightmap->setOcclusionBackend(OcclusionBackend::BVH);
+    auto bvh = lightmap->getQuadSurfaceBVH();
+    for(auto leafQuadCount : leafQuadCounts)
+    {
+        bvh->setMaxLeafQuadCount(leafQuadCount);
+        bvh->build(lightmap->quadSurfaces);
+        for(auto kernel : kernels)
+        {
+            if(isQuadKernelSupported(kernel))
+                measure("BVH", kernel, leafQuadCount);
+        }
+    }
+}
+
+/**
+ * Compares the form factors traced with single rays and with ray packets.
+ */
+static void benchmarkRayPackets(const LightmapPtr &lightmap)
+{
+    printf("Ray packet benchmark: %zu quads, %s kernel\n", lightmap->quadSurfaces.size(),
+        getQuadKernelName(lightmap->getQuadKernel()));
+    lightmap->setOcclusionBackend(OcclusionBackend::BVH);
+
+    // The classified pairs are not traced as packets.
+    lightmap->setSurfaceVisibilityClassification(false);
+
+    size_t referenceLinkCount = 0;
+    double referenceTime = 0.0;
+    for(auto packets : {false, true})
+    {
+        lightmap->setOcclusionRayPackets(packets);
+        auto startTime = currentTimeInMilliseconds();
+        lightmap->computeRadiosityFactors();
+        auto formFactorTime = currentTimeInMilliseconds() - startTime;
+
+        auto linkCount = lightmap->viewFactors.getNonZeroCount();
+        if(!packets)
+        {
+            referenceLinkCount = linkCount;
+            referenceTime = formFactorTime;
+        }
+
+        printf("  %-24s form factors %10.2f ms  speedup %6.2fx  link count difference %td\n",
+            packets ? "Ray packets" : "Single rays", formFactorTime, referenceTime / formFactorTime,
+            ptrdiff_t(linkCount) - ptrdiff_t(referenceLinkCount));
+    }
+}
+
+/**
+ * Form factor build time for growing thread counts, up to the -threads
+ * option, or all the hardware threads with -threads 0.
+ */
+static void benchmarkFormFactors(const LightmapPtr &lightmap)
+{
+    size_t maxThreadCount = options.threads > 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+    printf("Form factor benchmark: %zu patches, up to %zu threads\n", lightmap->patches.size(), maxThreadCount);
+
+    size_t referenceLinkCount = 0;
+    double referenceTime = 0.0;
+    for(size_t threadCount = 1; ; threadCount = std::min(threadCount*2, maxThreadCount))
+    {
+        ThreadPoolPtr threadPool;
+        if(threadCount > 1)
+            threadPool = std::make_shared<ThreadPool> (threadCount);
+        lightmap->setThreadPool(threadPool);
+
+        auto startTime = currentTimeInMilliseconds();
+        lightmap->computeRadiosityFactors();
+        auto formFactorTime = currentTimeInMilliseconds() - startTime;
+
+        auto linkCount = lightmap->viewFactors.getNonZeroCount();
+        if(threadCount == 1)
+        {
+            referenceLinkCount = linkCount;
+            referenceTime = formFactorTime;
+        }
+
+        auto speedup = referenceTime / formFactorTime;
+        printf("  %3zu threads  form factors %10.2f ms  speedup %6.2fx  efficiency %5.1f%%  link count difference %td\n",
+            threadCount, formFactorTime, speedup, speedup / threadCount*100.0,
+            ptrdiff_t(linkCount) - ptrdiff_t(referenceLinkCount));
+
+        if(threadCount == maxThreadCount)
+            break;
+    }
+}
+
+/**
+ * Form factor build time without the cache, with a cold cache, and with a
+ * warm cache. A corrupted cache file must be detected and rebuilt.
+ */
+static void benchmarkFormFactorCache(const LightmapPtr &lightmap)
+{
+    FormFactorCache cache(options.cacheDirectory);
+    auto key = FormFactorCache::computeKey(*lightmap);
+    auto fileName = cache.getFileName(key);
+    printf("Form factor cache benchmark: '%s'\n", fileName.c_str());
+    remove(fileName.c_str());
+
+    auto startTime = currentTimeInMilliseconds();
+    lightmap->computeRadiosityFactors();
+    printf("  %-24s %10.2f ms\n", "Computed", currentTimeInMilliseconds() - startTime);
+    auto reference = lightmap->viewFactors;
+
+    lightmap->setFormFactorCacheDirectory(options.cacheDirectory);
+    auto measureBuild = [&](const char *name) {
+        lightmap->viewFactors.clear();
+        auto startTime = currentTimeInMilliseconds();
+        lightmap->buildRadiosityFactors();
+        auto buildTime = currentTimeInMilliseconds() - startTime;
+
+        auto &viewFactors = lightmap->viewFactors;
+        auto identical = viewFactors.rowOffsets == reference.rowOffsets && viewFactors.columns == reference.columns &&
+            viewFactors.values == reference.values;
+        printf("  %-24s %10.2f ms  %s\n", name, buildTime, identical ? "identical" : "DIFFERENT");
+    };
+
+    measureBuild("Cold cache");
+    measureBuild("Warm cache");
+
+    // Flip a byte in the values.
+    auto f = fopen(fileName.c_str(), "r+b");
+    if(f)
+    {
+        fseek(f, -1, SEEK_END);
+        auto byte = fgetc(f);
+        fseek(f, -1, SEEK_END);
+        fputc(byte ^ 0xFF, f);
+        fclose(f);
+        measureBuild("Corrupt cache");
+        measureBuild("Rebuilt cache");
+    }
+
+    remove(fileName.c_str());
+}
+
+/**
+ * Compares the hemicube form factors with the pairwise rays, on the
+ * visibility of their links and on how much of the hemisphere they cover.
+ */
+static void benchmarkHemicube(const LightmapPtr &lightmap)
+{
+    ThreadPoolPtr threadPool;
+    if(options.threads != 1)
+        threadPool = std::make_shared<ThreadPool> (options.threads);
+    lightmap->setThreadPool(threadPool);
+    printf("Hemicube benchmark: %zu patches, %zu quads\n", lightmap->patches.size(), lightmap->quadSurfaces.size());
+
+    lightmap->setFormFactorMethod(FormFactorMethod::PairwiseRays);
+    auto startTime = currentTimeInMilliseconds();
+    lightmap->computeRadiosityFactors();
+    printf("  %-24s form factors %10.2f ms  %zu links\n", "Pairwise rays", currentTimeInMilliseconds() - startTime,
+        lightmap->viewFactors.getNonZeroCount());
+    auto pairwise = lightmap->viewFactors;
+
+    lightmap->setFormFactorMethod(FormFactorMethod::Hemicube);
+    for(size_t resolution : {32, 64, 128})
+    {
+        lightmap->setHemicubeResolution(resolution);
+        startTime = currentTimeInMilliseconds();
+        lightmap->computeRadiosityFactors();
+        auto formFactorTime = currentTimeInMilliseconds() - startTime;
+
+        // The share of the hemicube links that the rays also found visible.
+        auto &hemicube = lightmap->viewFactors;
+        size_t sharedCount = 0;
+        double rowSumTotal = 0.0;
+        for(size_t i = 0; i < lightmap->patches.size(); ++i)
+        {
+            rowSumTotal += hemicube.rowSum(i);
+            auto begin = pairwise.columns.begin() + pairwise.rowBegin(i);
+            auto end = pairwise.columns.begin() + pairwise.rowEnd(i);
+            for(size_t k = hemicube.rowBegin(i); k < hemicube.rowEnd(i); ++k)
+                sharedCount += std::binary_search(begin, end, hemicube.columns[k]);
+        }
+
+        char name[64];
+        snprintf(name, sizeof(name), "Hemicube %zu", resolution);
+        printf("  %-24s form factors %10.2f ms  %zu links  %.1f%% also visible to the rays  mean row sum %.3f\n", name,
+            formFactorTime, hemicube.getNonZeroCount(), sharedCount*100.0 / std::max(hemicube.getNonZeroCount(), size_t(1)),
+            rowSumTotal / lightmap->patches.size());
+    }
+}
+
+/**
+ * Builds the form factors with several pruning epsilons, and compares the
+ * solved indirect light with the one of the unpruned transport.
+ */
+static void benchmarkPruning(const LightmapPtr &lightmap)
+{
+    ThreadPoolPtr threadPool;
+    if(options.threads != 1)
+        threadPool = std::make_shared<ThreadPool> (options.threads);
+    lightmap->setThreadPool(threadPool);
+    printf("Pruning benchmark: %zu patches\n", lightmap->patches.size());
+
+    RadianceBuffer directLight;
+    RadianceBuffer referenceIndirectLight;
+    for(float epsilon : {0.0f, 1e-6f, 1e-5f, 1e-4f, 1e-3f})
+    {
+        lightmap->setFormFactorEpsilon(epsilon);
+        auto startTime = currentTimeInMilliseconds();
+        lightmap->computeRadiosityFactors();
+        auto formFactorTime = currentTimeInMilliseconds() - startTime;
+
+        RadianceBuffer indirectLight;
+        lightmap->computeDirectLights(sceneLights(), directLight);
+        lightmap->solveIndirectLight(directLight, indirectLight);
+        if(epsilon == 0.0f)
+            referenceIndirectLight = indirectLight;
+
+        char name[64];
+        snprintf(name, sizeof(name), "Epsilon %g", epsilon);
+        printf("  %-24s form factors %10.2f ms  %zu links  %zu KB  pruned %.3f%%  relative error %g\n", name,
+            formFactorTime, lightmap->viewFactors.getNonZeroCount(), lightmap->viewFactors.getMemorySize() / 1024,
+            lightmap->getPrunedFormFactorFraction()*100.0, computeRelativeError(indirectLight, referenceIndirectLight));
+    }
+}
+
+/**
+ * Builds the Monte Carlo form factors with several sample budgets, and
+ * compares their solved indirect light with the one of the largest sample
+ * count. The single centre ray per pair is measured against it too.
+ */
+static void benchmarkMonteCarlo(const LightmapPtr &lightmap)
+{
+    ThreadPoolPtr threadPool;
+    if(options.threads != 1)
+        threadPool = std::make_shared<ThreadPool> (options.threads);
+    lightmap->setThreadPool(threadPool);
+    printf("Monte Carlo benchmark: %zu patches\n", lightmap->patches.size());
+
+    RadianceBuffer directLight;
+    lightmap->computeDirectLights(sceneLights(), directLight);
+    auto measure = [&](FormFactorMethod method, size_t budget, RadianceBuffer &indirectLight) {
+        lightmap->setFormFactorMethod(method);
+        lightmap->setFormFactorSampleBudget(budget);
+        auto startTime = currentTimeInMilliseconds();
+        lightmap->computeRadiosityFactors();
+        auto formFactorTime = currentTimeInMilliseconds() - startTime;
+        lightmap->solveIndirectLight(directLight, indirectLight);
+        return formFactorTime;
+    };
+
+    RadianceBuffer referenceIndirectLight;
+    auto referenceTime = measure(FormFactorMethod::MonteCarlo, ~size_t(0), referenceIndirectLight);
+    printf("  %-24s form factors %10.2f ms\n", "Reference", referenceTime);
+
+    RadianceBuffer indirectLight;
+    auto formFactorTime = measure(FormFactorMethod::PairwiseRays, 0, indirectLight);
+    printf("  %-24s form factors %10.2f ms  relative error %g\n", "Centre rays", formFactorTime,
+        computeRelativeError(indirectLight, referenceIndirectLight));
+
+    for(size_t budget : {1u << 20, 4u << 20, 16u << 20, 64u << 20})
+    {
+        formFactorTime = measure(FormFactorMethod::MonteCarlo, budget, indirectLight);
+
+        char name[64];
+        snprintf(name, sizeof(name), "Budget %zuM rays", budget >> 20);
+        printf("  %-24s form factors %10.2f ms  relative error %g\n", name, formFactorTime,
+            computeRelativeError(indirectLight, referenceIndirectLight));
+    }
+
+    lightmap->setFormFactorMethod(FormFactorMethod::PairwiseRays);
+    lightmap->setFormFactorSampleBudget(Lightmap::DefaultFormFactorSampleBudget);
+}
+
+// The links that only one of the matrices has, and the largest difference
+// of the shared ones.
+static size_t countDifferentLinks(const SparseMatrix &matrix, const SparseMatrix &reference, float &maxDifference)
+{
+    size_t differentCount = 0;
+    maxDifference = 0.0f;
+    for(size_t i = 0; i < matrix.getRowCount(); ++i)
+    {
+        auto k = matrix.rowBegin(i);
+        auto l = reference.rowBegin(i);
+        while(k < matrix.rowEnd(i) || l < reference.rowEnd(i))
+        {
+            if(l == reference.rowEnd(i) || (k < matrix.rowEnd(i) && matrix.columns[k] < reference.columns[l]))
+            {
+                ++differentCount;
+                ++k;
+            }
+            else if(k == matrix.rowEnd(i) || reference.columns[l] < matrix.columns[k])
+            {
+                ++differentCount;
+                ++l;
+            }
+            else
+            {
+                maxDifference = std::max(maxDifference, fabsf(matrix.values[k] - reference.values[l]));
+                ++k;
+                ++l;
+            }
+        }
+    }
+
+    return differentCount;
+}
+
+/**
+ * Moves the last cube of the scene and patches the form factors, then adds
+ * and removes an occluder. The patched links are compared with a full
+ * rebuild of the same geometry.
+ */
+static void benchmarkIncrementalUpdate(const LightmapPtr &lightmap)
+{
+    ThreadPoolPtr threadPool;
+    if(options.threads != 1)
+        threadPool = std::make_shared<ThreadPool> (options.threads);
+    lightmap->setThreadPool(threadPool);
+    printf("Incremental update benchmark: %zu patches, %zu quads\n", lightmap->patches.size(), lightmap->quadSurfaces.size());
+
+    auto startTime = currentTimeInMilliseconds();
+    lightmap->computeRadiosityFactors();
+    lightmap->computeDirectLights(sceneLights());
+    printf("  %-24s %10.2f ms\n", "Full build", currentTimeInMilliseconds() - startTime);
+
+    // The six faces of a cube are the last quads.
+    auto quadCount = lightmap->quadSurfaces.size();
+    std::vector<uint32_t> cubeQuads;
+    for(size_t i = quadCount - std::min(quadCount, size_t(6)); i < quadCount; ++i)
+        cubeQuads.push_back(i);
+
+    auto compareWithRebuild = [&](const char *name, double updateTime) {
+        auto patched = lightmap->viewFactors;
+        auto rebuildStart = currentTimeInMilliseconds();
+        lightmap->computeRadiosityFactors();
+        auto rebuildTime = currentTimeInMilliseconds() - rebuildStart;
+
+        float maxDifference;
+        auto differentCount = countDifferentLinks(patched, lightmap->viewFactors, maxDifference);
+        printf("  %-24s update %10.2f ms  rebuild %10.2f ms  %zu links  %zu different links  max difference %g\n", name,
+            updateTime, rebuildTime, patched.getNonZeroCount(), differentCount, maxDifference);
+        requireNoDifferentLinks(name, differentCount);
+    };
+
+    startTime = currentTimeInMilliseconds();
+    lightmap->moveQuadSurfaces(cubeQuads, glm::translate(glm::mat4(1.0f), glm::vec3(0.25f, 0.0f, 0.1f)));
+    compareWithRebuild("Move a cube", currentTimeInMilliseconds() - startTime);
+
+    // A floating panel, without patches of its own.
+    LightmapCompactQuadSurface panel;
+    panel.normal = glm::vec3(0.0f, 1.0f, 0.0f);
+    panel.tangent = glm::vec3(1.0f, 0.0f, 0.0f);
+    panel.bitangent = glm::vec3(0.0f, 0.0f, 1.0f);
+    panel.distance = 1.2f;
+    panel.vertices[0] = glm::vec2(-0.4f, -0.4f);
+    panel.vertices[1] = glm::vec2(0.4f, -0.4f);
+    panel.vertices[2] = glm::vec2(0.4f, 0.4f);
+    panel.vertices[3] = glm::vec2(-0.4f, 0.4f);
+
+    startTime = currentTimeInMilliseconds();
+    auto panelIndex = lightmap->addOccluderQuadSurfaces({panel});
+    compareWithRebuild("Add an occluder", currentTimeInMilliseconds() - startTime);
+
+    startTime = currentTimeInMilliseconds();
+    lightmap->removeOccluderQuadSurfaces({uint32_t(panelIndex)});
+    compareWithRebuild("Remove the occluder", currentTimeInMilliseconds() - startTime);
+}
+
+/**
+ * Builds the links again from the visibility matrix, at the same epsilon, at
+ * a larger one and at a smaller one, and compares them with the links
+ * computed with rays. The smaller epsilon computes the form factors again.
+ */
+static void benchmarkVisibilityMatrix(const LightmapPtr &lightmap)
+{
+    ThreadPoolPtr threadPool;
+    if(options.threads != 1)
+        threadPool = std::make_shared<ThreadPool> (options.threads);
+    lightmap->setThreadPool(threadPool);
+    printf("Visibility matrix benchmark: %zu patches\n", lightmap->patches.size());
+
+    auto defaultEpsilon = lightmap->getFormFactorEpsilon();
+    for(auto epsilon : {defaultEpsilon, defaultEpsilon*10.0f, defaultEpsilon*0.1f})
+    {
+        lightmap->setFormFactorEpsilon(defaultEpsilon);
+        lightmap->computeRadiosityFactors();
+        auto &visibility = lightmap->getVisibilityMatrix();
+        printf("  Visibility %zu KB for %zu pairs, links %zu KB\n", visibility.getMemorySize() / 1024,
+            visibility.getVisibleCount(), lightmap->viewFactors.getMemorySize() / 1024);
+
+        lightmap->setFormFactorEpsilon(epsilon);
+        auto startTime = currentTimeInMilliseconds();
+        lightmap->rebuildTransportFromVisibility();
+        auto rebuildTime = currentTimeInMilliseconds() - startTime;
+        auto rebuilt = lightmap->viewFactors;
+
+        startTime = currentTimeInMilliseconds();
+        lightmap->computeRadiosityFactors();
+        auto computeTime = currentTimeInMilliseconds() - startTime;
+
+        float maxDifference;
+        auto differentCount = countDifferentLinks(rebuilt, lightmap->viewFactors, maxDifference);
+        char name[64];
+        snprintf(name, sizeof(name), "Epsilon %g", epsilon);
+        printf("  %-24s rebuild %10.2f ms  rays %10.2f ms  %zu links  %zu different links  max difference %g\n", name,
+            rebuildTime, computeTime, rebuilt.getNonZeroCount(), differentCount, maxDifference);
+    }
+
+    lightmap->setFormFactorEpsilon(defaultEpsilon);
+}
+
+/**
+ * Places a floating cube, which is a lightmap of its own, in the room and
+ * builds the links of the room with the two level scene occlusion. The cube
+ * is then moved, and its quads are edited. The updates of the room are
+ * compared with a full rebuild.
+ */
+static void benchmarkSceneOcclusion(const LightmapPtr &lightmap)
+{
+    ThreadPoolPtr threadPool;
+    if(options.threads != 1)
+        threadPool = std::make_shared<ThreadPool> (options.threads);
+    lightmap->setThreadPool(threadPool);
+
+    auto cube = GenericMeshBuilder()
+        .identity()
+        .addCube(glm::vec3(0.4, 0.4, 0.4))
+        .buildLightmap();
+    printf("Scene occlusion benchmark: %zu patches, %zu quads, cube with %zu quads\n", lightmap->patches.size(),
+        lightmap->quadSurfaces.size(), cube->quadSurfaces.size());
+
+    // Every pair is traced through the scene, so the timings measure the
+    // two level occlusion rather than the classification of the room.
+    lightmap->setSurfaceVisibilityClassification(false);
+
+    auto startTime = currentTimeInMilliseconds();
+    lightmap->computeRadiosityFactors();
+    printf("  %-24s %10.2f ms  %zu links\n", "Room alone", currentTimeInMilliseconds() - startTime,
+        lightmap->viewFactors.getNonZeroCount());
+
+    std::vector<glm::mat4> transforms {
+        glm::mat4(1.0f),
+        glm::translate(glm::mat4(1.0f), glm::vec3(0.8f, 1.2f, 0.6f))
+    };
+
+    startTime = currentTimeInMilliseconds();
+    auto sceneOcclusion = std::make_shared<SceneOcclusion> ();
+    sceneOcclusion->addInstance(lightmap.get(), transforms[0]);
+    sceneOcclusion->addInstance(cube.get(), transforms[1]);
+    sceneOcclusion->build();
+    auto buildTime = currentTimeInMilliseconds() - startTime;
+
+    lightmap->setSceneOcclusion(sceneOcclusion, 0);
+    cube->setSceneOcclusion(sceneOcclusion, 1);
+    startTime = currentTimeInMilliseconds();
+    lightmap->computeRadiosityFactors();
+    printf("  %-24s %10.2f ms  %zu links  scene built in %.3f ms\n", "Room with the cube", currentTimeInMilliseconds() - startTime,
+        lightmap->viewFactors.getNonZeroCount(), buildTime);
+    printf("  %-24s room %zu KB  cube %zu KB, shared with the lightmaps\n", "Bottom level BVH",
+        lightmap->getQuadSurfaceBVH()->getMemorySize() / 1024, cube->getQuadSurfaceBVH()->getMemorySize() / 1024);
+
+    auto compareWithRebuild = [&](const char *name, double updateTime) {
+        auto patched = lightmap->viewFactors;
+        auto rebuildStart = currentTimeInMilliseconds();
+        lightmap->computeRadiosityFactors();
+        auto rebuildTime = currentTimeInMilliseconds() - rebuildStart;
+
+        float maxDifference;
+        auto differentCount = countDifferentLinks(patched, lightmap->viewFactors, maxDifference);
+        printf("  %-24s update %10.2f ms  rebuild %10.2f ms  %zu links  %zu different links  max difference %g\n", name,
+            updateTime, rebuildTime, patched.getNonZeroCount(), differentCount, maxDifference);
+    };
+
+    transforms[1] = glm::translate(glm::mat4(1.0f), glm::vec3(-0.6f, 1.0f, -0.4f));
+    std::vector<std::vector<Box3>> changedRegions;
+    startTime = currentTimeInMilliseconds();
+    sceneOcclusion->moveInstances(transforms, changedRegions);
+    auto refitTime = currentTimeInMilliseconds() - startTime;
+
+    printf("  %-24s refit %.3f ms\n", "Move the cube", refitTime);
+
+    startTime = currentTimeInMilliseconds();
+    lightmap->updateSceneOcclusion(changedRegions[0]);
+    compareWithRebuild("Move the cube", currentTimeInMilliseconds() - startTime);
+
+    // Stretch the top of the cube upwards, in the mesh space of the cube.
+    std::vector<uint32_t> topQuads;
+    for(size_t i = 0; i < cube->quadSurfaces.size(); ++i)
+    {
+        if(cube->quadSurfaces[i].normal.y > 0.5f)
+            topQuads.push_back(i);
+    }
+
+    startTime = currentTimeInMilliseconds();
+    cube->moveQuadSurfaces(topQuads, glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, 0.3f, 0.0f)));
+    compareWithRebuild("Move the cube top", currentTimeInMilliseconds() - startTime);
+
+    lightmap->setSceneOcclusion(nullptr, SceneOcclusion::NoInstance);
+    cube->setSceneOcclusion(nullptr, SceneOcclusion::NoInstance);
+}
+
+/**
+ * Compares the memory and the ray throughput of the BVH and of the voxel
+ * grid at several resolutions, on the rays between random patch pairs. The
+ * brute force test is the reference.
+ */
+static void benchmarkVoxelGrid(const LightmapPtr &lightmap)
+{
+    auto &patches = lightmap->patches;
+    printf("Voxel grid benchmark: %zu patches, %zu quads\n", patches.size(), lightmap->quadSurfaces.size());
+    if(patches.empty())
+        return;
+
+    // The same pairs for every backend, on different surfaces.
+    const size_t RayCount = 1 << 20;
+    std::vector<std::pair<uint32_t, uint32_t>> pairs;
+    pairs.reserve(RayCount);
+    uint32_t seed = 1;
+    auto nextRandom = [&]() {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+    };
+    while(pairs.size() < RayCount)
+    {
+        auto first = nextRandom() % patches.size();
+        auto second = nextRandom() % patches.size();
+        if(patches[first].surfaceIndex != patches[second].surfaceIndex)
+            pairs.push_back(std::make_pair(uint32_t(first), uint32_t(second)));
+    }
+
+    std::vector<uint8_t> reference;
+    auto traceRays = [&](const char *name, size_t memorySize) {
+        std::vector<uint8_t> occluded(RayCount);
+        auto startTime = currentTimeInMilliseconds();
+        for(size_t i = 0; i < RayCount; ++i)
+        {
+            auto &first = patches[pairs[i].first];
+            auto &second = patches[pairs[i].second];
+            occluded[i] = lightmap->isRayOccluded(first.position, first.surfaceIndex, second.position, second.surfaceIndex);
+        }
+        auto rayTime = currentTimeInMilliseconds() - startTime;
+
+        if(reference.empty())
+            reference = occluded;
+
+        size_t occludedCount = 0;
+        size_t differentCount = 0;
+        for(size_t i = 0; i < RayCount; ++i)
+        {
+            occludedCount += occluded[i];
+            differentCount += occluded[i] != reference[i];
+        }
+
+        printf("  %-28s %8zu KB  %8.3f Mrays/s  %5.1f%% occluded  %zu different rays\n", name, memorySize / 1024,
+            RayCount / (rayTime*1000.0), occludedCount*100.0 / RayCount, differentCount);
+    };
+
+    lightmap->setOcclusionBackend(OcclusionBackend::BruteForce);
+    traceRays("Brute force", lightmap->getPackedQuadSurfaces().getMemorySize());
+
+    lightmap->setOcclusionBackend(OcclusionBackend::BVH);
+    traceRays("BVH", lightmap->getQuadSurfaceBVH()->getMemorySize());
+
+    lightmap->setOcclusionBackend(OcclusionBackend::VoxelGrid);
+    auto voxelGrid = lightmap->getQuadSurfaceVoxelGrid();
+    for(auto voxelsPerQuad : {2.0f, 8.0f, 32.0f, 128.0f})
+    {
+        voxelGrid->setVoxelsPerQuad(voxelsPerQuad);
+        voxelGrid->build(lightmap->quadSurfaces);
+
+        auto resolution = voxelGrid->getResolution();
+        char name[64];
+        snprintf(name, sizeof(name), "Voxel grid %dx%dx%d", resolution.x, resolution.y, resolution.z);
+        traceRays(name, voxelGrid->getMemorySize());
+    }
+}
+
+/**
+ * Compares the pairwise form factors with and without the classification of
+ * the surface pairs.
+ */
+static void benchmarkSurfaceVisibility(const LightmapPtr &lightmap)
+{
+    ThreadPoolPtr threadPool;
+    if(options.threads != 1)
+        threadPool = std::make_shared<ThreadPool> (options.threads);
+    lightmap->setThreadPool(threadPool);
+    printf("Surface visibility benchmark: %zu patches, %zu quads\n", lightmap->patches.size(), lightmap->quadSurfaces.size());
+
+    SparseMatrix reference;
+    for(auto classification : {false, true})
+    {
+        lightmap->setSurfaceVisibilityClassification(classification);
+        auto startTime = currentTimeInMilliseconds();
+        lightmap->computeRadiosityFactors();
+        auto formFactorTime = currentTimeInMilliseconds() - startTime;
+
+        auto &viewFactors = lightmap->viewFactors;
+        if(!classification)
+            reference = viewFactors;
+
+        // The links that only one of the two found.
+        size_t differentCount = 0;
+        for(size_t i = 0; i < lightmap->patches.size(); ++i)
+        {
+            std::vector<uint32_t> difference;
+            std::set_symmetric_difference(viewFactors.columns.begin() + viewFactors.rowBegin(i),
+                viewFactors.columns.begin() + viewFactors.rowEnd(i),
+                reference.columns.begin() + reference.rowBegin(i), reference.columns.begin() + reference.rowEnd(i),
+                std::back_inserter(difference));
+            differentCount += difference.size();
+        }
+
+        printf("  %-24s form factors %10.2f ms  %zu links  %zu different links\n",
+            classification ? "Classified pairs" : "Ray per patch pair", formFactorTime, viewFactors.getNonZeroCount(),
+            differentCount);
+        requireNoDifferentLinks("The classification", differentCount);
+    }
+}
+
+/**
+ * Builds the pairwise form factors with and without the patch cluster
+ * culling. The links must be the same.
+ */
+static void benchmarkPatchClusters(const LightmapPtr &lightmap)
+{
+    ThreadPoolPtr threadPool;
+    if(options.threads != 1)
+        threadPool = std::make_shared<ThreadPool> (options.threads);
+    lightmap->setThreadPool(threadPool);
+    printf("Patch cluster benchmark: %zu patches, %zu quads\n", lightmap->patches.size(), lightmap->quadSurfaces.size());
+
+    SparseMatrix reference;
+    for(auto culling : {false, true})
+    {
+        lightmap->setPatchClusterCulling(culling);
+        auto startTime = currentTimeInMilliseconds();
+        lightmap->computeRadiosityFactors();
+        auto formFactorTime = currentTimeInMilliseconds() - startTime;
+
+        auto &viewFactors = lightmap->viewFactors;
+        if(!culling)
+            reference = viewFactors;
+
+        size_t differentCount = 0;
+        for(size_t i = 0; i < lightmap->patches.size(); ++i)
+        {
+            std::vector<uint32_t> difference;
+            std::set_symmetric_difference(viewFactors.columns.begin() + viewFactors.rowBegin(i),
+                viewFactors.columns.begin() + viewFactors.rowEnd(i),
+                reference.columns.begin() + reference.rowBegin(i), reference.columns.begin() + reference.rowEnd(i),
+                std::back_inserter(difference));
+            differentCount += difference.size();
+        }
+
+        printf("  %-24s form factors %10.2f ms  %zu links  %zu different links\n",
+            culling ? "Cluster culling" : "Every patch pair", formFactorTime, viewFactors.getNonZeroCount(),
+            differentCount);
+    }
+}
+
+static void printUsage()
+{
+    printf("Usage: LightmapBenchmark [options] [benchmarks...]\n");
+    printf("Options:\n");
+    printf("  -scene demo|generated   The scene to use (default: demo)\n");
+    printf("  -cubes N                Cube count of the generated scene (default: 9)\n");
+    printf("  -passes N               Number of solver passes (default: 20)\n");
+    printf("  -threads N              Worker threads, 0 for all the hardware threads (default: 1)\n");
+    printf("  -reflectivity R         Surface reflectivity for the solver benchmark (default: 0.8)\n");
+    printf("  -omega W                Over-relaxation factor for the solver benchmark (default: 1.3)\n");
+    printf("  -residual E             Residual reached by the solver benchmark (default: 0.1/255)\n");
+    printf("  -max-passes N           Pass limit of the solver benchmark (default: 500)\n");
+    printf("  -tile N                 Column tile size for the ordering benchmark (default: 16384)\n");
+    printf("  -rank N                 Low rank transport rank (default: 32)\n");
+    printf("  -cache DIR              Form factor cache directory (default: .)\n");
+    printf("Benchmarks:\n");
+    printf("  gather                  Transport gather kernels\n");
+    printf("  solvers                 Passes needed by each iterative solver\n");
+    printf("  ordering                Patch orders and column tiled gather\n");
+    printf("  lights                  Light intensity edits with cached light responses\n");
+    printf("  lowrank                 Low rank transport error and relighting time\n");
+    printf("  occlusion               Occlusion backends on the form factors\n");
+    printf("  quads                   Quad intersection kernels on the form factors\n");
+    printf("  packets                 Single rays and ray packets on the form factors\n");
+    printf("  formfactors             Form factor build scaling with the thread count\n");
+    printf("  cache                   Form factor cache loading and validation\n");
+    printf("  hemicube                Hemicube and pairwise ray form factors\n");
+    printf("  pruning                 Form factor pruning epsilons and their error\n");
+    printf("  visibility              Surface pair visibility classification\n");
+    printf("  clusters                Normal cone culling of the patch clusters\n");
+    printf("  montecarlo              Monte Carlo form factor sample budgets\n");
+    printf("  incremental             Form factor updates after moving geometry\n");
+    printf("  visibilitymatrix        Links rebuilt from the visibility bits\n");
+    printf("  voxelgrid               Voxel grid and BVH memory and ray throughput\n");
+    printf("  sceneocclusion          Occlusion between lightmaps and their refit\n");
+}
+
+static bool parseCommandLine(int argc, char *argv[])
+{
+    for(int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        auto hasValue = i + 1 < argc;
+        if(arg == "-scene" && hasValue)
+            options.scene = argv[++i];
+        else if(arg == "-cubes" && hasValue)
+            options.cubeCount = atoi(argv[++i]);
+        else if(arg == "-passes" && hasValue)
+            options.passes = std::max(1, atoi(argv[++i]));
+        else if(arg == "-threads" && hasValue)
+            options.threads = atoi(argv[++i]);
+        else if(arg == "-reflectivity" && hasValue)
+            options.reflectivity = atof(argv[++i]);
+        else if(arg == "-omega" && hasValue)
+            options.relaxationFactor = atof(argv[++i]);
+        else if(arg == "-residual" && hasValue)
+            options.targetResidual = atof(argv[++i]);
+        else if(arg == "-max-passes" && hasValue)
+            options.maxPasses = std::max(1, atoi(argv[++i]));
+        else if(arg == "-tile" && hasValue)
+            options.columnTileSize = atoi(argv[++i]);
+        else if(arg == "-rank" && hasValue)
+            options.rank = std::max(1, atoi(argv[++i]));
+        else if(arg == "-cache" && hasValue)
+            options.cacheDirectory = argv[++i];
+        else if(arg == "-h" || arg == "-help")
+            return false;
+        else if(!arg.empty() && arg[0] != '-')
+            options.benchmarks.push_back(arg);
+        else
+        {
+            fprintf(stderr, "Unknown option '%s'\n", arg.c_str());
+            return false;
+        }
+    }
+
+    if(options.benchmarks.empty())
+        options.benchmarks.push_back("gather");
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    if(!parseCommandLine(argc, argv))
+    {
+        printUsage();
+        return 1;
+    }
+
+    for(auto &benchmark : options.benchmarks)
+    {
+        auto lightmap = buildScene();
+        lightmap->createBuffers();
+
+        if(benchmark == "gather")
+            benchmarkGather(lightmap);
+        else if(benchmark == "solvers")
+            benchmarkSolvers(lightmap);
+        else if(benchmark == "ordering")
+            benchmarkOrdering(lightmap);
+        else if(benchmark == "lights")
+            benchmarkLightResponses(lightmap);
+        else if(benchmark == "lowrank")
+            benchmarkLowRank(lightmap);
+        else if(benchmark == "occlusion")
+            benchmarkOcclusion(lightmap);
+        else if(benchmark == "quads")
+            benchmarkQuadKernels(lightmap);
+        else if(benchmark == "packets")
+            benchmarkRayPackets(lightmap);
+        else if(benchmark == "formfactors")
+            benchmarkFormFactors(lightmap);
+        else if(benchmark == "cache")
+            benchmarkFormFactorCache(lightmap);
+        else if(benchmark == "hemicube")
+            benchmarkHemicube(lightmap);
+        else if(benchmark == "pruning")
+            benchmarkPruning(lightmap);
+        else if(benchmark == "visibility")
+            benchmarkSurfaceVisibility(lightmap);
+        else if(benchmark == "clusters")
+            benchmarkPatchClusters(lightmap);
+        else if(benchmark == "montecarlo")
+            benchmarkMonteCarlo(lightmap);
+        else if(benchmark == "incremental")
+            benchmarkIncrementalUpdate(lightmap);
+        else if(benchmark == "visibilitymatrix")
+            benchmarkVisibilityMatrix(lightmap);
+        else if(benchmark == "voxelgrid")
+            benchmarkVoxelGrid(lightmap);
+        else if(benchmark == "sceneocclusion")
+            benchmarkSceneOcclusion(lightmap);
+        else
+            fprintf(stderr, "Unknown benchmark '%s'\n", benchmark.c_str());
+    }
+
+    return failedCheckCount ? 1 : 0;
+}
@@ -4,11 +4,14 @@
 #include "Mesh.hpp"
 #include "Lightmap.hpp"
 #include "Light.hpp"
+#include "SceneOcclusion.hpp"
+#include "ThreadPool.hpp"
+#include <algorithm>
 
 namespace RadiosityTest
 {
 LightmapBuildProcess::LightmapBuildProcess()
-    : running(false)
+    : workerCount(0), running(false)
 {
 }
 
@@ -23,6 +26,9 @@ void LightmapBuildProcess::start()
         return;
 
     running = true;
+    if(!threadPool)
+        threadPool = std::make_shared<ThreadPool> (workerCount);
+
     std::thread t([=]{
         threadProcess();
     });
@@ -35,6 +41,7 @@ void LightmapBuildProcess::shutdown()
         std::unique_lock<std::mutex> l(mutex);
         running = false;
     }
+    wakeCondition.notify_all();
     thread.join();
 }
 
@@ -51,13 +58,23 @@ void LightmapBuildProcess::threadProcess()
             currentScene = theScene;
         }
 
-        processScene(currentScene);
+        auto processedAny = processScene(currentScene);
         pendingLightmaps.clear();
+        pendingTransforms.clear();
         currentLights.clear();
+
+        // Do not spin once everything has converged. The scene is polled
+        // again later, so that a change in the lights resumes the solver.
+        if(!processedAny)
+        {
+            std::unique_lock<std::mutex> l(mutex);
+            if(running)
+                wakeCondition.wait_for(l, std::chrono::milliseconds(IdlePollIntervalMilliseconds));
+        }
     }
 }
 
-void LightmapBuildProcess::processScene(const ScenePtr &scene)
+bool LightmapBuildProcess::processScene(const ScenePtr &scene)
 {
     class Visitor : public SceneVisitor
     {
@@ -69,7 +86,10 @@ void LightmapBuildProcess::processScene(const ScenePtr &scene)
         {
             auto &mesh = object->getMesh();
             if(mesh && mesh->lightmap)
+            {
                 self->pendingLightmaps.push_back(mesh->lightmap);
+                self->pendingTransforms.push_back(object->getCurrentTransform());
+            }
         }
 
         void visitLight(Light *light)
@@ -81,7 +101,7 @@ void LightmapBuildProcess::processScene(const ScenePtr &scene)
     };
 
     if(!scene)
-        return;
+        return false;
 
     {
         std::unique_lock<std::mutex> (scene->getMutex());
@@ -92,8 +112,92 @@ void LightmapBuildProcess::processScene(const ScenePtr &scene)
         }
     }
 
-    for(auto &lightmap : pendingLightmaps)
-        lightmap->process(currentLights);
+    updateSceneOcclusion();
+
+    // New lightmaps are never converged, so they are processed right away.
+    // A lightmap shared by several objects is solved in the space of the
+    // first one.
+    bool processedAny = false;
+    for(size_t i = 0; i < pendingLightmaps.size(); ++i)
+    {
+        auto &lightmap = pendingLightmaps[i];
+        if(std::find(pendingLightmaps.begin(), pendingLightmaps.begin() + i, lightmap) != pendingLightmaps.begin() + i)
+            continue;
+
+        auto lights = computeMeshSpaceLights(glm::inverse(pendingTransforms[i]));
+        if(!lightmap->needsProcessing(lights))
+            continue;
+
+        lightmap->setThreadPool(threadPool);
+        lightmap->setFormFactorCacheDirectory(formFactorCacheDirectory);
+        lightmap->process(lights);
+        processedAny = true;
+    }
+
+    return processedAny;
+}
+
+void LightmapBuildProcess::updateSceneOcclusion()
+{
+    // A single object has nothing to be shadowed by.
+    if(pendingLightmaps.size() < 2)
+    {
+        if(sceneOcclusion)
+        {
+            for(auto &lightmap : instanceLightmaps)
+                lightmap->setSceneOcclusion(nullptr, SceneOcclusion::NoInstance);
+        }
+
+        sceneOcclusion.reset();
+        instanceLightmaps.clear();
+        return;
+    }
+
+    // The objects only moved, so the top level is refitted and the lightmaps
+    // only trace again the links near the objects that moved.
+    if(sceneOcclusion && instanceLightmaps == pendingLightmaps)
+    {
+        std::vector<std::vector<Box3>> changedRegions;
+        if(!sceneOcclusion->moveInstances(pendingTransforms, changedRegions))
+            return;
+
+        for(size_t i = 0; i < instanceLightmaps.size(); ++i)
+        {
+            auto &lightmap = instanceLightmaps[i];
+            if(lightmap->getSceneInstance() == i && !changedRegions[i].empty())
+                lightmap->updateSceneOcclusion(changedRegions[i]);
+        }
+        return;
+    }
+
+    // The objects changed, so both levels are built again.
+    for(auto &lightmap : instanceLightmaps)
+        lightmap->setSceneOcclusion(nullptr, SceneOcclusion::NoInstance);
+
+    sceneOcclusion = std::make_shared<SceneOcclusion> ();
+    for(size_t i = 0; i < pendingLightmaps.size(); ++i)
+        sceneOcclusion->addInstance(pendingLightmaps[i].get(), pendingTransforms[i]);
+    sceneOcclusion->build();
+
+    instanceLightmaps = pendingLightmaps;
+    for(size_t i = 0; i < instanceLightmaps.size(); ++i)
+    {
+        if(std::find(instanceLightmaps.begin(), instanceLightmaps.begin() + i, instanceLightmaps[i]) == instanceLightmaps.begin() + i)
+            instanceLightmaps[i]->setSceneOcclusion(sceneOcclusion, i);
+    }
+}
+
+std::vector<LightState> LightmapBuildProcess::computeMeshSpaceLights(const glm::mat4 &inverseTransform) const
+{
+    // The lightmaps are in the space of their meshes.
+    auto lights = currentLights;
+    for(auto &light : lights)
+    {
+        light.position = inverseTransform*light.position;
+        light.spotDirection = glm::mat3(inverseTransform)*light.spotDirection;
+    }
+
+    return lights;
 }
 
 } // End of namespace RadiosityTest
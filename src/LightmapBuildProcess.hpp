@@ -3,22 +3,31 @@
 
 #include "Object.hpp"
 #include "LightState.hpp"
+#include <glm/glm.hpp>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <vector>
+#include <string>
 
 namespace RadiosityTest
 {
 DECLARE_CLASS(LightmapBuildProcess);
 DECLARE_CLASS(Scene);
 DECLARE_CLASS(Lightmap);
+DECLARE_CLASS(ThreadPool);
+DECLARE_CLASS(SceneOcclusion);
 
 /**
- * A process that takes care of building lightmaps.
+ * A process that takes care of building lightmaps. The lightmaps of the scene
+ * share a scene occlusion, so the objects shadow each other.
  */
 class LightmapBuildProcess : public Object
 {
 public:
+    // How often the scene is checked for changes once every lightmap has converged.
+    static constexpr int IdlePollIntervalMilliseconds = 20;
+
     LightmapBuildProcess();
     ~LightmapBuildProcess();
 
@@ -35,15 +44,48 @@ public:
         return theScene;
     }
 
+    size_t getWorkerCount() const
+    {
+        return workerCount;
+    }
+
+    // Sets the number of threads used by the solvers. Zero uses one thread
+    // per hardware thread. This must be set before starting the process.
+    void setWorkerCount(size_t newWorkerCount)
+    {
+        workerCount = newWorkerCount;
+    }
+
+    const std::string &getFormFactorCacheDirectory() const
+    {
+        return formFactorCacheDirectory;
+    }
+
+    // The form factor cache directory given to every processed lightmap.
+    // This must be set before starting the process.
+    void setFormFactorCacheDirectory(const std::string &newDirectory)
+    {
+        formFactorCacheDirectory = newDirectory;
+    }
+
 private:
     void threadProcess();
-    void processScene(const ScenePtr &scene);
+    bool processScene(const ScenePtr &scene);
+    void updateSceneOcclusion();
+    std::vector<LightState> computeMeshSpaceLights(const glm::mat4 &inverseTransform) const;
 
     std::thread thread;
     std::mutex mutex;
+    std::condition_variable wakeCondition;
     ScenePtr theScene;
     std::vector<LightState> currentLights;
     std::vector<LightmapPtr> pendingLightmaps;
+    std::vector<glm::mat4> pendingTransforms;
+    std::vector<LightmapPtr> instanceLightmaps;
+    SceneOcclusionPtr sceneOcclusion;
+    ThreadPoolPtr threadPool;
+    size_t workerCount;
+    std::string formFactorCacheDirectory;
     bool running;
 };
 
@@ -0,0 +1,265 @@
+#include "LowRankTransport.hpp"
+#include "Lightmap.hpp"
+#include <algorithm>
+#include <random>
+#include <math.h>
+#include <stdio.h>
+
+namespace RadiosityTest
+{
+
+static constexpr unsigned int RandomSeed = 5489u;
+static constexpr size_t MaxEigenSweeps = 64;
+
+static double dot(const std::vector<double> &a, const std::vector<double> &b)
+{
+    double result = 0.0;
+    for(size_t i = 0; i < a.size(); ++i)
+        result += a[i]*b[i];
+    return result;
+}
+
+// Modified Gram-Schmidt, with a second pass for keeping the orthogonality.
+static void orthonormalize(std::vector<std::vector<double>> &vectors)
+{
+    for(size_t i = 0; i < vectors.size(); ++i)
+    {
+        auto &vector = vectors[i];
+        for(int pass = 0; pass < 2; ++pass)
+        {
+            for(size_t j = 0; j < i; ++j)
+            {
+                auto projection = dot(vector, vectors[j]);
+                for(size_t k = 0; k < vector.size(); ++k)
+                    vector[k] -= projection*vectors[j][k];
+            }
+        }
+
+        // A vector in the span of the previous ones is dropped.
+        auto length = sqrt(dot(vector, vector));
+        auto scale = length > 1e-12 ? 1.0 / length : 0.0;
+        for(auto &element : vector)
+            element *= scale;
+    }
+}
+
+/**
+ * Cyclic Jacobi eigenvalue algorithm for a small symmetric matrix, stored by
+ * rows. The eigenvalues are left on the diagonal of the matrix, and the
+ * eigenvectors in the columns of eigenvectors.
+ */
+static void computeSymmetricEigenvectors(std::vector<double> &matrix, size_t size, std::vector<double> &eigenvectors)
+{
+    eigenvectors.assign(size*size, 0.0);
+    for(size_t i = 0; i < size; ++i)
+        eigenvectors[i*size + i] = 1.0;
+
+    auto element = [&](size_t row, size_t column) -> double& {
+        return matrix[row*size + column];
+    };
+
+    for(size_t sweep = 0; sweep < MaxEigenSweeps; ++sweep)
+    {
+        double offDiagonal = 0.0;
+        double diagonal = 0.0;
+        for(size_t p = 0; p < size; ++p)
+        {
+            diagonal += element(p, p)*element(p, p);
+            for(size_t q = p + 1; q < size; ++q)
+                offDiagonal += element(p, q)*element(p, q);
+        }
+
+        if(offDiagonal <= 1e-24*diagonal)
+            break;
+
+        for(size_t p = 0; p < size; ++p)
+        {
+            for(size_t q = p + 1; q < size; ++q)
+            {
+                auto apq = element(p, q);
+                if(apq == 0.0)
+                    continue;
+
+                auto theta = (element(q, q) - element(p, p)) / (2.0*apq);
+                auto t = (theta >= 0.0 ? 1.0 : -1.0) / (fabs(theta) + sqrt(theta*theta + 1.0));
+                auto c = 1.0 / sqrt(t*t + 1.0);
+                auto s = t*c;
+
+                for(size_t k = 0; k < size; ++k)
+                {
+                    auto akp = element(k, p);
+                    auto akq = element(k, q);
+                    element(k, p) = c*akp - s*akq;
+                    element(k, q) = s*akp + c*akq;
+                }
+
+                for(size_t k = 0; k < size; ++k)
+                {
+                    auto apk = element(p, k);
+                    auto aqk = element(q, k);
+                    element(p, k) = c*apk - s*aqk;
+                    element(q, k) = s*apk + c*aqk;
+                }
+
+                for(size_t k = 0; k < size; ++k)
+                {
+                    auto vkp = eigenvectors[k*size + p];
+                    auto vkq = eigenvectors[k*size + q];
+                    eigenvectors[k*size + p] = c*vkp - s*vkq;
+                    eigenvectors[k*size + q] = s*vkp + c*vkq;
+                }
+            }
+        }
+    }
+}
+
+LowRankTransport::LowRankTransport(Lightmap *lightmap)
+    : lightmap(lightmap), patchCount(0), rank(0)
+{
+}
+
+LowRankTransport::~LowRankTransport()
+{
+}
+
+void LowRankTransport::applyTransport(const std::vector<Vector> &input, std::vector<Vector> &output, bool transposed)
+{
+    // The three color channels are independent systems, so every solve
+    // transports three vectors.
+    RadianceBuffer direct;
+    RadianceBuffer indirect;
+    direct.resize(patchCount);
+    output.assign(input.size(), Vector(patchCount));
+    for(size_t first = 0; first < input.size(); first += 3)
+    {
+        std::vector<float> *channels[3] = {&direct.red, &direct.green, &direct.blue};
+        for(size_t c = 0; c < 3; ++c)
+        {
+            for(size_t i = 0; i < patchCount; ++i)
+                (*channels[c])[i] = first + c < input.size() ? float(input[first + c][i]) : 0.0f;
+        }
+
+        lightmap->solveIndirectLight(direct, indirect, transposed);
+
+        const std::vector<float> *results[3] = {&indirect.red, &indirect.green, &indirect.blue};
+        for(size_t c = 0; c < 3 && first + c < input.size(); ++c)
+        {
+            for(size_t i = 0; i < patchCount; ++i)
+                output[first + c][i] = (*results[c])[i];
+        }
+    }
+}
+
+void LowRankTransport::build(size_t newRank)
+{
+    patchCount = lightmap->patches.size();
+    auto sampleCount = std::min(newRank + Oversampling, patchCount);
+    rank = newRank;
+    auto basisCount = std::min(rank, sampleCount);
+
+    // Sample the range of M with random vectors.
+    std::mt19937 generator(RandomSeed);
+    std::normal_distribution<double> distribution;
+    std::vector<Vector> samples(sampleCount, Vector(patchCount));
+    for(auto &sample : samples)
+    {
+        for(auto &element : sample)
+            element = distribution(generator);
+    }
+
+    std::vector<Vector> range;
+    applyTransport(samples, range, false);
+    orthonormalize(range);
+
+    // Power iterations sharpen the decay of the singular values.
+    for(size_t i = 0; i < PowerIterations; ++i)
+    {
+        applyTransport(range, samples, true);
+        orthonormalize(samples);
+        applyTransport(samples, range, false);
+        orthonormalize(range);
+    }
+
+    // B = Q^t M is small, its rows are M^t q.
+    std::vector<Vector> projected;
+    applyTransport(range, projected, true);
+
+    // The SVD of B comes from the eigen decomposition of B B^t.
+    std::vector<double> gram(sampleCount*sampleCount);
+    for(size_t i = 0; i < sampleCount; ++i)
+    {
+        for(size_t j = i; j < sampleCount; ++j)
+            gram[i*sampleCount + j] = gram[j*sampleCount + i] = dot(projected[i], projected[j]);
+    }
+
+    std::vector<double> eigenvectors;
+    computeSymmetricEigenvectors(gram, sampleCount, eigenvectors);
+
+    std::vector<std::pair<double, size_t>> eigenvalues(sampleCount);
+    for(size_t i = 0; i < sampleCount; ++i)
+        eigenvalues[i] = std::make_pair(gram[i*sampleCount + i], i);
+    std::sort(eigenvalues.rbegin(), eigenvalues.rend());
+
+    singularValues.resize(sampleCount);
+    for(size_t i = 0; i < sampleCount; ++i)
+        singularValues[i] = sqrt(std::max(eigenvalues[i].first, 0.0));
+
+    // M ~= (Q W) S V^t, with V^t = S^-1 W^t B.
+    leftBasis.assign(basisCount*patchCount, 0.0f);
+    rightBasis.assign(basisCount*patchCount, 0.0f);
+    for(size_t r = 0; r < basisCount; ++r)
+    {
+        auto column = eigenvalues[r].second;
+        auto singularValue = double(singularValues[r]);
+        if(singularValue <= 0.0)
+            continue;
+
+        auto left = &leftBasis[r*patchCount];
+        auto right = &rightBasis[r*patchCount];
+        for(size_t j = 0; j < sampleCount; ++j)
+        {
+            auto weight = eigenvectors[j*sampleCount + column];
+            for(size_t i = 0; i < patchCount; ++i)
+            {
+                left[i] += float(weight*range[j][i]);
+                right[i] += float(weight*projected[j][i] / singularValue);
+            }
+        }
+
+        for(size_t i = 0; i < patchCount; ++i)
+            left[i] *= float(singularValue);
+    }
+
+    auto truncatedValue = basisCount < sampleCount ? singularValues[basisCount] : 0.0f;
+    printf("Low rank transport: rank %zu, %zu samples, truncated singular value ratio %g (%zu KB)\n",
+        basisCount, sampleCount, singularValues[0] > 0.0f ? truncatedValue / singularValues[0] : 0.0f, getMemorySize() / 1024);
+}
+
+void LowRankTransport::relight(const RadianceBuffer &directLight, RadianceBuffer &indirectLight) const
+{
+    indirectLight.resize(patchCount);
+    indirectLight.clear();
+    auto basisCount = patchCount ? leftBasis.size() / patchCount : 0;
+    for(size_t r = 0; r < basisCount; ++r)
+    {
+        auto left = &leftBasis[r*patchCount];
+        auto right = &rightBasis[r*patchCount];
+
+        float red = 0.0f, green = 0.0f, blue = 0.0f;
+        for(size_t i = 0; i < patchCount; ++i)
+        {
+            red += right[i]*directLight.red[i];
+            green += right[i]*directLight.green[i];
+            blue += right[i]*directLight.blue[i];
+        }
+
+        for(size_t i = 0; i < patchCount; ++i)
+        {
+            indirectLight.red[i] += left[i]*red;
+            indirectLight.green[i] += left[i]*green;
+            indirectLight.blue[i] += left[i]*blue;
+        }
+    }
+}
+
+} // End of namespace RadiosityTest
@@ -0,0 +1,67 @@
+#ifndef RADIOSITY_TEST_LOW_RANK_TRANSPORT_HPP
+#define RADIOSITY_TEST_LOW_RANK_TRANSPORT_HPP
+
+#include "Object.hpp"
+#include "RadianceBuffer.hpp"
+#include <vector>
+
+namespace RadiosityTest
+{
+DECLARE_CLASS(LowRankTransport);
+DECLARE_CLASS(Lightmap);
+
+/**
+ * A truncated low rank factorization of the converged multiple bounce
+ * transport M = (I - T)^-1 T, which maps the direct light into the indirect
+ * light. It is computed with a randomized SVD (Halko, Martinsson and Tropp,
+ * "Finding structure with randomness", 2011), so relighting costs two thin
+ * matrix products instead of an iterative solve.
+ */
+class LowRankTransport : public Object
+{
+public:
+    static constexpr size_t Oversampling = 8;
+    static constexpr size_t PowerIterations = 1;
+
+    LowRankTransport(Lightmap *lightmap);
+    ~LowRankTransport();
+
+    void build(size_t rank);
+
+    // Computes indirectLight = M*directLight.
+    void relight(const RadianceBuffer &directLight, RadianceBuffer &indirectLight) const;
+
+    size_t getRank() const
+    {
+        return rank;
+    }
+
+    const std::vector<float> &getSingularValues() const
+    {
+        return singularValues;
+    }
+
+    size_t getMemorySize() const
+    {
+        return (leftBasis.size() + rightBasis.size())*sizeof(float);
+    }
+
+private:
+    typedef std::vector<double> Vector;
+
+    void applyTransport(const std::vector<Vector> &input, std::vector<Vector> &output, bool transposed);
+
+    Lightmap *lightmap;
+    size_t patchCount;
+    size_t rank;
+
+    // Rank rows of patchCount elements. The left basis is scaled by the
+    // singular values.
+    std::vector<float> leftBasis;
+    std::vector<float> rightBasis;
+    std::vector<float> singularValues;
+};
+
+} // End of namespace RadiosityTest
+
+#endif //RADIOSITY_TEST_LOW_RANK_TRANSPORT_HPP
@@ -8,6 +8,8 @@
 #include "GenericMesh.hpp"
 #include "Light.hpp"
 #include "LightmapBuildProcess.hpp"
+#include "Lightmap.hpp"
+#include "Mesh.hpp"
 #include <glm/gtc/matrix_transform.hpp>
 
 using namespace RadiosityTest;
@@ -26,6 +28,7 @@ static ScenePtr scene;
 static CameraPtr camera;
 static LightmapBuildProcessPtr lightmapProcess;
 static LightPtr spotLight;
+static SceneMeshObjectPtr staticGeometry;
 
 static glm::vec3 cameraVelocity;
 static glm::vec2 cameraAngularVelocity;
@@ -35,6 +38,27 @@ static constexpr float CameraSlowSpeed = 1.0f;
 static constexpr float CameraFastSpeed = 3.0f;
 static float cameraSpeed = CameraSlowSpeed;
 
+static void setLightmapSolver(RadiositySolver solver)
+{
+    auto &mesh = staticGeometry->getMesh();
+    if(mesh && mesh->lightmap)
+        mesh->lightmap->setSolver(solver);
+}
+
+static void cycleLightColor()
+{
+    static const glm::vec4 colors[] = {
+        glm::vec4(1.0f, 1.0f, 1.0f, 1.0f),
+        glm::vec4(1.0f, 0.6f, 0.3f, 1.0f),
+        glm::vec4(0.4f, 0.6f, 1.0f, 1.0f),
+        glm::vec4(0.5f, 0.5f, 0.5f, 1.0f),
+    };
+    static size_t colorIndex = 0;
+
+    colorIndex = (colorIndex + 1) % (sizeof(colors) / sizeof(colors[0]));
+    spotLight->setIntensity(colors[colorIndex]);
+}
+
 static void onKeyDown(const SDL_KeyboardEvent &event)
 {
     switch(event.keysym.sym)
@@ -89,6 +113,30 @@ static void onKeyDown(const SDL_KeyboardEvent &event)
         renderer->setLightMapFilter(LightMapFilter::Linear);
         renderer->useLightMapProgram();
         break;
+    case SDLK_5:
+        setLightmapSolver(RadiositySolver::GaussSeidel);
+        break;
+    case SDLK_6:
+        setLightmapSolver(RadiositySolver::ProgressiveRefinement);
+        break;
+    case SDLK_7:
+        setLightmapSolver(RadiositySolver::Hierarchical);
+        break;
+    case SDLK_8:
+        setLightmapSolver(RadiositySolver::Jacobi);
+        break;
+    case SDLK_9:
+        setLightmapSolver(RadiositySolver::SuccessiveOverRelaxation);
+        break;
+    case SDLK_0:
+        setLightmapSolver(RadiositySolver::BiCGStab);
+        break;
+    case SDLK_l:
+        setLightmapSolver(RadiositySolver::LowRank);
+        break;
+    case SDLK_c:
+        cycleLightColor();
+        break;
     }
 }
 
@@ -200,7 +248,7 @@ static void createScene()
 
     // Create the static geometry
     {
-        auto staticGeometry = std::make_shared<SceneMeshObject> ();
+        staticGeometry = std::make_shared<SceneMeshObject> ();
         staticGeometry->setMesh(GenericMeshBuilder()
 
             // Add the walls
@@ -215,6 +263,9 @@ static void createScene()
             .mesh()
         );
         scene->addObject(staticGeometry);
+
+        // The light only changes its color.
+        staticGeometry->getMesh()->lightmap->setLightResponseCaching(true);
     }
 
     // Create the light
@@ -291,6 +342,8 @@ int main(int argc, char* argv[])
 
     lightmapProcess = std::make_shared<LightmapBuildProcess> ();
     lightmapProcess->setScene(scene);
+    // Unchanged scenes load their form factors from the working directory.
+    lightmapProcess->setFormFactorCacheDirectory(".");
     lightmapProcess->start();
 
     auto lastTime = SDL_GetTicks();
@@ -0,0 +1,162 @@
+#include "MonteCarloFormFactors.hpp"
+#include "Lightmap.hpp"
+#include "SurfaceVisibility.hpp"
+#include <algorithm>
+#include <math.h>
+
+namespace RadiosityTest
+{
+
+// The samples stay this far inside of the quad, so they are never in the
+// plane of an adjacent surface.
+static constexpr float BorderInset = 1e-3f;
+
+static uint32_t reverseBits(uint32_t value)
+{
+    value = ((value >> 1) & 0x55555555u) | ((value & 0x55555555u) << 1);
+    value = ((value >> 2) & 0x33333333u) | ((value & 0x33333333u) << 2);
+    value = ((value >> 4) & 0x0F0F0F0Fu) | ((value & 0x0F0F0F0Fu) << 4);
+    value = ((value >> 8) & 0x00FF00FFu) | ((value & 0x00FF00FFu) << 8);
+    return (value >> 16) | (value << 16);
+}
+
+// The second dimension of the Sobol sequence.
+static uint32_t sobolSecondDimension(uint32_t index)
+{
+    uint32_t result = 0;
+    for(uint32_t direction = 1u << 31; index != 0; index >>= 1, direction ^= direction >> 1)
+    {
+        if(index & 1)
+            result ^= direction;
+    }
+
+    return result;
+}
+
+static uint32_t hashInteger(uint32_t value)
+{
+    value ^= value >> 16;
+    value *= 0x7FEB352Du;
+    value ^= value >> 15;
+    value *= 0x846CA68Bu;
+    value ^= value >> 16;
+    return value;
+}
+
+static float toUnitFloat(uint32_t value)
+{
+    return float(value >> 8) * (1.0f / 16777216.0f);
+}
+
+MonteCarloFormFactors::MonteCarloFormFactors(const Lightmap &lightmap, const SurfaceVisibility &visibility, size_t sampleBudget)
+    : lightmap(lightmap), visibility(visibility), samplesPerPair(1), patchArea(lightmap.texelScale*lightmap.texelScale)
+{
+    // The largest power of two that fits the budget, since the prefixes of
+    // that length are the stratified ones.
+    auto partialPairCount = std::max(visibility.getPartialPatchPairCount(), size_t(1));
+    while(samplesPerPair*2 <= MaxSamplesPerPair && samplesPerPair*2*partialPairCount <= sampleBudget)
+        samplesPerPair *= 2;
+
+    auto &patches = lightmap.patches;
+    auto &quads = lightmap.quadSurfaces;
+    auto halfTexel = lightmap.texelScale*0.5f;
+    patchTexels.resize(patches.size());
+    for(size_t i = 0; i < patches.size(); ++i)
+    {
+        auto &patch = patches[i];
+        auto &quad = quads[patch.surfaceIndex];
+        auto quadMin = glm::min(glm::min(quad.vertices[0], quad.vertices[1]), glm::min(quad.vertices[2], quad.vertices[3]));
+        auto quadMax = glm::max(glm::max(quad.vertices[0], quad.vertices[1]), glm::max(quad.vertices[2], quad.vertices[3]));
+        quadMin += BorderInset;
+        quadMax = glm::max(quadMax - BorderInset, quadMin);
+
+        glm::vec2 center(glm::dot(quad.tangent, patch.position), glm::dot(quad.bitangent, patch.position));
+        auto &texel = patchTexels[i];
+        texel.min = glm::clamp(center - halfTexel, quadMin, quadMax) - center;
+        texel.max = glm::clamp(center + halfTexel, quadMin, quadMax) - center;
+    }
+}
+
+MonteCarloFormFactors::~MonteCarloFormFactors()
+{
+}
+
+float MonteCarloFormFactors::estimate(size_t firstPatch, size_t secondPatch, size_t &rayCount) const
+{
+    // Every pair has its own scrambles, so the errors of the pairs are not
+    // correlated.
+    uint32_t scrambles[4];
+    auto seed = hashInteger(uint32_t(firstPatch)*0x9E3779B9u ^ hashInteger(uint32_t(secondPatch)));
+    for(int i = 0; i < 4; ++i)
+    {
+        seed = hashInteger(seed + 0x9E3779B9u);
+        scrambles[i] = seed;
+    }
+
+    // The probes decide on their own when they agree.
+    auto probeCount = std::min(ProbeSampleCount, samplesPerPair);
+    float formFactorSum = 0.0f;
+    size_t occludedCount = 0;
+    for(uint32_t i = 0; i < probeCount; ++i)
+    {
+        bool occluded;
+        formFactorSum += sampleFormFactor(firstPatch, secondPatch, i, scrambles, occluded);
+        occludedCount += occluded ? 1 : 0;
+    }
+
+    rayCount += probeCount;
+    if(occludedCount == 0 || occludedCount == probeCount)
+        return formFactorSum / probeCount;
+
+    for(uint32_t i = uint32_t(probeCount); i < samplesPerPair; ++i)
+    {
+        bool occluded;
+        formFactorSum += sampleFormFactor(firstPatch, secondPatch, i, scrambles, occluded);
+    }
+
+    rayCount += samplesPerPair - probeCount;
+    return formFactorSum / samplesPerPair;
+}
+
+glm::vec3 MonteCarloFormFactors::samplePoint(size_t patchIndex, uint32_t sampleIndex, uint32_t scrambleX, uint32_t scrambleY) const
+{
+    // Scrambling the digits keeps the strata of the sequence.
+    auto &patch = lightmap.patches[patchIndex];
+    auto &quad = lightmap.quadSurfaces[patch.surfaceIndex];
+    auto &texel = patchTexels[patchIndex];
+    glm::vec2 sample(toUnitFloat(reverseBits(sampleIndex) ^ scrambleX), toUnitFloat(sobolSecondDimension(sampleIndex) ^ scrambleY));
+    auto offset = texel.min + (texel.max - texel.min)*sample;
+    return patch.position + quad.tangent*offset.x + quad.bitangent*offset.y;
+}
+
+float MonteCarloFormFactors::sampleFormFactor(size_t firstPatch, size_t secondPatch, uint32_t sampleIndex,
+    const uint32_t *scrambles, bool &occluded) const
+{
+    occluded = false;
+    auto &first = lightmap.patches[firstPatch];
+    auto &second = lightmap.patches[secondPatch];
+    auto start = samplePoint(firstPatch, sampleIndex, scrambles[0], scrambles[1]);
+    auto end = samplePoint(secondPatch, sampleIndex, scrambles[2], scrambles[3]);
+
+    auto delta = end - start;
+    auto distance2 = glm::dot(delta, delta);
+    if(distance2 <= 0.0f)
+        return 0.0f;
+
+    auto direction = delta / sqrtf(distance2);
+    auto firstCosine = glm::dot(direction, first.normal);
+    auto secondCosine = -glm::dot(direction, second.normal);
+    if(firstCosine <= 0.0f || secondCosine <= 0.0f)
+        return 0.0f;
+
+    if(visibility.isRayOccluded(Ray::fromEndPoints(start, end), firstPatch, secondPatch))
+    {
+        occluded = true;
+        return 0.0f;
+    }
+
+    // The same kernel as the single centre sample of the pairwise rays.
+    return firstCosine*secondCosine*patchArea / (float(M_PI)*distance2 + patchArea);
+}
+
+} // End of namespace RadiosityTest
@@ -0,0 +1,63 @@
+#ifndef RADIOSITY_TEST_MONTE_CARLO_FORM_FACTORS_HPP
+#define RADIOSITY_TEST_MONTE_CARLO_FORM_FACTORS_HPP
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace RadiosityTest
+{
+class Lightmap;
+class SurfaceVisibility;
+
+/**
+ * Estimates the form factors of the partially visible patch pairs with rays
+ * between stratified points of both texels. The points of a pair are a
+ * scrambled (0,2)-sequence (Kollig and Keller, "Efficient multidimensional
+ * sampling", 2002), so every power of two prefix covers the texel evenly.
+ * A few probe rays are cast first, and only the pairs that they do not agree
+ * on get the rest of the samples. The samples per pair come from a budget of
+ * rays for the whole lightmap.
+ */
+class MonteCarloFormFactors
+{
+public:
+    static constexpr size_t ProbeSampleCount = 4;
+    static constexpr size_t MaxSamplesPerPair = 64;
+
+    MonteCarloFormFactors(const Lightmap &lightmap, const SurfaceVisibility &visibility, size_t sampleBudget);
+    ~MonteCarloFormFactors();
+
+    size_t getSamplesPerPair() const
+    {
+        return samplesPerPair;
+    }
+
+    // The form factor of a partial pair, averaged over the samples. The rays
+    // that were cast are added to the count.
+    float estimate(size_t firstPatch, size_t secondPatch, size_t &rayCount) const;
+
+private:
+    // The texel of a patch, clamped to its quad so the samples of the border
+    // patches stay on their surface.
+    struct PatchTexel
+    {
+        glm::vec2 min;
+        glm::vec2 max;
+    };
+
+    glm::vec3 samplePoint(size_t patchIndex, uint32_t sampleIndex, uint32_t scrambleX, uint32_t scrambleY) const;
+    float sampleFormFactor(size_t firstPatch, size_t secondPatch, uint32_t sampleIndex, const uint32_t *scrambles,
+        bool &occluded) const;
+
+    const Lightmap &lightmap;
+    const SurfaceVisibility &visibility;
+    size_t samplesPerPair;
+    float patchArea;
+    std::vector<PatchTexel> patchTexels;
+};
+
+} // End of namespace RadiosityTest
+
+#endif //RADIOSITY_TEST_MONTE_CARLO_FORM_FACTORS_HPP
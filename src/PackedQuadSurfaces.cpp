@@ -0,0 +1,329 @@
+#include "PackedQuadSurfaces.hpp"
+#include "Lightmap.hpp"
+#include "Float.hpp"
+#include <algorithm>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RADIOSITY_TEST_HAS_SSE 1
+#include <emmintrin.h>
+#endif
+
+#if defined(__AVX2__)
+#define RADIOSITY_TEST_HAS_AVX2 1
+#include <immintrin.h>
+#endif
+
+#if defined(__AVX512F__)
+#define RADIOSITY_TEST_HAS_AVX512 1
+#include <immintrin.h>
+#endif
+
+namespace RadiosityTest
+{
+
+const char *getQuadKernelName(QuadKernel kernel)
+{
+    switch(kernel)
+    {
+    case QuadKernel::Scalar: return "Scalar";
+    case QuadKernel::SSE: return "SSE";
+    case QuadKernel::AVX2: return "AVX2";
+    case QuadKernel::AVX512: return "AVX512";
+    }
+
+    return "Unknown";
+}
+
+bool isQuadKernelSupported(QuadKernel kernel)
+{
+    switch(kernel)
+    {
+    case QuadKernel::Scalar:
+        return true;
+    case QuadKernel::SSE:
+#ifdef RADIOSITY_TEST_HAS_SSE
+        return true;
+#else
+        return false;
+#endif
+    case QuadKernel::AVX2:
+#ifdef RADIOSITY_TEST_HAS_AVX2
+        return true;
+#else
+        return false;
+#endif
+    case QuadKernel::AVX512:
+#ifdef RADIOSITY_TEST_HAS_AVX512
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    return false;
+}
+
+QuadKernel getBestQuadKernel()
+{
+    if(isQuadKernelSupported(QuadKernel::AVX512))
+        return QuadKernel::AVX512;
+    if(isQuadKernelSupported(QuadKernel::AVX2))
+        return QuadKernel::AVX2;
+    if(isQuadKernelSupported(QuadKernel::SSE))
+        return QuadKernel::SSE;
+    return QuadKernel::Scalar;
+}
+
+PackedQuadSurfaces::PackedQuadSurfaces()
+    : quadCount(0)
+{
+}
+
+PackedQuadSurfaces::~PackedQuadSurfaces()
+{
+}
+
+void PackedQuadSurfaces::build(const std::vector<LightmapCompactQuadSurface> &quads)
+{
+    std::vector<uint32_t> order(quads.size());
+    for(size_t i = 0; i < quads.size(); ++i)
+        order[i] = i;
+    build(quads, order);
+}
+
+void PackedQuadSurfaces::build(const std::vector<LightmapCompactQuadSurface> &quads, const std::vector<uint32_t> &order)
+{
+    const auto LaneCount = PackedQuadGroup::LaneCount;
+    quadCount = order.size();
+    groups.resize((quadCount + LaneCount - 1) / LaneCount);
+
+    // The empty lanes have a null normal, which is never hit.
+    for(auto &group : groups)
+    {
+        memset(&group, 0, sizeof(group));
+        std::fill(group.quadIndex, group.quadIndex + LaneCount, -1);
+    }
+
+    for(size_t i = 0; i < quadCount; ++i)
+    {
+        auto &quad = quads[order[i]];
+        auto &group = groups[i / LaneCount];
+        auto lane = i % LaneCount;
+
+        group.normalX[lane] = quad.normal.x;
+        group.normalY[lane] = quad.normal.y;
+        group.normalZ[lane] = quad.normal.z;
+        group.distance[lane] = quad.distance;
+        group.quadIndex[lane] = order[i];
+
+        // The 2D edge function of the quad, expressed over the 3D point.
+        for(int edge = 0; edge < 4; ++edge)
+        {
+            auto &start = quad.vertices[edge];
+            auto delta = quad.vertices[(edge + 1) % 4] - start;
+            auto plane = quad.tangent*(-delta.y) + quad.bitangent*delta.x;
+            group.edgeX[edge][lane] = plane.x;
+            group.edgeY[edge][lane] = plane.y;
+            group.edgeZ[edge][lane] = plane.z;
+            group.edgeW[edge][lane] = delta.y*start.x - delta.x*start.y;
+        }
+    }
+}
+
+// The lanes of [laneBegin, laneBegin + width) that are also in [begin, end).
+inline uint32_t computeRangeMask(size_t laneBegin, size_t width, size_t begin, size_t end)
+{
+    uint32_t mask = 0;
+    for(size_t i = 0; i < width; ++i)
+    {
+        auto index = laneBegin + i;
+        if(begin <= index && index < end)
+            mask |= 1u << i;
+    }
+
+    return mask;
+}
+
+/**
+ * Single lane operations, for the scalar kernel.
+ */
+struct ScalarLanes
+{
+    static constexpr size_t Width = 1;
+    typedef float Value;
+
+    static Value load(const float *p) { return *p; }
+    static Value set(float x) { return x; }
+    static Value add(Value a, Value b) { return a + b; }
+    static Value sub(Value a, Value b) { return a - b; }
+    static Value mul(Value a, Value b) { return a*b; }
+    static Value div(Value a, Value b) { return a / b; }
+    static Value abs(Value a) { return fabsf(a); }
+    static uint32_t lessMask(Value a, Value b) { return a < b; }
+    static uint32_t equalIndexMask(const int32_t *p, int32_t value) { return *p == value; }
+};
+
+#ifdef RADIOSITY_TEST_HAS_SSE
+struct SSELanes
+{
+    static constexpr size_t Width = 4;
+    typedef __m128 Value;
+
+    static Value load(const float *p) { return _mm_loadu_ps(p); }
+    static Value set(float x) { return _mm_set1_ps(x); }
+    static Value add(Value a, Value b) { return _mm_add_ps(a, b); }
+    static Value sub(Value a, Value b) { return _mm_sub_ps(a, b); }
+    static Value mul(Value a, Value b) { return _mm_mul_ps(a, b); }
+    static Value div(Value a, Value b) { return _mm_div_ps(a, b); }
+    static Value abs(Value a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+    static uint32_t lessMask(Value a, Value b) { return _mm_movemask_ps(_mm_cmplt_ps(a, b)); }
+
+    static uint32_t equalIndexMask(const int32_t *p, int32_t value)
+    {
+        auto indices = _mm_loadu_si128(reinterpret_cast<const __m128i*> (p));
+        return _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(indices, _mm_set1_epi32(value))));
+    }
+};
+#endif
+
+#ifdef RADIOSITY_TEST_HAS_AVX2
+struct AVX2Lanes
+{
+    static constexpr size_t Width = 8;
+    typedef __m256 Value;
+
+    static Value load(const float *p) { return _mm256_loadu_ps(p); }
+    static Value set(float x) { return _mm256_set1_ps(x); }
+    static Value add(Value a, Value b) { return _mm256_add_ps(a, b); }
+    static Value sub(Value a, Value b) { return _mm256_sub_ps(a, b); }
+    static Value mul(Value a, Value b) { return _mm256_mul_ps(a, b); }
+    static Value div(Value a, Value b) { return _mm256_div_ps(a, b); }
+    static Value abs(Value a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+    static uint32_t lessMask(Value a, Value b) { return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LT_OQ)); }
+
+    static uint32_t equalIndexMask(const int32_t *p, int32_t value)
+    {
+        auto indices = _mm256_loadu_si256(reinterpret_cast<const __m256i*> (p));
+        return _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(indices, _mm256_set1_epi32(value))));
+    }
+};
+#endif
+
+#ifdef RADIOSITY_TEST_HAS_AVX512
+struct AVX512Lanes
+{
+    static constexpr size_t Width = 16;
+    typedef __m512 Value;
+
+    static Value load(const float *p) { return _mm512_loadu_ps(p); }
+    static Value set(float x) { return _mm512_set1_ps(x); }
+    static Value add(Value a, Value b) { return _mm512_add_ps(a, b); }
+    static Value sub(Value a, Value b) { return _mm512_sub_ps(a, b); }
+    static Value mul(Value a, Value b) { return _mm512_mul_ps(a, b); }
+    static Value div(Value a, Value b) { return _mm512_div_ps(a, b); }
+    static Value abs(Value a) { return _mm512_abs_ps(a); }
+    static uint32_t lessMask(Value a, Value b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+
+    static uint32_t equalIndexMask(const int32_t *p, int32_t value)
+    {
+        auto indices = _mm512_loadu_si512(p);
+        return _mm512_cmpeq_epi32_mask(indices, _mm512_set1_epi32(value));
+    }
+};
+#endif
+
+/**
+ * Tests a ray against the lanes of a group in chunks of the SIMD width. It
+ * is the same test as LightmapCompactQuadSurface::rayIntersection.
+ */
+template<typename Lanes>
+static bool anyHitWith(const std::vector<PackedQuadGroup> &groups, const Ray &ray, size_t begin, size_t end,
+    int32_t ignoredQuad, int32_t otherIgnoredQuad)
+{
+    typedef typename Lanes::Value Value;
+    const auto LaneCount = PackedQuadGroup::LaneCount;
+    const auto Width = Lanes::Width;
+
+    auto ox = Lanes::set(ray.position.x);
+    auto oy = Lanes::set(ray.position.y);
+    auto oz = Lanes::set(ray.position.z);
+    auto dx = Lanes::set(ray.direction.x);
+    auto dy = Lanes::set(ray.direction.y);
+    auto dz = Lanes::set(ray.direction.z);
+    auto zero = Lanes::set(0.0f);
+    auto maxDistance = Lanes::set(ray.maxDistance);
+    auto epsilon = Lanes::set(FloatEpsilon);
+    auto negativeEpsilon = Lanes::set(-FloatEpsilon);
+
+    auto chunkBegin = begin - begin % Width;
+    for(size_t laneBegin = chunkBegin; laneBegin < end; laneBegin += Width)
+    {
+        auto &group = groups[laneBegin / LaneCount];
+        auto lane = laneBegin % LaneCount;
+
+        auto mask = computeRangeMask(laneBegin, Width, begin, end);
+        mask &= ~Lanes::equalIndexMask(group.quadIndex + lane, ignoredQuad);
+        mask &= ~Lanes::equalIndexMask(group.quadIndex + lane, otherIgnoredQuad);
+        if(!mask)
+            continue;
+
+        // Ray plane intersection.
+        auto nx = Lanes::load(group.normalX + lane);
+        auto ny = Lanes::load(group.normalY + lane);
+        auto nz = Lanes::load(group.normalZ + lane);
+        auto den = Lanes::add(Lanes::add(Lanes::mul(dx, nx), Lanes::mul(dy, ny)), Lanes::mul(dz, nz));
+        auto originDistance = Lanes::add(Lanes::add(Lanes::mul(ox, nx), Lanes::mul(oy, ny)), Lanes::mul(oz, nz));
+        Value t = Lanes::div(Lanes::sub(Lanes::load(group.distance + lane), originDistance), den);
+        mask &= Lanes::lessMask(epsilon, Lanes::abs(den));
+        mask &= Lanes::lessMask(zero, t);
+        mask &= Lanes::lessMask(t, maxDistance);
+        if(!mask)
+            continue;
+
+        // Edge tests on the intersection point.
+        auto px = Lanes::add(ox, Lanes::mul(dx, t));
+        auto py = Lanes::add(oy, Lanes::mul(dy, t));
+        auto pz = Lanes::add(oz, Lanes::mul(dz, t));
+        for(int edge = 0; edge < 4 && mask; ++edge)
+        {
+            auto value = Lanes::add(Lanes::add(Lanes::mul(px, Lanes::load(group.edgeX[edge] + lane)),
+                Lanes::mul(py, Lanes::load(group.edgeY[edge] + lane))),
+                Lanes::add(Lanes::mul(pz, Lanes::load(group.edgeZ[edge] + lane)), Lanes::load(group.edgeW[edge] + lane)));
+            mask &= ~Lanes::lessMask(value, negativeEpsilon);
+        }
+
+        if(mask)
+            return true;
+    }
+
+    return false;
+}
+
+bool PackedQuadSurfaces::anyHit(QuadKernel kernel, const Ray &ray, size_t begin, size_t end,
+    int32_t ignoredQuad, int32_t otherIgnoredQuad) const
+{
+    end = std::min(end, quadCount);
+    if(begin >= end)
+        return false;
+
+    switch(kernel)
+    {
+#ifdef RADIOSITY_TEST_HAS_AVX512
+    case QuadKernel::AVX512:
+        return anyHitWith<AVX512Lanes> (groups, ray, begin, end, ignoredQuad, otherIgnoredQuad);
+#endif
+#ifdef RADIOSITY_TEST_HAS_AVX2
+    case QuadKernel::AVX2:
+        return anyHitWith<AVX2Lanes> (groups, ray, begin, end, ignoredQuad, otherIgnoredQuad);
+#endif
+#ifdef RADIOSITY_TEST_HAS_SSE
+    case QuadKernel::SSE:
+        return anyHitWith<SSELanes> (groups, ray, begin, end, ignoredQuad, otherIgnoredQuad);
+#endif
+    default:
+        return anyHitWith<ScalarLanes> (groups, ray, begin, end, ignoredQuad, otherIgnoredQuad);
+    }
+}
+
+} // End of namespace RadiosityTest
@@ -0,0 +1,105 @@
+#ifndef RADIOSITY_TEST_PACKED_QUAD_SURFACES_HPP
+#define RADIOSITY_TEST_PACKED_QUAD_SURFACES_HPP
+
+#include "Ray.hpp"
+#include <vector>
+#include <stdint.h>
+
+namespace RadiosityTest
+{
+class LightmapCompactQuadSurface;
+
+/**
+ * The instruction set used for intersecting a ray with packed quads.
+ */
+enum class QuadKernel
+{
+    // The original test, one quad at a time.
+    Scalar = 0,
+
+    // Four quads per instruction.
+    SSE,
+
+    // Eight quads per instruction.
+    AVX2,
+
+    // Sixteen quads per instruction.
+    AVX512,
+};
+
+const char *getQuadKernelName(QuadKernel kernel);
+
+// The SIMD kernels are only available when enabled at compile time.
+bool isQuadKernelSupported(QuadKernel kernel);
+QuadKernel getBestQuadKernel();
+
+/**
+ * The quads of a group, stored as a structure of arrays. Every edge is a
+ * plane equation, so a point is inside the quad when it is in front of the
+ * four edge planes.
+ */
+struct alignas(64) PackedQuadGroup
+{
+    static constexpr size_t LaneCount = 16;
+
+    float normalX[LaneCount];
+    float normalY[LaneCount];
+    float normalZ[LaneCount];
+    float distance[LaneCount];
+
+    float edgeX[4][LaneCount];
+    float edgeY[4][LaneCount];
+    float edgeZ[4][LaneCount];
+    float edgeW[4][LaneCount];
+
+    // The index of the original quad, or -1 for an empty lane.
+    int32_t quadIndex[LaneCount];
+};
+
+/**
+ * Quad surfaces packed in groups for testing a ray against many of them at
+ * the same time.
+ */
+class PackedQuadSurfaces
+{
+public:
+    PackedQuadSurfaces();
+    ~PackedQuadSurfaces();
+
+    // Packs the quads in the given order. The quad indices are the indices
+    // in the quads array.
+    void build(const std::vector<LightmapCompactQuadSurface> &quads, const std::vector<uint32_t> &order);
+    void build(const std::vector<LightmapCompactQuadSurface> &quads);
+
+    void clear()
+    {
+        quadCount = 0;
+        groups.clear();
+        groups.shrink_to_fit();
+    }
+
+    /**
+     * Is any of the packed quads in [begin, end) hit in (0, ray.maxDistance)?
+     * The ignored quads are given by their original index.
+     */
+    bool anyHit(QuadKernel kernel, const Ray &ray, size_t begin, size_t end,
+        int32_t ignoredQuad, int32_t otherIgnoredQuad) const;
+
+    size_t size() const
+    {
+        return quadCount;
+    }
+
+    size_t getMemorySize() const
+    {
+        return groups.size()*sizeof(PackedQuadGroup);
+    }
+
+private:
+    size_t quadCount;
+    std::vector<PackedQuadGroup> groups;
+};
+
+} // End of namespace RadiosityTest
+
+#endif //RADIOSITY_TEST_PACKED_QUAD_SURFACES_HPP
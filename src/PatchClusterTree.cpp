@@ -0,0 +1,139 @@
+#include "PatchClusterTree.hpp"
+#include "Lightmap.hpp"
+#include <algorithm>
+
+namespace RadiosityTest
+{
+
+PatchClusterTree::PatchClusterTree()
+    : leafSize(DefaultLeafSize)
+{
+}
+
+PatchClusterTree::~PatchClusterTree()
+{
+}
+
+void PatchClusterTree::build(const std::vector<LightmapPatch> &patches, size_t newLeafSize)
+{
+    leafSize = std::max(newLeafSize, size_t(1));
+    nodes.clear();
+    leaves.clear();
+    if(patches.empty())
+        return;
+
+    nodes.reserve(2*(patches.size() / leafSize + 1));
+    nodes.push_back(PatchCluster());
+    buildNode(patches, 0, 0, uint32_t(patches.size()));
+}
+
+void PatchClusterTree::buildNode(const std::vector<LightmapPatch> &patches, uint32_t nodeIndex, uint32_t begin, uint32_t end)
+{
+    // The cone axis is the mean normal, and the spread is measured from it.
+    Box3 bounds;
+    glm::vec3 normalSum(0.0f);
+    for(auto i = begin; i < end; ++i)
+    {
+        bounds.insertPoint(patches[i].position);
+        normalSum += patches[i].normal;
+    }
+
+    auto normalSumLength = glm::length(normalSum);
+    auto coneAxis = normalSumLength > 0.0f ? normalSum / normalSumLength : glm::vec3(0.0f);
+    auto coneSpread = 0.0f;
+    if(normalSumLength > 0.0f)
+    {
+        for(auto i = begin; i < end; ++i)
+            coneSpread = std::max(coneSpread, glm::length(patches[i].normal - coneAxis));
+    }
+    else
+    {
+        coneSpread = 2.0f;
+    }
+
+    {
+        auto &node = nodes[nodeIndex];
+        node.bounds = bounds;
+        node.coneAxis = coneAxis;
+        node.coneSpread = std::min(coneSpread, 2.0f);
+        node.begin = begin;
+        node.end = end;
+        node.firstChild = 0;
+    }
+
+    if(end - begin <= leafSize)
+    {
+        leaves.push_back(nodeIndex);
+        return;
+    }
+
+    // The children are consecutive, and the node vector may grow below.
+    auto firstChild = uint32_t(nodes.size());
+    nodes.push_back(PatchCluster());
+    nodes.push_back(PatchCluster());
+    nodes[nodeIndex].firstChild = firstChild;
+
+    auto middle = begin + (end - begin) / 2;
+    buildNode(patches, firstChild, begin, middle);
+    buildNode(patches, firstChild + 1, middle, end);
+}
+
+size_t PatchClusterTree::findLeafIndex(size_t patchIndex) const
+{
+    auto it = std::upper_bound(leaves.begin(), leaves.end(), patchIndex, [&](size_t patch, uint32_t leaf) {
+        return patch < nodes[leaf].begin;
+    });
+    return (it - leaves.begin()) - 1;
+}
+
+void PatchClusterTree::findFacingLeaves(const PatchCluster &source, size_t firstPatch, std::vector<uint32_t> &result) const
+{
+    if(nodes.empty())
+        return;
+
+    // The first child is visited first, so the leaves come in patch order.
+    uint32_t stack[64];
+    size_t stackSize = 0;
+    stack[stackSize++] = 0;
+    while(stackSize > 0)
+    {
+        auto &node = nodes[stack[--stackSize]];
+        if(node.end <= firstPatch || !canFace(source, node))
+            continue;
+
+        if(node.isLeaf())
+        {
+            result.push_back(uint32_t(&node - &nodes[0]));
+            continue;
+        }
+
+        stack[stackSize++] = node.firstChild + 1;
+        stack[stackSize++] = node.firstChild;
+    }
+}
+
+bool PatchClusterTree::isBoxBehind(const Box3 &box, const PatchCluster &cluster)
+{
+    // The offsets from the patches to the points of the box are in the box
+    // of their differences. Every normal is the axis plus a deviation no
+    // longer than the spread, so the offsets along the normals are bounded
+    // by their support along the axis plus their length times the spread.
+    auto offsetMin = box.min - cluster.bounds.max;
+    auto offsetMax = box.max - cluster.bounds.min;
+    auto &axis = cluster.coneAxis;
+    auto support = 0.0f;
+    auto length2 = 0.0f;
+    for(int i = 0; i < 3; ++i)
+    {
+        support += std::max(axis[i]*offsetMin[i], axis[i]*offsetMax[i]);
+        length2 += std::max(offsetMin[i]*offsetMin[i], offsetMax[i]*offsetMax[i]);
+    }
+
+    if(cluster.coneSpread > 0.0f)
+        support += sqrtf(length2)*cluster.coneSpread;
+
+    // The pairs on the planes have no form factor, as in the per patch test.
+    return support <= 0.0f;
+}
+
+} // End of namespace RadiosityTest
@@ -0,0 +1,105 @@
+#ifndef RADIOSITY_TEST_PATCH_CLUSTER_TREE_HPP
+#define RADIOSITY_TEST_PATCH_CLUSTER_TREE_HPP
+
+#include "Box3.hpp"
+#include <glm/glm.hpp>
+#include <vector>
+#include <stdint.h>
+
+namespace RadiosityTest
+{
+class LightmapPatch;
+
+/**
+ * A range of consecutive patches, with the bounds of their positions and the
+ * cone of their normals.
+ */
+struct PatchCluster
+{
+    bool isLeaf() const
+    {
+        return firstChild == 0;
+    }
+
+    Box3 bounds;
+    glm::vec3 coneAxis;
+
+    // The largest distance between a normal and the axis, which is
+    // 2 sin(angle / 2). It is 2 when the normals do not fit in a cone.
+    float coneSpread;
+
+    uint32_t begin;
+    uint32_t end;
+    uint32_t firstChild;
+};
+
+/**
+ * A binary hierarchy of patch clusters, built over the patch order so every
+ * node is a contiguous range of patches. The patch orders keep the nearby
+ * patches together, so the nodes stay compact. The cluster pairs that can
+ * never see each other are rejected before any per patch work.
+ */
+class PatchClusterTree
+{
+public:
+    static constexpr size_t DefaultLeafSize = 16;
+
+    PatchClusterTree();
+    ~PatchClusterTree();
+
+    void build(const std::vector<LightmapPatch> &patches, size_t leafSize = DefaultLeafSize);
+
+    const PatchCluster &getNode(size_t index) const
+    {
+        return nodes[index];
+    }
+
+    size_t getLeafCount() const
+    {
+        return leaves.size();
+    }
+
+    // The node of a leaf, by its position in patch order.
+    uint32_t getLeaf(size_t leafIndex) const
+    {
+        return leaves[leafIndex];
+    }
+
+    // The leaf that contains a patch, and its position in patch order.
+    uint32_t findLeaf(size_t patchIndex) const
+    {
+        return leaves[findLeafIndex(patchIndex)];
+    }
+
+    size_t findLeafIndex(size_t patchIndex) const;
+
+    /**
+     * Appends the leaves that may see the source cluster, in patch order.
+     * Only the leaves with patches from firstPatch on are visited.
+     */
+    void findFacingLeaves(const PatchCluster &source, size_t firstPatch, std::vector<uint32_t> &result) const;
+
+    // Is every point of the box behind or on the planes of all the patches
+    // of the cluster?
+    static bool isBoxBehind(const Box3 &box, const PatchCluster &cluster);
+
+    // Can any patch of a cluster be in front of a patch of the other, and
+    // the other way around?
+    static bool canFace(const PatchCluster &first, const PatchCluster &second)
+    {
+        return !isBoxBehind(second.bounds, first) && !isBoxBehind(first.bounds, second);
+    }
+
+private:
+    void buildNode(const std::vector<LightmapPatch> &patches, uint32_t nodeIndex, uint32_t begin, uint32_t end);
+
+    size_t leafSize;
+    std::vector<PatchCluster> nodes;
+
+    // The leaf nodes in patch order.
+    std::vector<uint32_t> leaves;
+};
+
+} // End of namespace RadiosityTest
+
+#endif //RADIOSITY_TEST_PATCH_CLUSTER_TREE_HPP
@@ -0,0 +1,400 @@
+#include "QuadSurfaceBVH.hpp"
+#include <algorithm>
+#include <stdio.h>
+#include <math.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RADIOSITY_TEST_HAS_SSE 1
+#include <emmintrin.h>
+#endif
+
+namespace RadiosityTest
+{
+
+static constexpr size_t MaxTraversalDepth = 64;
+static constexpr float BoxTestMargin = 1e-4f;
+static constexpr float BoundsPadding = 1e-4f;
+
+// The rounding of the rebuilt vertices grows with the coordinates, so the
+// bounds are also padded by a part of the scene extent.
+static constexpr float RelativeBoundsPadding = 1e-4f;
+
+static bool rayIntersectsBox(const Box3 &box, const glm::vec3 &origin, const glm::vec3 &inverseDirection, float maxDistance)
+{
+    float entry = 0.0f;
+    float exit = maxDistance;
+    for(int axis = 0; axis < 3; ++axis)
+    {
+        // A ray parallel to the slab, including one on its boundary, only
+        // needs its origin inside it.
+        if(isinf(inverseDirection[axis]))
+        {
+            if(origin[axis] < box.min[axis] || origin[axis] > box.max[axis])
+                return false;
+            continue;
+        }
+
+        auto t1 = (box.min[axis] - origin[axis])*inverseDirection[axis];
+        auto t2 = (box.max[axis] - origin[axis])*inverseDirection[axis];
+        entry = std::max(entry, std::min(t1, t2));
+        exit = std::min(exit, std::max(t1, t2));
+    }
+
+    // The margin keeps the test conservative with respect to the rounding
+    // of the quad intersection, for hits at the end of the ray.
+    return entry <= exit*(1.0f + BoxTestMargin) + BoxTestMargin;
+}
+
+#ifdef RADIOSITY_TEST_HAS_SSE
+/**
+ * The same test as rayIntersectsBox for all the lanes of a packet, four at a
+ * time.
+ */
+static uint32_t packetIntersectsBox(const Box3 &box, const RayPacket &packet, uint32_t activeMask)
+{
+    const auto LaneCount = RayPacket::MaxSize;
+    auto infinity = _mm_set1_ps(INFINITY);
+    auto marginScale = _mm_set1_ps(1.0f + BoxTestMargin);
+    auto margin = _mm_set1_ps(BoxTestMargin);
+
+    uint32_t mask = 0;
+    for(size_t i = 0; i < LaneCount; i += 4)
+    {
+        if(!((activeMask >> i) & 0xF))
+            continue;
+
+        auto entry = _mm_setzero_ps();
+        auto exit = _mm_loadu_ps(packet.maxDistances + i);
+        for(int axis = 0; axis < 3; ++axis)
+        {
+            auto boxMin = _mm_set1_ps(box.min[axis]);
+            auto boxMax = _mm_set1_ps(box.max[axis]);
+            auto origin = _mm_loadu_ps(packet.origins[axis] + i);
+            auto inverseDirection = _mm_loadu_ps(packet.inverseDirections[axis] + i);
+            auto parallel = _mm_castsi128_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*> (packet.parallelAxes[axis] + i)));
+
+            auto t1 = _mm_mul_ps(_mm_sub_ps(boxMin, origin), inverseDirection);
+            auto t2 = _mm_mul_ps(_mm_sub_ps(boxMax, origin), inverseDirection);
+
+            // A parallel axis gives an empty or an infinite slab.
+            auto outside = _mm_or_ps(_mm_cmplt_ps(origin, boxMin), _mm_cmpgt_ps(origin, boxMax));
+            auto parallelNear = _mm_or_ps(_mm_and_ps(outside, infinity), _mm_andnot_ps(outside, _mm_xor_ps(infinity, _mm_set1_ps(-0.0f))));
+            auto parallelFar = _mm_xor_ps(parallelNear, _mm_set1_ps(-0.0f));
+            auto near = _mm_or_ps(_mm_and_ps(parallel, parallelNear), _mm_andnot_ps(parallel, _mm_min_ps(t1, t2)));
+            auto far = _mm_or_ps(_mm_and_ps(parallel, parallelFar), _mm_andnot_ps(parallel, _mm_max_ps(t1, t2)));
+            entry = _mm_max_ps(entry, near);
+            exit = _mm_min_ps(exit, far);
+        }
+
+        auto hit = _mm_cmple_ps(entry, _mm_add_ps(_mm_mul_ps(exit, marginScale), margin));
+        mask |= uint32_t(_mm_movemask_ps(hit)) << i;
+    }
+
+    return mask;
+}
+#else
+/**
+ * The same test as rayIntersectsBox for all the lanes of a packet.
+ */
+static uint32_t packetIntersectsBox(const Box3 &box, const RayPacket &packet, uint32_t activeMask)
+{
+    uint32_t mask = 0;
+    for(size_t i = 0; i < packet.size; ++i)
+    {
+        auto &ray = packet.rays[i];
+        if((activeMask & (1u << i)) && rayIntersectsBox(box, ray.position, 1.0f / ray.direction, ray.maxDistance))
+            mask |= 1u << i;
+    }
+
+    return mask;
+}
+#endif
+
+QuadSurfaceBVH::QuadSurfaceBVH()
+    : depth(0), maxLeafQuadCount(DefaultMaxLeafQuadCount), quadKernel(QuadKernel::Scalar)
+{
+}
+
+QuadSurfaceBVH::~QuadSurfaceBVH()
+{
+}
+
+void QuadSurfaceBVH::build(const std::vector<LightmapCompactQuadSurface> &newQuads)
+{
+    nodes.clear();
+    quads.clear();
+    depth = 0;
+
+    Box3 sceneBounds;
+    for(auto &quad : newQuads)
+        sceneBounds.insertBox(quad.computeBounds());
+    auto sceneExtent = sceneBounds.isEmpty() ? glm::vec3() : sceneBounds.extent();
+    auto padding = std::max(BoundsPadding, std::max(sceneExtent.x, std::max(sceneExtent.y, sceneExtent.z))*RelativeBoundsPadding);
+
+    quadOrder.resize(newQuads.size());
+    quadBounds.resize(newQuads.size());
+    quadCenters.resize(newQuads.size());
+    for(size_t i = 0; i < newQuads.size(); ++i)
+    {
+        quadOrder[i] = i;
+        // The vertices are rebuilt from the plane, so the bounds are padded
+        // for their rounding errors.
+        auto bounds = newQuads[i].computeBounds();
+        quadBounds[i] = Box3(bounds.min - glm::vec3(padding), bounds.max + glm::vec3(padding));
+        quadCenters[i] = quadBounds[i].center();
+    }
+
+    if(newQuads.empty())
+        return;
+
+    nodes.reserve(newQuads.size()*2);
+    nodes.push_back(QuadSurfaceBVHNode());
+    buildNode(0, 0, newQuads.size(), 1);
+
+    quads.reserve(newQuads.size());
+    for(auto index : quadOrder)
+        quads.push_back(newQuads[index]);
+    packedQuads.build(newQuads, quadOrder);
+
+    quadBounds.clear();
+    quadBounds.shrink_to_fit();
+    quadCenters.clear();
+    quadCenters.shrink_to_fit();
+    printf("Quad surface BVH: %zu quads, %zu nodes, depth %zu\n", quads.size(), nodes.size(), depth);
+}
+
+void QuadSurfaceBVH::buildNode(uint32_t nodeIndex, uint32_t first, uint32_t count, size_t nodeDepth)
+{
+    depth = std::max(depth, nodeDepth);
+
+    Box3 bounds;
+    Box3 centerBounds;
+    for(size_t i = first; i < first + count; ++i)
+    {
+        bounds.insertBox(quadBounds[quadOrder[i]]);
+        centerBounds.insertPoint(quadCenters[quadOrder[i]]);
+    }
+
+    nodes[nodeIndex].bounds = bounds;
+    nodes[nodeIndex].firstIndex = first;
+    nodes[nodeIndex].quadCount = count;
+    if(count <= maxLeafQuadCount || nodeDepth >= MaxTraversalDepth)
+        return;
+
+    // Find the cheapest split with binned SAH.
+    auto bestCost = IntersectionCost*count;
+    int bestAxis = -1;
+    size_t bestSplit = 0;
+    auto centerExtent = centerBounds.extent();
+    for(int axis = 0; axis < 3; ++axis)
+    {
+        if(centerExtent[axis] <= 0.0f)
+            continue;
+
+        Box3 binBounds[BinCount];
+        size_t binCounts[BinCount] = {};
+        auto binScale = BinCount / centerExtent[axis];
+        auto binOf = [&](uint32_t quad) {
+            auto bin = size_t((quadCenters[quad][axis] - centerBounds.min[axis])*binScale);
+            return std::min(bin, BinCount - 1);
+        };
+
+        for(size_t i = first; i < first + count; ++i)
+        {
+            auto bin = binOf(quadOrder[i]);
+            binBounds[bin].insertBox(quadBounds[quadOrder[i]]);
+            ++binCounts[bin];
+        }
+
+        // Sweep from the right for the areas of the right side.
+        float rightAreas[BinCount];
+        size_t rightCounts[BinCount];
+        Box3 rightBounds;
+        size_t rightCount = 0;
+        for(size_t bin = BinCount - 1; bin > 0; --bin)
+        {
+            rightBounds.insertBox(binBounds[bin]);
+            rightCount += binCounts[bin];
+            rightAreas[bin] = rightBounds.isEmpty() ? 0.0f : rightBounds.surfaceArea();
+            rightCounts[bin] = rightCount;
+        }
+
+        Box3 leftBounds;
+        size_t leftCount = 0;
+        for(size_t split = 1; split < BinCount; ++split)
+        {
+            leftBounds.insertBox(binBounds[split - 1]);
+            leftCount += binCounts[split - 1];
+            if(leftCount == 0 || rightCounts[split] == 0)
+                continue;
+
+            auto cost = TraversalCost + IntersectionCost*(leftBounds.surfaceArea()*leftCount + rightAreas[split]*rightCounts[split]) /
+                bounds.surfaceArea();
+            if(cost < bestCost)
+            {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = split;
+            }
+        }
+    }
+
+    if(bestAxis < 0)
+        return;
+
+    // Partition the quads.
+    auto scale = BinCount / centerExtent[bestAxis];
+    auto middle = std::partition(quadOrder.begin() + first, quadOrder.begin() + first + count, [&](uint32_t quad) {
+        auto bin = std::min(size_t((quadCenters[quad][bestAxis] - centerBounds.min[bestAxis])*scale), BinCount - 1);
+        return bin < bestSplit;
+    });
+    uint32_t leftCount = middle - (quadOrder.begin() + first);
+
+    auto childIndex = nodes.size();
+    nodes.push_back(QuadSurfaceBVHNode());
+    nodes.push_back(QuadSurfaceBVHNode());
+    nodes[nodeIndex].firstIndex = childIndex;
+    nodes[nodeIndex].quadCount = 0;
+
+    buildNode(childIndex, first, leftCount, nodeDepth + 1);
+    buildNode(childIndex + 1, first + leftCount, count - leftCount, nodeDepth + 1);
+}
+
+bool QuadSurfaceBVH::isLeafOccluded(const QuadSurfaceBVHNode &leaf, const Ray &ray, size_t ignoredQuad, size_t otherIgnoredQuad) const
+{
+    if(quadKernel != QuadKernel::Scalar)
+        return packedQuads.anyHit(quadKernel, ray, leaf.firstIndex, leaf.firstIndex + leaf.quadCount,
+            int32_t(ignoredQuad), int32_t(otherIgnoredQuad));
+
+    for(size_t i = leaf.firstIndex; i < leaf.firstIndex + leaf.quadCount; ++i)
+    {
+        if(quadOrder[i] == ignoredQuad || quadOrder[i] == otherIgnoredQuad)
+            continue;
+
+        auto distance = quads[i].rayIntersection(ray);
+        if(distance > 0.0f && distance < ray.maxDistance)
+            return true;
+    }
+
+    return false;
+}
+
+bool QuadSurfaceBVH::isOccluded(const Ray &ray, size_t ignoredQuad, size_t otherIgnoredQuad) const
+{
+    if(nodes.empty())
+        return false;
+
+    auto inverseDirection = 1.0f / ray.direction;
+    uint32_t stack[MaxTraversalDepth*2];
+    size_t stackSize = 0;
+    stack[stackSize++] = 0;
+
+    while(stackSize > 0)
+    {
+        auto &node = nodes[stack[--stackSize]];
+        if(!rayIntersectsBox(node.bounds, ray.position, inverseDirection, ray.maxDistance))
+            continue;
+
+        if(node.isLeaf())
+        {
+            if(isLeafOccluded(node, ray, ignoredQuad, otherIgnoredQuad))
+                return true;
+        }
+        else
+        {
+            stack[stackSize++] = node.firstIndex;
+            stack[stackSize++] = node.firstIndex + 1;
+        }
+    }
+
+    return false;
+}
+
+uint32_t QuadSurfaceBVH::computeOccludedRays(const RayPacket &packet) const
+{
+    if(nodes.empty() || packet.size == 0)
+        return 0;
+
+    // Every stack entry carries the rays that entered its parent.
+    struct StackEntry
+    {
+        uint32_t node;
+        uint32_t rayMask;
+    };
+
+    StackEntry stack[MaxTraversalDepth*2];
+    size_t stackSize = 0;
+    stack[stackSize++] = StackEntry{0, packet.getFullMask()};
+
+    auto fullMask = packet.getFullMask();
+    uint32_t occludedMask = 0;
+    while(stackSize > 0)
+    {
+        auto entry = stack[--stackSize];
+        auto &node = nodes[entry.node];
+        auto activeMask = entry.rayMask & ~occludedMask;
+
+        if(!activeMask)
+            continue;
+
+        auto hitMask = activeMask & packetIntersectsBox(node.bounds, packet, activeMask);
+        if(!hitMask)
+            continue;
+
+        if(node.isLeaf())
+        {
+            for(size_t i = 0; i < packet.size; ++i)
+            {
+                if((hitMask & (1u << i)) &&
+                    isLeafOccluded(node, packet.rays[i], packet.ignoredQuads[i], packet.otherIgnoredQuads[i]))
+                    occludedMask |= 1u << i;
+            }
+
+            if(occludedMask == fullMask)
+                break;
+        }
+        else
+        {
+            stack[stackSize++] = StackEntry{node.firstIndex, hitMask};
+            stack[stackSize++] = StackEntry{node.firstIndex + 1, hitMask};
+        }
+    }
+
+    return occludedMask;
+}
+
+void QuadSurfaceBVH::findShaftQuads(const Shaft &shaft, std::vector<uint32_t> &result) const
+{
+    if(nodes.empty())
+        return;
+
+    uint32_t stack[MaxTraversalDepth*2];
+    size_t stackSize = 0;
+    stack[stackSize++] = 0;
+
+    while(stackSize > 0)
+    {
+        auto &node = nodes[stack[--stackSize]];
+        if(shaft.isBoxOutside(node.bounds))
+            continue;
+
+        if(node.isLeaf())
+        {
+            for(size_t i = node.firstIndex; i < node.firstIndex + node.quadCount; ++i)
+            {
+                glm::vec3 vertices[4];
+                for(int j = 0; j < 4; ++j)
+                    vertices[j] = quads[i].vertexPosition(j);
+                if(!shaft.arePointsOutside(vertices, 4))
+                    result.push_back(quadOrder[i]);
+            }
+        }
+        else
+        {
+            stack[stackSize++] = node.firstIndex;
+            stack[stackSize++] = node.firstIndex + 1;
+        }
+    }
+}
+
+} // End of namespace RadiosityTest
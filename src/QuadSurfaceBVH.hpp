@@ -0,0 +1,121 @@
+#ifndef RADIOSITY_TEST_QUAD_SURFACE_BVH_HPP
+#define RADIOSITY_TEST_QUAD_SURFACE_BVH_HPP
+
+#include "Lightmap.hpp"
+#include "RayPacket.hpp"
+#include "Shaft.hpp"
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+namespace RadiosityTest
+{
+DECLARE_CLASS(QuadSurfaceBVH);
+
+/**
+ * A node of the quad surface BVH. An inner node has two consecutive
+ * children starting at firstIndex, and a leaf has quadCount quads starting
+ * at firstIndex in the quad order.
+ */
+struct QuadSurfaceBVHNode
+{
+    bool isLeaf() const
+    {
+        return quadCount != 0;
+    }
+
+    Box3 bounds;
+    uint32_t firstIndex;
+    uint32_t quadCount;
+};
+
+/**
+ * Bounding volume hierarchy over the quad surfaces of a lightmap, built with
+ * the surface area heuristic. Answers any hit occlusion queries.
+ */
+class QuadSurfaceBVH : public Object
+{
+public:
+    static constexpr size_t BinCount = 16;
+    static constexpr size_t DefaultMaxLeafQuadCount = 4;
+    static constexpr float TraversalCost = 1.0f;
+    static constexpr float IntersectionCost = 1.0f;
+
+    QuadSurfaceBVH();
+    ~QuadSurfaceBVH();
+
+    void build(const std::vector<LightmapCompactQuadSurface> &newQuads);
+
+    // Is there any quad in (0, ray.maxDistance), other than the ignored ones?
+    bool isOccluded(const Ray &ray, size_t ignoredQuad, size_t otherIgnoredQuad) const;
+
+    // Traces the rays of a packet together, so every node is fetched once per
+    // packet. Returns the mask of the occluded rays.
+    uint32_t computeOccludedRays(const RayPacket &packet) const;
+
+    // Appends the indices of the quads that are not outside of the shaft.
+    void findShaftQuads(const Shaft &shaft, std::vector<uint32_t> &result) const;
+
+    QuadKernel getQuadKernel() const
+    {
+        return quadKernel;
+    }
+
+    void setQuadKernel(QuadKernel newQuadKernel)
+    {
+        quadKernel = newQuadKernel;
+    }
+
+    // Larger leaves suit the wider kernels. It takes effect on the next build.
+    size_t getMaxLeafQuadCount() const
+    {
+        return maxLeafQuadCount;
+    }
+
+    void setMaxLeafQuadCount(size_t newMaxLeafQuadCount)
+    {
+        maxLeafQuadCount = std::max(newMaxLeafQuadCount, size_t(1));
+    }
+
+    size_t getNodeCount() const
+    {
+        return nodes.size();
+    }
+
+    // The bounds of all the quads, which are empty without quads.
+    Box3 getBounds() const
+    {
+        return nodes.empty() ? Box3() : nodes[0].bounds;
+    }
+
+    size_t getDepth() const
+    {
+        return depth;
+    }
+
+    size_t getMemorySize() const
+    {
+        return nodes.size()*sizeof(QuadSurfaceBVHNode) + quads.size()*sizeof(LightmapCompactQuadSurface) +
+            packedQuads.getMemorySize() + quadOrder.size()*sizeof(uint32_t);
+    }
+
+private:
+    void buildNode(uint32_t nodeIndex, uint32_t first, uint32_t count, size_t nodeDepth);
+    bool isLeafOccluded(const QuadSurfaceBVHNode &leaf, const Ray &ray, size_t ignoredQuad, size_t otherIgnoredQuad) const;
+
+    std::vector<QuadSurfaceBVHNode> nodes;
+
+    // The quads are copied in the order of the leaves.
+    std::vector<LightmapCompactQuadSurface> quads;
+    PackedQuadSurfaces packedQuads;
+    std::vector<uint32_t> quadOrder;
+    std::vector<Box3> quadBounds;
+    std::vector<glm::vec3> quadCenters;
+    size_t depth;
+    size_t maxLeafQuadCount;
+    QuadKernel quadKernel;
+};
+
+} // End of namespace RadiosityTest
+
+#endif //RADIOSITY_TEST_QUAD_SURFACE_BVH_HPP
@@ -0,0 +1,353 @@
+#include "QuadSurfaceVoxelGrid.hpp"
+#include "VisibilityMatrix.hpp"
+#include <algorithm>
+#include <stdio.h>
+#include <math.h>
+
+namespace RadiosityTest
+{
+
+static constexpr float BoundsPadding = 1e-4f;
+
+// The voxels are padded by a part of their size for the rounding of the
+// DDA at the voxel boundaries.
+static constexpr float RelativeVoxelPadding = 1e-3f;
+
+// The last quads intersected by a ray, since the quads are in many voxels.
+static constexpr size_t MailboxSize = 8;
+
+static inline uint32_t countBits(uint64_t value)
+{
+#ifdef _MSC_VER
+    return uint32_t(__popcnt64(value));
+#else
+    return uint32_t(__builtin_popcountll(value));
+#endif
+}
+
+static bool clipRayToBox(const Box3 &box, const Ray &ray, const glm::vec3 &inverseDirection, float &start, float &end)
+{
+    for(int axis = 0; axis < 3; ++axis)
+    {
+        if(ray.direction[axis] == 0.0f)
+        {
+            if(ray.position[axis] < box.min[axis] || ray.position[axis] > box.max[axis])
+                return false;
+            continue;
+        }
+
+        auto t1 = (box.min[axis] - ray.position[axis])*inverseDirection[axis];
+        auto t2 = (box.max[axis] - ray.position[axis])*inverseDirection[axis];
+        start = std::max(start, std::min(t1, t2));
+        end = std::min(end, std::max(t1, t2));
+    }
+
+    return start <= end;
+}
+
+/**
+ * Walks the cells of a grid crossed by a ray between the distances start and
+ * end, which are already clipped to the grid, with a 3D DDA (Amanatides and
+ * Woo, "A fast voxel traversal algorithm for ray tracing", 1987). The first
+ * cell is clamped into the grid, so the rounding at its boundary never
+ * leaves the grid. Calls visit(cell, cellStart, cellEnd) on every cell, and
+ * stops when it returns true.
+ */
+template<typename FT>
+static bool walkCells(const Ray &ray, const glm::vec3 &inverseDirection, float start, float end,
+    const glm::vec3 &gridMin, float cellSize, const glm::ivec3 &cellCounts, const FT &visit)
+{
+    glm::ivec3 cell;
+    glm::ivec3 step;
+    glm::vec3 nextDistance;
+    glm::vec3 deltaDistance;
+    auto point = ray.position + ray.direction*start;
+    for(int axis = 0; axis < 3; ++axis)
+    {
+        cell[axis] = glm::clamp(int(floorf((point[axis] - gridMin[axis]) / cellSize)), 0, cellCounts[axis] - 1);
+        if(ray.direction[axis] > 0.0f)
+        {
+            step[axis] = 1;
+            nextDistance[axis] = (gridMin[axis] + (cell[axis] + 1)*cellSize - ray.position[axis])*inverseDirection[axis];
+            deltaDistance[axis] = cellSize*inverseDirection[axis];
+        }
+        else if(ray.direction[axis] < 0.0f)
+        {
+            step[axis] = -1;
+            nextDistance[axis] = (gridMin[axis] + cell[axis]*cellSize - ray.position[axis])*inverseDirection[axis];
+            deltaDistance[axis] = -cellSize*inverseDirection[axis];
+        }
+        else
+        {
+            step[axis] = 0;
+            nextDistance[axis] = INFINITY;
+            deltaDistance[axis] = INFINITY;
+        }
+    }
+
+    for(;;)
+    {
+        int axis = nextDistance.x < nextDistance.y ?
+            (nextDistance.x < nextDistance.z ? 0 : 2) :
+            (nextDistance.y < nextDistance.z ? 1 : 2);
+        auto cellEnd = std::min(nextDistance[axis], end);
+        if(visit(cell, start, cellEnd))
+            return true;
+
+        if(nextDistance[axis] >= end)
+            return false;
+
+        start = std::max(start, nextDistance[axis]);
+        cell[axis] += step[axis];
+        if(cell[axis] < 0 || cell[axis] >= cellCounts[axis])
+            return false;
+        nextDistance[axis] += deltaDistance[axis];
+    }
+}
+
+QuadSurfaceVoxelGrid::QuadSurfaceVoxelGrid()
+    : quads(nullptr), maxResolution(DefaultMaxResolution), voxelsPerQuad(DefaultVoxelsPerQuad),
+      voxelSize(0.0f), voxelPadding(0.0f), brickCounts(0)
+{
+}
+
+QuadSurfaceVoxelGrid::~QuadSurfaceVoxelGrid()
+{
+}
+
+void QuadSurfaceVoxelGrid::build(const std::vector<LightmapCompactQuadSurface> &newQuads)
+{
+    quads = &newQuads;
+    bounds = Box3();
+    brickCounts = glm::ivec3(0);
+    brickBits.clear();
+    brickBitRanks.clear();
+    brickVoxelBits.clear();
+    brickVoxelRanks.clear();
+    voxelQuadOffsets.clear();
+    voxelQuads.clear();
+    if(newQuads.empty())
+        return;
+
+    std::vector<Box3> quadBounds(newQuads.size());
+    for(size_t i = 0; i < newQuads.size(); ++i)
+    {
+        quadBounds[i] = newQuads[i].computeBounds();
+        bounds.insertBox(quadBounds[i]);
+    }
+
+    // The voxels are cubes, sized for a number of voxels per quad, so the
+    // scenes with many small quads get small voxels. The flat sides of the
+    // bounds count as one voxel thick.
+    auto extent = bounds.extent();
+    auto longestExtent = std::max(std::max(extent.x, extent.y), std::max(extent.z, BoundsPadding));
+    auto minVoxelSize = longestExtent / maxResolution;
+    auto volumeExtent = glm::max(extent, glm::vec3(minVoxelSize));
+    auto volume = volumeExtent.x*volumeExtent.y*volumeExtent.z;
+    voxelSize = std::max(cbrtf(volume / (voxelsPerQuad*newQuads.size())), minVoxelSize);
+    voxelPadding = std::max(BoundsPadding, voxelSize*RelativeVoxelPadding);
+
+    bounds.min -= glm::vec3(voxelPadding);
+    bounds.max += glm::vec3(voxelPadding);
+    extent = bounds.extent();
+    auto brickSize = voxelSize*BrickSize;
+    for(int axis = 0; axis < 3; ++axis)
+        brickCounts[axis] = std::max(1, int(ceilf(extent[axis] / brickSize)));
+
+    // Every voxel that touches the plane of a quad inside its bounds gets
+    // it. The keys sort by brick, by voxel in the brick and then by quad.
+    auto resolution = getResolution();
+    std::vector<uint64_t> voxelQuadKeys;
+    for(size_t i = 0; i < newQuads.size(); ++i)
+    {
+        auto &quad = newQuads[i];
+        auto first = glm::clamp(glm::ivec3(glm::floor((quadBounds[i].min - voxelPadding - bounds.min) / voxelSize)),
+            glm::ivec3(0), resolution - 1);
+        auto last = glm::clamp(glm::ivec3(glm::floor((quadBounds[i].max + voxelPadding - bounds.min) / voxelSize)),
+            glm::ivec3(0), resolution - 1);
+        auto radius = 0.5f*voxelSize*(fabsf(quad.normal.x) + fabsf(quad.normal.y) + fabsf(quad.normal.z)) + voxelPadding;
+
+        glm::ivec3 voxel;
+        for(voxel.z = first.z; voxel.z <= last.z; ++voxel.z)
+        {
+            for(voxel.y = first.y; voxel.y <= last.y; ++voxel.y)
+            {
+                for(voxel.x = first.x; voxel.x <= last.x; ++voxel.x)
+                {
+                    auto center = bounds.min + (glm::vec3(voxel) + 0.5f)*voxelSize;
+                    if(fabsf(glm::dot(quad.normal, center) - quad.distance) > radius)
+                        continue;
+
+                    auto brick = voxel / BrickSize;
+                    auto local = voxel % BrickSize;
+                    auto brickIndex = uint64_t((brick.z*brickCounts.y + brick.y)*brickCounts.x + brick.x);
+                    auto localIndex = uint64_t((local.z*BrickSize + local.y)*BrickSize + local.x);
+                    voxelQuadKeys.push_back(((brickIndex*64 + localIndex) << 32) | i);
+                }
+            }
+        }
+    }
+
+    std::sort(voxelQuadKeys.begin(), voxelQuadKeys.end());
+
+    auto brickCount = size_t(brickCounts.x)*brickCounts.y*brickCounts.z;
+    brickBits.assign((brickCount + 63) / 64, 0);
+    auto previousVoxel = ~uint64_t(0);
+    for(auto key : voxelQuadKeys)
+    {
+        auto voxel = key >> 32;
+        if(voxel != previousVoxel)
+        {
+            auto brick = voxel / 64;
+            if(previousVoxel == ~uint64_t(0) || previousVoxel / 64 != brick)
+            {
+                brickBits[brick / 64] |= uint64_t(1) << (brick % 64);
+                brickVoxelBits.push_back(0);
+                brickVoxelRanks.push_back(uint32_t(voxelQuadOffsets.size()));
+            }
+
+            brickVoxelBits.back() |= uint64_t(1) << (voxel % 64);
+            voxelQuadOffsets.push_back(uint32_t(voxelQuads.size()));
+            previousVoxel = voxel;
+        }
+
+        voxelQuads.push_back(uint32_t(key));
+    }
+    voxelQuadOffsets.push_back(uint32_t(voxelQuads.size()));
+
+    brickBitRanks.resize(brickBits.size());
+    uint32_t occupiedBrickCount = 0;
+    for(size_t i = 0; i < brickBits.size(); ++i)
+    {
+        brickBitRanks[i] = occupiedBrickCount;
+        occupiedBrickCount += countBits(brickBits[i]);
+    }
+
+    brickVoxelBits.shrink_to_fit();
+    brickVoxelRanks.shrink_to_fit();
+    voxelQuadOffsets.shrink_to_fit();
+    voxelQuads.shrink_to_fit();
+    printf("Quad surface voxel grid: %zu quads, %dx%dx%d voxels, %u occupied bricks, %zu occupied voxels, %zu quad references, %zu KB\n",
+        newQuads.size(), resolution.x, resolution.y, resolution.z, occupiedBrickCount, getOccupiedVoxelCount(),
+        voxelQuads.size(), getMemorySize() / 1024);
+}
+
+uint32_t QuadSurfaceVoxelGrid::findBrick(const glm::ivec3 &brick) const
+{
+    auto index = size_t((brick.z*brickCounts.y + brick.y)*brickCounts.x + brick.x);
+    auto word = brickBits[index / 64];
+    auto bit = uint64_t(1) << (index % 64);
+    if(!(word & bit))
+        return NoBrick;
+
+    return brickBitRanks[index / 64] + countBits(word & (bit - 1));
+}
+
+bool QuadSurfaceVoxelGrid::isOccluded(const Ray &ray, size_t ignoredQuad, size_t otherIgnoredQuad) const
+{
+    if(voxelQuads.empty())
+        return false;
+
+    auto inverseDirection = 1.0f / ray.direction;
+    auto start = 0.0f;
+    auto end = ray.maxDistance;
+    if(!clipRayToBox(bounds, ray, inverseDirection, start, end))
+        return false;
+
+    uint32_t testedQuads[MailboxSize];
+    std::fill(testedQuads, testedQuads + MailboxSize, ~uint32_t(0));
+    size_t testedQuadCursor = 0;
+
+    auto brickSize = voxelSize*BrickSize;
+    return walkCells(ray, inverseDirection, start, end, bounds.min, brickSize, brickCounts,
+        [&](const glm::ivec3 &brick, float brickStart, float brickEnd) {
+        auto brickSlot = findBrick(brick);
+        if(brickSlot == NoBrick)
+            return false;
+
+        auto voxelBits = brickVoxelBits[brickSlot];
+        auto firstVoxel = brickVoxelRanks[brickSlot];
+        auto brickMin = bounds.min + glm::vec3(brick)*brickSize;
+        return walkCells(ray, inverseDirection, brickStart, brickEnd, brickMin, voxelSize, glm::ivec3(BrickSize),
+            [&](const glm::ivec3 &voxel, float, float) {
+            auto localBit = uint64_t(1) << ((voxel.z*BrickSize + voxel.y)*BrickSize + voxel.x);
+            if(!(voxelBits & localBit))
+                return false;
+
+            auto voxelIndex = firstVoxel + countBits(voxelBits & (localBit - 1));
+            for(auto k = voxelQuadOffsets[voxelIndex]; k < voxelQuadOffsets[voxelIndex + 1]; ++k)
+            {
+                auto quad = voxelQuads[k];
+                if(quad == ignoredQuad || quad == otherIgnoredQuad ||
+                    std::find(testedQuads, testedQuads + MailboxSize, quad) != testedQuads + MailboxSize)
+                    continue;
+
+                testedQuads[testedQuadCursor] = quad;
+                testedQuadCursor = (testedQuadCursor + 1) % MailboxSize;
+
+                auto distance = (*quads)[quad].rayIntersection(ray);
+                if(distance > 0.0f && distance < ray.maxDistance)
+                    return true;
+            }
+
+            return false;
+        });
+    });
+}
+
+void QuadSurfaceVoxelGrid::findShaftQuads(const Shaft &shaft, std::vector<uint32_t> &result) const
+{
+    if(voxelQuads.empty())
+        return;
+
+    auto &shaftBounds = shaft.getBounds();
+    auto brickSize = voxelSize*BrickSize;
+    auto first = glm::clamp(glm::ivec3(glm::floor((shaftBounds.min - bounds.min) / brickSize)), glm::ivec3(0), brickCounts - 1);
+    auto last = glm::clamp(glm::ivec3(glm::floor((shaftBounds.max - bounds.min) / brickSize)), glm::ivec3(0), brickCounts - 1);
+
+    // The quads of the voxels in the shaft are gathered, and then tested as
+    // in the BVH.
+    auto firstResult = result.size();
+    glm::ivec3 brick;
+    for(brick.z = first.z; brick.z <= last.z; ++brick.z)
+    {
+        for(brick.y = first.y; brick.y <= last.y; ++brick.y)
+        {
+            for(brick.x = first.x; brick.x <= last.x; ++brick.x)
+            {
+                auto brickSlot = findBrick(brick);
+                if(brickSlot == NoBrick)
+                    continue;
+
+                auto brickMin = bounds.min + glm::vec3(brick)*brickSize;
+                if(shaft.isBoxOutside(Box3(brickMin - voxelPadding, brickMin + brickSize + voxelPadding)))
+                    continue;
+
+                auto voxelBits = brickVoxelBits[brickSlot];
+                auto voxelIndex = brickVoxelRanks[brickSlot];
+                for(; voxelBits != 0; voxelBits &= voxelBits - 1, ++voxelIndex)
+                {
+                    auto local = int(countTrailingZeros(voxelBits));
+                    auto voxel = glm::ivec3(local % BrickSize, (local / BrickSize) % BrickSize, local / (BrickSize*BrickSize));
+                    auto voxelMin = brickMin + glm::vec3(voxel)*voxelSize;
+                    if(shaft.isBoxOutside(Box3(voxelMin - voxelPadding, voxelMin + voxelSize + voxelPadding)))
+                        continue;
+
+                    result.insert(result.end(), voxelQuads.begin() + voxelQuadOffsets[voxelIndex],
+                        voxelQuads.begin() + voxelQuadOffsets[voxelIndex + 1]);
+                }
+            }
+        }
+    }
+
+    std::sort(result.begin() + firstResult, result.end());
+    result.erase(std::unique(result.begin() + firstResult, result.end()), result.end());
+    result.erase(std::remove_if(result.begin() + firstResult, result.end(), [&](uint32_t quad) {
+        glm::vec3 vertices[4];
+        for(int j = 0; j < 4; ++j)
+            vertices[j] = (*quads)[quad].vertexPosition(j);
+        return shaft.arePointsOutside(vertices, 4);
+    }), result.end());
+}
+
+} // End of namespace RadiosityTest
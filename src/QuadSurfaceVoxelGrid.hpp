@@ -0,0 +1,120 @@
+#ifndef RADIOSITY_TEST_QUAD_SURFACE_VOXEL_GRID_HPP
+#define RADIOSITY_TEST_QUAD_SURFACE_VOXEL_GRID_HPP
+
+#include "Lightmap.hpp"
+#include "Shaft.hpp"
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+namespace RadiosityTest
+{
+DECLARE_CLASS(QuadSurfaceVoxelGrid);
+
+/**
+ * Uniform voxel grid over the quad surfaces of a lightmap, for the scenes
+ * where the BVH takes too much memory. The quads are conservatively
+ * voxelized, and the occupancy has two levels of bits: a bit for every brick
+ * of 4x4x4 voxels, and a word with the voxels of every occupied brick. Only
+ * the occupied voxels have quad lists. A ray walks the bricks and then the
+ * voxels of the occupied bricks with a 3D DDA, and only intersects the quads
+ * of the occupied voxels. Answers any hit occlusion queries.
+ */
+class QuadSurfaceVoxelGrid : public Object
+{
+public:
+    static constexpr int BrickSize = 4;
+    static constexpr size_t DefaultMaxResolution = 256;
+    static constexpr float DefaultVoxelsPerQuad = 8.0f;
+
+    QuadSurfaceVoxelGrid();
+    ~QuadSurfaceVoxelGrid();
+
+    // The quads are not copied, so they must outlive the grid, and the grid
+    // must be built again when they change.
+    void build(const std::vector<LightmapCompactQuadSurface> &newQuads);
+
+    // Is there any quad in (0, ray.maxDistance), other than the ignored ones?
+    bool isOccluded(const Ray &ray, size_t ignoredQuad, size_t otherIgnoredQuad) const;
+
+    // Appends the indices of the quads that are not outside of the shaft.
+    void findShaftQuads(const Shaft &shaft, std::vector<uint32_t> &result) const;
+
+    // The voxel count along the longest axis is at most the maximum
+    // resolution. It takes effect on the next build.
+    size_t getMaxResolution() const
+    {
+        return maxResolution;
+    }
+
+    void setMaxResolution(size_t newMaxResolution)
+    {
+        maxResolution = std::max(newMaxResolution, size_t(BrickSize));
+    }
+
+    // The voxel count aimed at for every quad, before the resolution limit.
+    // It takes effect on the next build.
+    float getVoxelsPerQuad() const
+    {
+        return voxelsPerQuad;
+    }
+
+    void setVoxelsPerQuad(float newVoxelsPerQuad)
+    {
+        voxelsPerQuad = newVoxelsPerQuad;
+    }
+
+    glm::ivec3 getResolution() const
+    {
+        return brickCounts*BrickSize;
+    }
+
+    size_t getOccupiedVoxelCount() const
+    {
+        return voxelQuadOffsets.empty() ? 0 : voxelQuadOffsets.size() - 1;
+    }
+
+    size_t getQuadReferenceCount() const
+    {
+        return voxelQuads.size();
+    }
+
+    size_t getMemorySize() const
+    {
+        return brickBits.size()*sizeof(uint64_t) + brickBitRanks.size()*sizeof(uint32_t) +
+            brickVoxelBits.size()*sizeof(uint64_t) + brickVoxelRanks.size()*sizeof(uint32_t) +
+            voxelQuadOffsets.size()*sizeof(uint32_t) + voxelQuads.size()*sizeof(uint32_t);
+    }
+
+private:
+    static constexpr uint32_t NoBrick = ~uint32_t(0);
+
+    // The position of an occupied brick in the brick arrays, or NoBrick.
+    uint32_t findBrick(const glm::ivec3 &brick) const;
+
+    const std::vector<LightmapCompactQuadSurface> *quads;
+    size_t maxResolution;
+    float voxelsPerQuad;
+
+    Box3 bounds;
+    float voxelSize;
+    float voxelPadding;
+    glm::ivec3 brickCounts;
+
+    // A bit for every brick, and the occupied bricks before every word.
+    std::vector<uint64_t> brickBits;
+    std::vector<uint32_t> brickBitRanks;
+
+    // The voxel bits of the occupied bricks, and the occupied voxels before
+    // every brick.
+    std::vector<uint64_t> brickVoxelBits;
+    std::vector<uint32_t> brickVoxelRanks;
+
+    // The quads of the occupied voxels.
+    std::vector<uint32_t> voxelQuadOffsets;
+    std::vector<uint32_t> voxelQuads;
+};
+
+} // End of namespace RadiosityTest
+
+#endif //RADIOSITY_TEST_QUAD_SURFACE_VOXEL_GRID_HPP
@@ -0,0 +1,109 @@
+#ifndef RADIOSITY_TEST_RADIANCE_BUFFER_HPP
+#define RADIOSITY_TEST_RADIANCE_BUFFER_HPP
+
+#include <glm/vec3.hpp>
+#include <vector>
+#include <algorithm>
+#include <math.h>
+
+namespace RadiosityTest
+{
+
+/**
+ * Per patch radiance, stored as a structure of arrays with one contiguous
+ * array per color channel.
+ */
+struct RadianceBuffer
+{
+    size_t size() const
+    {
+        return red.size();
+    }
+
+    void resize(size_t newSize)
+    {
+        red.resize(newSize);
+        green.resize(newSize);
+        blue.resize(newSize);
+    }
+
+    void clear()
+    {
+        std::fill(red.begin(), red.end(), 0.0f);
+        std::fill(green.begin(), green.end(), 0.0f);
+        std::fill(blue.begin(), blue.end(), 0.0f);
+    }
+
+    void swap(RadianceBuffer &other)
+    {
+        red.swap(other.red);
+        green.swap(other.green);
+        blue.swap(other.blue);
+    }
+
+    glm::vec3 get(size_t index) const
+    {
+        return glm::vec3(red[index], green[index], blue[index]);
+    }
+
+    void set(size_t index, const glm::vec3 &value)
+    {
+        red[index] = value.r;
+        green[index] = value.g;
+        blue[index] = value.b;
+    }
+
+    void add(size_t index, const glm::vec3 &value)
+    {
+        red[index] += value.r;
+        green[index] += value.g;
+        blue[index] += value.b;
+    }
+
+    // Stores a + b into this buffer.
+    void setSum(const RadianceBuffer &a, const RadianceBuffer &b)
+    {
+        resize(a.size());
+        for(size_t i = 0; i < a.size(); ++i)
+        {
+            red[i] = a.red[i] + b.red[i];
+            green[i] = a.green[i] + b.green[i];
+            blue[i] = a.blue[i] + b.blue[i];
+        }
+    }
+
+    // Adds other*scale into this buffer. The channels are separate loops,
+    // which the compiler vectorizes.
+    void addScaled(const RadianceBuffer &other, const glm::vec3 &scale)
+    {
+        auto count = size();
+        for(size_t i = 0; i < count; ++i)
+            red[i] += other.red[i]*scale.r;
+        for(size_t i = 0; i < count; ++i)
+            green[i] += other.green[i]*scale.g;
+        for(size_t i = 0; i < count; ++i)
+            blue[i] += other.blue[i]*scale.b;
+    }
+
+    // The largest per channel difference with another buffer.
+    float maxDifference(const RadianceBuffer &other) const
+    {
+        float result = 0.0f;
+        for(size_t i = 0; i < size(); ++i)
+        {
+            result = std::max(result, fabsf(red[i] - other.red[i]));
+            result = std::max(result, fabsf(green[i] - other.green[i]));
+            result = std::max(result, fabsf(blue[i] - other.blue[i]));
+        }
+
+        return result;
+    }
+
+    std::vector<float> red;
+    std::vector<float> green;
+    std::vector<float> blue;
+};
+
+} // End of namespace RadiosityTest
+
+#endif //RADIOSITY_TEST_RADIANCE_BUFFER_HPP
@@ -0,0 +1,238 @@
+#include "RadiosityKernels.hpp"
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RADIOSITY_TEST_HAS_SSE 1
+#include <emmintrin.h>
+#endif
+
+#if defined(__AVX2__)
+#define RADIOSITY_TEST_HAS_AVX2 1
+#include <immintrin.h>
+#endif
+
+namespace RadiosityTest
+{
+
+const char *getGatherKernelName(GatherKernel kernel)
+{
+    switch(kernel)
+    {
+    case GatherKernel::Scalar: return "Scalar";
+    case GatherKernel::SSE: return "SSE";
+    case GatherKernel::AVX2: return "AVX2";
+    }
+
+    return "Unknown";
+}
+
+bool isGatherKernelSupported(GatherKernel kernel)
+{
+    switch(kernel)
+    {
+    case GatherKernel::Scalar:
+        return true;
+    case GatherKernel::SSE:
+#ifdef RADIOSITY_TEST_HAS_SSE
+        return true;
+#else
+        return false;
+#endif
+    case GatherKernel::AVX2:
+#ifdef RADIOSITY_TEST_HAS_AVX2
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    return false;
+}
+
+GatherKernel getBestGatherKernel()
+{
+    if(isGatherKernelSupported(GatherKernel::AVX2))
+        return GatherKernel::AVX2;
+    if(isGatherKernelSupported(GatherKernel::SSE))
+        return GatherKernel::SSE;
+    return GatherKernel::Scalar;
+}
+
+/**
+ * The arrays read by the gather kernels.
+ */
+struct GatherArrays
+{
+    GatherArrays(const SparseMatrix &transport, const RadianceBuffer &emission)
+        : columns(&transport.columns[0]), values(&transport.values[0]),
+          red(&emission.red[0]), green(&emission.green[0]), blue(&emission.blue[0]) {}
+
+    const uint32_t *columns;
+    const float *values;
+    const float *red;
+    const float *green;
+    const float *blue;
+};
+
+// Sums the emission of the links in [k, end), weighted by their factor.
+static glm::vec3 accumulateLinksScalar(const GatherArrays &arrays, size_t k, size_t end)
+{
+    float r = 0.0f, g = 0.0f, b = 0.0f;
+    for(; k < end; ++k)
+    {
+        auto column = arrays.columns[k];
+        auto factor = arrays.values[k];
+        r += arrays.red[column]*factor;
+        g += arrays.green[column]*factor;
+        b += arrays.blue[column]*factor;
+    }
+
+    return glm::vec3(r, g, b);
+}
+
+#ifdef RADIOSITY_TEST_HAS_SSE
+inline float horizontalSum(__m128 value)
+{
+    auto shuffled = _mm_shuffle_ps(value, value, _MM_SHUFFLE(2, 3, 0, 1));
+    auto sums = _mm_add_ps(value, shuffled);
+    shuffled = _mm_movehl_ps(shuffled, sums);
+    sums = _mm_add_ss(sums, shuffled);
+    return _mm_cvtss_f32(sums);
+}
+
+static glm::vec3 accumulateLinksSSE(const GatherArrays &arrays, size_t k, size_t end)
+{
+    auto columns = arrays.columns;
+    auto red = arrays.red;
+    auto green = arrays.green;
+    auto blue = arrays.blue;
+
+    // Four links per iteration. SSE has no gather, so the emission is
+    // loaded lane by lane.
+    auto r4 = _mm_setzero_ps();
+    auto g4 = _mm_setzero_ps();
+    auto b4 = _mm_setzero_ps();
+    for(; k + 4 <= end; k += 4)
+    {
+        auto c0 = columns[k]; auto c1 = columns[k + 1];
+        auto c2 = columns[k + 2]; auto c3 = columns[k + 3];
+        auto factors = _mm_loadu_ps(arrays.values + k);
+        r4 = _mm_add_ps(r4, _mm_mul_ps(factors, _mm_set_ps(red[c3], red[c2], red[c1], red[c0])));
+        g4 = _mm_add_ps(g4, _mm_mul_ps(factors, _mm_set_ps(green[c3], green[c2], green[c1], green[c0])));
+        b4 = _mm_add_ps(b4, _mm_mul_ps(factors, _mm_set_ps(blue[c3], blue[c2], blue[c1], blue[c0])));
+    }
+
+    return glm::vec3(horizontalSum(r4), horizontalSum(g4), horizontalSum(b4)) + accumulateLinksScalar(arrays, k, end);
+}
+#endif
+
+#ifdef RADIOSITY_TEST_HAS_AVX2
+inline float horizontalSum(__m256 value)
+{
+    return horizontalSum(_mm_add_ps(_mm256_castps256_ps128(value), _mm256_extractf128_ps(value, 1)));
+}
+
+inline __m256 multiplyAdd(__m256 a, __m256 b, __m256 c)
+{
+#ifdef __FMA__
+    return _mm256_fmadd_ps(a, b, c);
+#else
+    return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+#endif
+}
+
+static glm::vec3 accumulateLinksAVX2(const GatherArrays &arrays, size_t k, size_t end)
+{
+    // Eight links per iteration.
+    auto r8 = _mm256_setzero_ps();
+    auto g8 = _mm256_setzero_ps();
+    auto b8 = _mm256_setzero_ps();
+    for(; k + 8 <= end; k += 8)
+    {
+        auto indices = _mm256_loadu_si256(reinterpret_cast<const __m256i*> (arrays.columns + k));
+        auto factors = _mm256_loadu_ps(arrays.values + k);
+        r8 = multiplyAdd(factors, _mm256_i32gather_ps(arrays.red, indices, 4), r8);
+        g8 = multiplyAdd(factors, _mm256_i32gather_ps(arrays.green, indices, 4), g8);
+        b8 = multiplyAdd(factors, _mm256_i32gather_ps(arrays.blue, indices, 4), b8);
+    }
+
+    return glm::vec3(horizontalSum(r8), horizontalSum(g8), horizontalSum(b8)) + accumulateLinksScalar(arrays, k, end);
+}
+#endif
+
+typedef glm::vec3 (*AccumulateLinksFunction) (const GatherArrays &arrays, size_t k, size_t end);
+
+template<AccumulateLinksFunction accumulateLinks>
+static void gatherRows(const SparseMatrix &transport, const std::vector<float> &rowScale,
+    const RadianceBuffer &emission, RadianceBuffer &result, size_t beginRow, size_t endRow)
+{
+    GatherArrays arrays(transport, emission);
+    for(size_t i = beginRow; i < endRow; ++i)
+        result.set(i, accumulateLinks(arrays, transport.rowBegin(i), transport.rowEnd(i))*rowScale[i]);
+}
+
+/**
+ * Gathers a block of rows one tile of columns at a time, so the emission of
+ * the tile is reused by every row of the block while it is in the cache.
+ */
+template<AccumulateLinksFunction accumulateLinks>
+static void gatherRowsTiled(const SparseMatrix &transport, const std::vector<float> &rowScale,
+    const RadianceBuffer &emission, RadianceBuffer &result, size_t beginRow, size_t endRow)
+{
+    GatherArrays arrays(transport, emission);
+    auto tileCount = transport.getColumnTileCount();
+
+    glm::vec3 sums[TiledGatherRowCount];
+    for(size_t blockBegin = beginRow; blockBegin < endRow; blockBegin += TiledGatherRowCount)
+    {
+        auto blockEnd = std::min(blockBegin + TiledGatherRowCount, endRow);
+        std::fill(sums, sums + (blockEnd - blockBegin), glm::vec3());
+
+        for(size_t tile = 0; tile < tileCount; ++tile)
+        {
+            for(size_t i = blockBegin; i < blockEnd; ++i)
+                sums[i - blockBegin] += accumulateLinks(arrays, transport.tileBegin(i, tile), transport.tileBegin(i, tile + 1));
+        }
+
+        for(size_t i = blockBegin; i < blockEnd; ++i)
+            result.set(i, sums[i - blockBegin]*rowScale[i]);
+    }
+}
+
+template<AccumulateLinksFunction accumulateLinks>
+static void gatherTransportRowsWith(const SparseMatrix &transport, const std::vector<float> &rowScale,
+    const RadianceBuffer &emission, RadianceBuffer &result, size_t beginRow, size_t endRow)
+{
+    if(transport.hasColumnTiles())
+        gatherRowsTiled<accumulateLinks> (transport, rowScale, emission, result, beginRow, endRow);
+    else
+        gatherRows<accumulateLinks> (transport, rowScale, emission, result, beginRow, endRow);
+}
+
+void gatherTransportRows(GatherKernel kernel, const SparseMatrix &transport, const std::vector<float> &rowScale,
+    const RadianceBuffer &emission, RadianceBuffer &result, size_t beginRow, size_t endRow)
+{
+    // Without any link, the rows gather nothing.
+    if(transport.getNonZeroCount() == 0)
+    {
+        for(size_t i = beginRow; i < endRow; ++i)
+            result.set(i, glm::vec3());
+        return;
+    }
+
+    switch(kernel)
+    {
+#ifdef RADIOSITY_TEST_HAS_AVX2
+    case GatherKernel::AVX2:
+        return gatherTransportRowsWith<accumulateLinksAVX2> (transport, rowScale, emission, result, beginRow, endRow);
+#endif
+#ifdef RADIOSITY_TEST_HAS_SSE
+    case GatherKernel::SSE:
+        return gatherTransportRowsWith<accumulateLinksSSE> (transport, rowScale, emission, result, beginRow, endRow);
+#endif
+    default:
+        return gatherTransportRowsWith<accumulateLinksScalar> (transport, rowScale, emission, result, beginRow, endRow);
+    }
+}
+
+} // End of namespace RadiosityTest
@@ -0,0 +1,42 @@
+#ifndef RADIOSITY_TEST_RADIOSITY_KERNELS_HPP
+#define RADIOSITY_TEST_RADIOSITY_KERNELS_HPP
+
+#include "SparseMatrix.hpp"
+#include "RadianceBuffer.hpp"
+
+namespace RadiosityTest
+{
+
+/**
+ * The instruction set used by the transport gather kernel.
+ */
+enum class GatherKernel
+{
+    Scalar = 0,
+    SSE,
+    AVX2,
+};
+
+/**
+ * Rows gathered together in each tile of columns, when the transport has
+ * column tiles.
+ */
+static constexpr size_t TiledGatherRowCount = 64;
+
+const char *getGatherKernelName(GatherKernel kernel);
+
+// The SIMD kernels are only available when enabled at compile time.
+bool isGatherKernelSupported(GatherKernel kernel);
+GatherKernel getBestGatherKernel();
+
+/**
+ * Computes result[i] = rowScale[i] * sum_j(transport[i][j] * emission[j]) for
+ * the rows in [beginRow, endRow). The columns are visited by tiles when the
+ * transport has them.
+ */
+void gatherTransportRows(GatherKernel kernel, const SparseMatrix &transport, const std::vector<float> &rowScale,
+    const RadianceBuffer &emission, RadianceBuffer &result, size_t beginRow, size_t endRow);
+
+} // End of namespace RadiosityTest
+
+#endif //RADIOSITY_TEST_RADIOSITY_KERNELS_HPP
@@ -15,11 +15,19 @@ struct Ray
     Ray(const glm::vec3 &position, const glm::vec3 &direction, float maxDistance = INFINITY)
         : position(position), direction(direction), maxDistance(maxDistance) {}
 
+    // The share of a segment, at each end, where a hit does not count. The
+    // end points are patch centres or lights, and a surface that touches
+    // them is hit there only up to the rounding of the intersection.
+    static constexpr float EndPointTolerance = 1e-4f;
+
+    // The ray between two points, which only counts the hits strictly
+    // between them, away from the end points by the tolerance.
     static Ray fromEndPoints(const glm::vec3 &start, const glm::vec3 &end)
     {
         auto delta = end - start;
         auto length = glm::length(delta);
-        return Ray(start, delta / length, length);
+        auto direction = delta / length;
+        return Ray(start + direction*(length*EndPointTolerance), direction, length*(1.0f - 2.0f*EndPointTolerance));
     }
 
     glm::vec3 position;
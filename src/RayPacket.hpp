@@ -0,0 +1,84 @@
+#ifndef RADIOSITY_TEST_RAY_PACKET_HPP
+#define RADIOSITY_TEST_RAY_PACKET_HPP
+
+#include "Ray.hpp"
+#include <stdint.h>
+#include <string.h>
+
+namespace RadiosityTest
+{
+
+/**
+ * The octant of a direction, one bit per negative component.
+ */
+inline uint32_t directionOctant(const glm::vec3 &direction)
+{
+    return (direction.x < 0.0f ? 1 : 0) | (direction.y < 0.0f ? 2 : 0) | (direction.z < 0.0f ? 4 : 0);
+}
+
+/**
+ * A group of coherent rays that are traced together. Each ray has its own
+ * pair of ignored quads, and the results are returned as a bit mask. The
+ * box test data is also stored by lanes, so a whole packet is tested against
+ * a box without branches.
+ */
+struct RayPacket
+{
+    static constexpr size_t MaxSize = 16;
+
+    RayPacket()
+        : size(0)
+    {
+        memset(origins, 0, sizeof(origins));
+        memset(inverseDirections, 0, sizeof(inverseDirections));
+        memset(parallelAxes, 0, sizeof(parallelAxes));
+        memset(maxDistances, 0, sizeof(maxDistances));
+    }
+
+    bool isFull() const
+    {
+        return size == MaxSize;
+    }
+
+    void clear()
+    {
+        size = 0;
+    }
+
+    void add(const Ray &ray, size_t ignoredQuad, size_t otherIgnoredQuad)
+    {
+        rays[size] = ray;
+        ignoredQuads[size] = ignoredQuad;
+        otherIgnoredQuads[size] = otherIgnoredQuad;
+        maxDistances[size] = ray.maxDistance;
+        for(int axis = 0; axis < 3; ++axis)
+        {
+            // The inverse of a parallel axis is never used, so it is kept
+            // finite.
+            auto parallel = ray.direction[axis] == 0.0f;
+            origins[axis][size] = ray.position[axis];
+            inverseDirections[axis][size] = parallel ? 0.0f : 1.0f / ray.direction[axis];
+            parallelAxes[axis][size] = parallel ? -1 : 0;
+        }
+        ++size;
+    }
+
+    uint32_t getFullMask() const
+    {
+        return (1u << size) - 1;
+    }
+
+    Ray rays[MaxSize];
+    size_t ignoredQuads[MaxSize];
+    size_t otherIgnoredQuads[MaxSize];
+    size_t size;
+
+    float origins[3][MaxSize];
+    float inverseDirections[3][MaxSize];
+    int32_t parallelAxes[3][MaxSize];
+    float maxDistances[MaxSize];
+};
+
+} // End of namespace RadiosityTest
+
+#endif //RADIOSITY_TEST_RAY_PACKET_HPP
@@ -0,0 +1,254 @@
+#include "SceneOcclusion.hpp"
+#include "QuadSurfaceBVH.hpp"
+#include <algorithm>
+#include <stdio.h>
+#include <math.h>
+
+namespace RadiosityTest
+{
+
+static constexpr size_t MaxTraversalDepth = 64;
+static constexpr float BoxTestMargin = 1e-4f;
+
+static bool rayIntersectsBox(const Box3 &box, const glm::vec3 &origin, const glm::vec3 &inverseDirection, float maxDistance)
+{
+    float entry = 0.0f;
+    float exit = maxDistance;
+    for(int axis = 0; axis < 3; ++axis)
+    {
+        if(isinf(inverseDirection[axis]))
+        {
+            if(origin[axis] < box.min[axis] || origin[axis] > box.max[axis])
+                return false;
+            continue;
+        }
+
+        auto t1 = (box.min[axis] - origin[axis])*inverseDirection[axis];
+        auto t2 = (box.max[axis] - origin[axis])*inverseDirection[axis];
+        entry = std::max(entry, std::min(t1, t2));
+        exit = std::min(exit, std::max(t1, t2));
+    }
+
+    return entry <= exit*(1.0f + BoxTestMargin) + BoxTestMargin;
+}
+
+SceneOcclusion::SceneOcclusion()
+{
+}
+
+SceneOcclusion::~SceneOcclusion()
+{
+}
+
+Box3 SceneOcclusion::transformBounds(const glm::mat4 &transform, const Box3 &bounds)
+{
+    Box3 result;
+    if(bounds.isEmpty())
+        return result;
+
+    for(int i = 0; i < 8; ++i)
+        result.insertPoint(glm::vec3(transform*glm::vec4(bounds.corner(i), 1.0f)));
+    return result;
+}
+
+size_t SceneOcclusion::addInstance(Lightmap *lightmap, const glm::mat4 &transform)
+{
+    SceneOcclusionInstance instance;
+    instance.lightmap = lightmap;
+    instance.bvh = lightmap->getSharedQuadSurfaceBVH();
+    setInstanceTransform(instance, transform);
+    instances.push_back(instance);
+    return instances.size() - 1;
+}
+
+void SceneOcclusion::setInstanceTransform(SceneOcclusionInstance &instance, const glm::mat4 &transform)
+{
+    instance.transform = transform;
+    instance.inverseTransform = glm::inverse(transform);
+    instance.bounds = transformBounds(transform, instance.bvh->getBounds());
+}
+
+void SceneOcclusion::build()
+{
+    nodes.clear();
+    instanceOrder.resize(instances.size());
+    for(size_t i = 0; i < instances.size(); ++i)
+        instanceOrder[i] = i;
+
+    if(instances.empty())
+        return;
+
+    nodes.reserve(instances.size()*2);
+    nodes.push_back(SceneOcclusionNode());
+    buildNode(0, 0, instances.size());
+    printf("Scene occlusion: %zu instances, %zu top level nodes\n", instances.size(), nodes.size());
+}
+
+void SceneOcclusion::buildNode(uint32_t nodeIndex, uint32_t first, uint32_t count)
+{
+    Box3 bounds;
+    Box3 centerBounds;
+    for(auto i = first; i < first + count; ++i)
+    {
+        bounds.insertBox(instances[instanceOrder[i]].bounds);
+        centerBounds.insertPoint(instances[instanceOrder[i]].bounds.center());
+    }
+
+    nodes[nodeIndex].bounds = bounds;
+    nodes[nodeIndex].firstChild = 0;
+    nodes[nodeIndex].instance = instanceOrder[first];
+    if(count == 1)
+        return;
+
+    // There are few instances, so a median split on the longest axis of the
+    // centers is enough.
+    auto extent = centerBounds.extent();
+    int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    auto middle = count / 2;
+    std::nth_element(instanceOrder.begin() + first, instanceOrder.begin() + first + middle, instanceOrder.begin() + first + count,
+        [&](uint32_t a, uint32_t b) {
+        return instances[a].bounds.center()[axis] < instances[b].bounds.center()[axis];
+    });
+
+    auto firstChild = uint32_t(nodes.size());
+    nodes.push_back(SceneOcclusionNode());
+    nodes.push_back(SceneOcclusionNode());
+    nodes[nodeIndex].firstChild = firstChild;
+
+    buildNode(firstChild, first, middle);
+    buildNode(firstChild + 1, first + middle, count - middle);
+}
+
+void SceneOcclusion::refit()
+{
+    // The children come after their parents, so a reverse pass sees them
+    // first.
+    for(size_t i = nodes.size(); i-- > 0;)
+    {
+        auto &node = nodes[i];
+        if(node.isLeaf())
+        {
+            node.bounds = instances[node.instance].bounds;
+            continue;
+        }
+
+        node.bounds = nodes[node.firstChild].bounds;
+        node.bounds.insertBox(nodes[node.firstChild + 1].bounds);
+    }
+}
+
+bool SceneOcclusion::moveInstances(const std::vector<glm::mat4> &transforms, std::vector<std::vector<Box3>> &changedRegions)
+{
+    assert(transforms.size() == instances.size());
+    changedRegions.assign(instances.size(), std::vector<Box3> ());
+
+    auto oldInstances = instances;
+    std::vector<uint8_t> moved(instances.size(), 0);
+    auto anyMoved = false;
+    for(size_t i = 0; i < instances.size(); ++i)
+    {
+        if(transforms[i] == instances[i].transform)
+            continue;
+
+        setInstanceTransform(instances[i], transforms[i]);
+        moved[i] = 1;
+        anyMoved = true;
+    }
+
+    if(!anyMoved)
+        return false;
+
+    refit();
+    for(size_t i = 0; i < instances.size(); ++i)
+    {
+        for(size_t j = 0; j < instances.size(); ++j)
+        {
+            if(i == j || (!moved[i] && !moved[j]))
+                continue;
+
+            changedRegions[i].push_back(transformBounds(oldInstances[i].inverseTransform, oldInstances[j].bounds));
+            changedRegions[i].push_back(transformBounds(instances[i].inverseTransform, instances[j].bounds));
+        }
+    }
+
+    return true;
+}
+
+void SceneOcclusion::updateLightmapQuads(Lightmap *lightmap, const std::vector<Box3> &changedRegions)
+{
+    std::vector<uint8_t> changed(instances.size(), 0);
+    for(size_t i = 0; i < instances.size(); ++i)
+    {
+        auto &instance = instances[i];
+        if(instance.lightmap != lightmap)
+            continue;
+
+        instance.bvh = lightmap->getSharedQuadSurfaceBVH();
+        setInstanceTransform(instance, instance.transform);
+        changed[i] = 1;
+    }
+
+    refit();
+
+    // Every lightmap is only solved for its own instance.
+    for(size_t i = 0; i < instances.size(); ++i)
+    {
+        auto other = instances[i].lightmap;
+        if(changed[i] || other->getSceneOcclusion().get() != this || other->getSceneInstance() != i)
+            continue;
+
+        std::vector<Box3> regions;
+        for(size_t j = 0; j < instances.size(); ++j)
+        {
+            if(!changed[j])
+                continue;
+
+            auto toOther = instances[i].inverseTransform*instances[j].transform;
+            for(auto &region : changedRegions)
+                regions.push_back(transformBounds(toOther, region));
+        }
+
+        other->updateSceneOcclusion(regions);
+    }
+}
+
+bool SceneOcclusion::isOccluded(const Ray &ray, size_t ignoredInstance) const
+{
+    if(nodes.empty())
+        return false;
+
+    auto inverseDirection = 1.0f / ray.direction;
+    uint32_t stack[MaxTraversalDepth*2];
+    size_t stackSize = 0;
+    stack[stackSize++] = 0;
+
+    while(stackSize > 0)
+    {
+        auto &node = nodes[stack[--stackSize]];
+        if(!rayIntersectsBox(node.bounds, ray.position, inverseDirection, ray.maxDistance))
+            continue;
+
+        if(!node.isLeaf())
+        {
+            stack[stackSize++] = node.firstChild;
+            stack[stackSize++] = node.firstChild + 1;
+            continue;
+        }
+
+        if(node.instance == ignoredInstance)
+            continue;
+
+        // The distances along the ray are kept in mesh space, since the
+        // direction is transformed without normalizing it. No quad of the
+        // other instances is ignored.
+        auto &instance = instances[node.instance];
+        Ray meshRay(glm::vec3(instance.inverseTransform*glm::vec4(ray.position, 1.0f)),
+            glm::mat3(instance.inverseTransform)*ray.direction, ray.maxDistance);
+        if(instance.bvh->isOccluded(meshRay, size_t(-1), size_t(-1)))
+            return true;
+    }
+
+    return false;
+}
+
+} // End of namespace RadiosityTest
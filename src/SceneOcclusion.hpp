@@ -0,0 +1,114 @@
+#ifndef RADIOSITY_TEST_SCENE_OCCLUSION_HPP
+#define RADIOSITY_TEST_SCENE_OCCLUSION_HPP
+
+#include "Lightmap.hpp"
+#include <glm/glm.hpp>
+#include <vector>
+#include <stdint.h>
+
+namespace RadiosityTest
+{
+DECLARE_CLASS(SceneOcclusion);
+
+/**
+ * A lightmap placed in the scene. The bottom level is the BVH of the
+ * lightmap itself, which is in mesh space.
+ */
+struct SceneOcclusionInstance
+{
+    Lightmap *lightmap;
+    QuadSurfaceBVHPtr bvh;
+    glm::mat4 transform;
+    glm::mat4 inverseTransform;
+
+    // The bounds of the quads, in world space.
+    Box3 bounds;
+};
+
+/**
+ * A node of the top level BVH. An inner node has two consecutive children
+ * starting at firstChild, which always come after it, and a leaf has a
+ * single instance.
+ */
+struct SceneOcclusionNode
+{
+    bool isLeaf() const
+    {
+        return firstChild == 0;
+    }
+
+    Box3 bounds;
+    uint32_t firstChild;
+    uint32_t instance;
+};
+
+/**
+ * Two level BVH over the quad surfaces of every lightmap of a scene, so the
+ * objects shadow each other. The bottom level shares the BVH of every
+ * lightmap, in mesh space, and the top level is over the instances in world
+ * space. Moving instances only refits the top level.
+ */
+class SceneOcclusion : public Object
+{
+public:
+    static constexpr size_t NoInstance = ~size_t(0);
+
+    SceneOcclusion();
+    ~SceneOcclusion();
+
+    // Adds an instance of a lightmap with the transform of its object. The
+    // top level must be built again afterwards.
+    size_t addInstance(Lightmap *lightmap, const glm::mat4 &transform);
+
+    void build();
+
+    /**
+     * Sets the transforms of all the instances and refits the top level.
+     * Every instance gets the regions of its own mesh space where its links
+     * may have changed: the old and the new bounds of the instances that
+     * moved relative to it. Returns whether any instance moved.
+     */
+    bool moveInstances(const std::vector<glm::mat4> &transforms, std::vector<std::vector<Box3>> &changedRegions);
+
+    /**
+     * Takes the new BVH of a lightmap whose quads changed in the regions,
+     * which are in its mesh space, and refits the top level. The other
+     * lightmaps of the scene trace again their links that cross the regions.
+     */
+    void updateLightmapQuads(Lightmap *lightmap, const std::vector<Box3> &changedRegions);
+
+    // Is there any quad of another instance in (0, ray.maxDistance)? The
+    // ray is in world space.
+    bool isOccluded(const Ray &ray, size_t ignoredInstance) const;
+
+    size_t getInstanceCount() const
+    {
+        return instances.size();
+    }
+
+    const SceneOcclusionInstance &getInstance(size_t index) const
+    {
+        return instances[index];
+    }
+
+    size_t getNodeCount() const
+    {
+        return nodes.size();
+    }
+
+    // The bounds of a box after a transform.
+    static Box3 transformBounds(const glm::mat4 &transform, const Box3 &bounds);
+
+private:
+    void setInstanceTransform(SceneOcclusionInstance &instance, const glm::mat4 &transform);
+    void buildNode(uint32_t nodeIndex, uint32_t first, uint32_t count);
+    void refit();
+
+    std::vector<SceneOcclusionInstance> instances;
+    std::vector<SceneOcclusionNode> nodes;
+    std::vector<uint32_t> instanceOrder;
+};
+
+} // End of namespace RadiosityTest
+
+#endif //RADIOSITY_TEST_SCENE_OCCLUSION_HPP
@@ -0,0 +1,97 @@
+#include "Shaft.hpp"
+
+namespace RadiosityTest
+{
+
+void Shaft::build(const Box3 &first, const Box3 &second)
+{
+    bounds = first;
+    bounds.insertBox(second);
+    planeCount = 0;
+
+    // Where one box reaches further on an axis and the other box further on
+    // a second axis, the corner of the bounds between them is cut by a
+    // plane parallel to the third axis.
+    for(int i = 0; i < 3; ++i)
+    {
+        for(int j = i + 1; j < 3; ++j)
+        {
+            for(int corner = 0; corner < 4; ++corner)
+            {
+                auto iSign = (corner & 1) ? 1.0f : -1.0f;
+                auto jSign = (corner & 2) ? 1.0f : -1.0f;
+                glm::vec2 a((corner & 1) ? first.max[i] : first.min[i], (corner & 2) ? first.max[j] : first.min[j]);
+                glm::vec2 b((corner & 1) ? second.max[i] : second.min[i], (corner & 2) ? second.max[j] : second.min[j]);
+                auto iDelta = iSign*(a.x - b.x);
+                auto jDelta = jSign*(a.y - b.y);
+                if(!((iDelta > 0.0f && jDelta < 0.0f) || (iDelta < 0.0f && jDelta > 0.0f)))
+                    continue;
+
+                // The normal points out of the corner.
+                auto edge = b - a;
+                auto normal2 = glm::normalize(glm::vec2(edge.y, -edge.x));
+                if(normal2.x*iSign + normal2.y*jSign < 0.0f)
+                    normal2 = -normal2;
+
+                glm::vec3 normal;
+                normal[i] = normal2.x;
+                normal[j] = normal2.y;
+                addPlane(normal, glm::dot(normal2, a));
+            }
+        }
+    }
+}
+
+bool Shaft::isBoxOutside(const Box3 &box) const
+{
+    for(int axis = 0; axis < 3; ++axis)
+    {
+        if(box.max[axis] < bounds.min[axis] || box.min[axis] > bounds.max[axis])
+            return true;
+    }
+
+    // The corner that is the furthest inside of each plane.
+    for(size_t i = 0; i < planeCount; ++i)
+    {
+        auto &plane = planes[i];
+        glm::vec3 nearest(plane.x < 0.0f ? box.max.x : box.min.x,
+            plane.y < 0.0f ? box.max.y : box.min.y,
+            plane.z < 0.0f ? box.max.z : box.min.z);
+        if(glm::dot(glm::vec3(plane), nearest) > plane.w)
+            return true;
+    }
+
+    return false;
+}
+
+bool Shaft::arePointsOutside(const glm::vec3 *points, size_t count) const
+{
+    for(int axis = 0; axis < 3; ++axis)
+    {
+        auto allBelow = true;
+        auto allAbove = true;
+        for(size_t i = 0; i < count; ++i)
+        {
+            allBelow = allBelow && points[i][axis] < bounds.min[axis] - tolerance;
+            allAbove = allAbove && points[i][axis] > bounds.max[axis] + tolerance;
+        }
+
+        if(allBelow || allAbove)
+            return true;
+    }
+
+    for(size_t i = 0; i < planeCount; ++i)
+    {
+        auto &plane = planes[i];
+        auto allOutside = true;
+        for(size_t j = 0; j < count && allOutside; ++j)
+            allOutside = glm::dot(glm::vec3(plane), points[j]) > plane.w + tolerance;
+
+        if(allOutside)
+            return true;
+    }
+
+    return false;
+}
+
+} // End of namespace RadiosityTest
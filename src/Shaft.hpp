@@ -0,0 +1,66 @@
+#ifndef RADIOSITY_TEST_SHAFT_HPP
+#define RADIOSITY_TEST_SHAFT_HPP
+
+#include "Box3.hpp"
+#include <glm/glm.hpp>
+#include <stddef.h>
+
+namespace RadiosityTest
+{
+
+/**
+ * A conservative bound of the segments between two boxes (Haines and
+ * Wallace, "Shaft culling for efficient ray-cast radiosity", 1991). It is the
+ * box around both boxes, cut by the planes that join their edges. More
+ * planes can be added to restrict it further.
+ */
+class Shaft
+{
+public:
+    // The three pairs of axes have up to four planes each.
+    static constexpr size_t MaxPlaneCount = 16;
+
+    // The objects that only touch the boundary, up to this distance, are
+    // still inside of the shaft, since the rays along it may hit them.
+    static constexpr float DefaultTolerance = 1e-4f;
+
+    Shaft()
+        : planeCount(0), tolerance(DefaultTolerance) {}
+
+    void build(const Box3 &first, const Box3 &second);
+
+    // Keeps the points with dot(normal, point) <= distance.
+    void addPlane(const glm::vec3 &normal, float distance)
+    {
+        if(planeCount < MaxPlaneCount)
+            planes[planeCount++] = glm::vec4(normal, distance);
+    }
+
+    // Is the box completely outside? The test is strict, since the boxes are
+    // usually padded bounds.
+    bool isBoxOutside(const Box3 &box) const;
+
+    // Are all the points outside of the shaft? The points on its boundary are
+    // inside.
+    bool arePointsOutside(const glm::vec3 *points, size_t count) const;
+
+    const Box3 &getBounds() const
+    {
+        return bounds;
+    }
+
+    size_t getPlaneCount() const
+    {
+        return planeCount;
+    }
+
+private:
+    Box3 bounds;
+    glm::vec4 planes[MaxPlaneCount];
+    size_t planeCount;
+    float tolerance;
+};
+
+} // End of namespace RadiosityTest
+
+#endif //RADIOSITY_TEST_SHAFT_HPP
@@ -0,0 +1,80 @@
+#ifndef RADIOSITY_TEST_SPACE_FILLING_CURVE_HPP
+#define RADIOSITY_TEST_SPACE_FILLING_CURVE_HPP
+
+#include <stdint.h>
+
+namespace RadiosityTest
+{
+
+/**
+ * Number of bits per axis of the space filling curve coordinates.
+ */
+static constexpr uint32_t SpaceFillingCurveBits = 10;
+
+// Inserts two zero bits between the lower ten bits of the value.
+inline uint32_t spreadBitsBy2(uint32_t value)
+{
+    value &= 0x3ff;
+    value = (value | (value << 16)) & 0x030000ff;
+    value = (value | (value << 8)) & 0x0300f00f;
+    value = (value | (value << 4)) & 0x030c30c3;
+    value = (value | (value << 2)) & 0x09249249;
+    return value;
+}
+
+/**
+ * The position of a point along the 3D Morton (Z-order) curve.
+ */
+inline uint32_t mortonEncode3(uint32_t x, uint32_t y, uint32_t z)
+{
+    return (spreadBitsBy2(x) << 2) | (spreadBitsBy2(y) << 1) | spreadBitsBy2(z);
+}
+
+/**
+ * The position of a point along the 3D Hilbert curve. Uses the transpose
+ * algorithm from Skilling, "Programming the Hilbert curve" (2004).
+ */
+inline uint32_t hilbertEncode3(uint32_t x, uint32_t y, uint32_t z)
+{
+    uint32_t axes[3] = {x, y, z};
+
+    // Inverse undo
+    for(uint32_t q = 1u << (SpaceFillingCurveBits - 1); q > 1; q >>= 1)
+    {
+        auto p = q - 1;
+        for(int i = 0; i < 3; ++i)
+        {
+            if(axes[i] & q)
+            {
+                axes[0] ^= p;
+            }
+            else
+            {
+                auto t = (axes[0] ^ axes[i]) & p;
+                axes[0] ^= t;
+                axes[i] ^= t;
+            }
+        }
+    }
+
+    // Gray encode
+    axes[1] ^= axes[0];
+    axes[2] ^= axes[1];
+    uint32_t t = 0;
+    for(uint32_t q = 1u << (SpaceFillingCurveBits - 1); q > 1; q >>= 1)
+    {
+        if(axes[2] & q)
+            t ^= q - 1;
+    }
+
+    for(int i = 0; i < 3; ++i)
+        axes[i] ^= t;
+
+    // The transposed index is interleaved with the first axis on the most
+    // significant bit.
+    return (spreadBitsBy2(axes[0]) << 2) | (spreadBitsBy2(axes[1]) << 1) | spreadBitsBy2(axes[2]);
+}
+
+} // End of namespace RadiosityTest
+
+#endif //RADIOSITY_TEST_SPACE_FILLING_CURVE_HPP
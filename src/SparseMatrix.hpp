@@ -0,0 +1,289 @@
+#ifndef RADIOSITY_TEST_SPARSE_MATRIX_HPP
+#define RADIOSITY_TEST_SPARSE_MATRIX_HPP
+
+#include <vector>
+#include <assert.h>
+#include <stdint.h>
+#include <stddef.h>
+
+namespace RadiosityTest
+{
+
+/**
+ * A sparse matrix entry.
+ */
+struct SparseMatrixEntry
+{
+    SparseMatrixEntry(uint32_t row = 0, uint32_t column = 0, float value = 0.0f)
+        : row(row), column(column), value(value) {}
+
+    uint32_t row;
+    uint32_t column;
+    float value;
+};
+
+/**
+ * A sparse matrix stored in compressed sparse row (CSR) format.
+ */
+class SparseMatrix
+{
+public:
+    SparseMatrix()
+        : rowCount(0), columnCount(0), columnTileSize(0), columnTileCount(0)
+    {
+    }
+
+    void clear()
+    {
+        rowCount = columnCount = 0;
+        rowOffsets.clear();
+        columns.clear();
+        values.clear();
+        clearColumnTiles();
+    }
+
+    // Allocates the arrays, for filling them directly.
+    void resize(size_t newRowCount, size_t newColumnCount, size_t nonZeroCount)
+    {
+        rowCount = newRowCount;
+        columnCount = newColumnCount;
+        clearColumnTiles();
+        rowOffsets.resize(rowCount + 1);
+        columns.resize(nonZeroCount);
+        values.resize(nonZeroCount);
+    }
+
+    /**
+     * Builds a square symmetric matrix from the entries of its upper
+     * triangle, including the diagonal. The entries must be sorted by row
+     * and then by column.
+     */
+    void buildSymmetricFromUpperTriangle(size_t size, const std::vector<SparseMatrixEntry> &upperEntries)
+    {
+        rowCount = columnCount = size;
+        clearColumnTiles();
+
+        // Count the elements in each row.
+        rowOffsets.assign(size + 1, 0);
+        for(auto &entry : upperEntries)
+        {
+            assert(entry.row <= entry.column);
+            ++rowOffsets[entry.row + 1];
+            if(entry.row != entry.column)
+                ++rowOffsets[entry.column + 1];
+        }
+
+        for(size_t i = 0; i < size; ++i)
+            rowOffsets[i + 1] += rowOffsets[i];
+
+        // Scatter the elements. Since the upper entries are sorted, the
+        // mirrored lower entries of a row always arrive before its upper
+        // entries, which keeps the columns of each row sorted.
+        auto nonZeroCount = rowOffsets[size];
+        columns.resize(nonZeroCount);
+        values.resize(nonZeroCount);
+
+        std::vector<size_t> cursors(rowOffsets.begin(), rowOffsets.end() - 1);
+        for(auto &entry : upperEntries)
+        {
+            auto index = cursors[entry.row]++;
+            columns[index] = entry.column;
+            values[index] = entry.value;
+
+            if(entry.row != entry.column)
+            {
+                index = cursors[entry.column]++;
+                columns[index] = entry.row;
+                values[index] = entry.value;
+            }
+        }
+    }
+
+    /**
+     * Replaces entries of a square symmetric matrix. Every row has its
+     * updates of the upper triangle, sorted by column, and they are mirrored
+     * to the lower triangle. An update of zero removes the entry. The rows
+     * without updates are copied as they are.
+     */
+    void updateSymmetricEntries(const std::vector<std::vector<SparseMatrixEntry>> &upperRowUpdates)
+    {
+        assert(upperRowUpdates.size() == rowCount);
+        clearColumnTiles();
+
+        // The mirrored updates of a row come in row order, so they are
+        // sorted too, and they all come before the updates of the row.
+        std::vector<std::vector<SparseMatrixEntry>> lowerRowUpdates(rowCount);
+        for(auto &updates : upperRowUpdates)
+        {
+            for(auto &update : updates)
+            {
+                assert(update.row < update.column);
+                lowerRowUpdates[update.column].push_back(SparseMatrixEntry(update.column, update.row, update.value));
+            }
+        }
+
+        std::vector<size_t> newRowOffsets(rowCount + 1, 0);
+        std::vector<uint32_t> newColumns;
+        std::vector<float> newValues;
+        newColumns.reserve(columns.size());
+        newValues.reserve(values.size());
+        for(size_t row = 0; row < rowCount; ++row)
+        {
+            auto k = rowOffsets[row];
+            auto rowEnd = rowOffsets[row + 1];
+            auto &lowerUpdates = lowerRowUpdates[row];
+            auto &upperUpdates = upperRowUpdates[row];
+            if(lowerUpdates.empty() && upperUpdates.empty())
+            {
+                newColumns.insert(newColumns.end(), columns.begin() + k, columns.begin() + rowEnd);
+                newValues.insert(newValues.end(), values.begin() + k, values.begin() + rowEnd);
+                newRowOffsets[row + 1] = newColumns.size();
+                continue;
+            }
+
+            const std::vector<SparseMatrixEntry> *rowUpdates[] = {&lowerUpdates, &upperUpdates};
+            for(auto updates : rowUpdates)
+            {
+                for(auto &update : *updates)
+                {
+                    for(; k < rowEnd && columns[k] < update.column; ++k)
+                    {
+                        newColumns.push_back(columns[k]);
+                        newValues.push_back(values[k]);
+                    }
+
+                    if(k < rowEnd && columns[k] == update.column)
+                        ++k;
+
+                    if(update.value != 0.0f)
+                    {
+                        newColumns.push_back(update.column);
+                        newValues.push_back(update.value);
+                    }
+                }
+            }
+
+            newColumns.insert(newColumns.end(), columns.begin() + k, columns.begin() + rowEnd);
+            newValues.insert(newValues.end(), values.begin() + k, values.begin() + rowEnd);
+            newRowOffsets[row + 1] = newColumns.size();
+        }
+
+        rowOffsets.swap(newRowOffsets);
+        columns.swap(newColumns);
+        values.swap(newValues);
+    }
+
+    /**
+     * Splits every row at the boundaries of tiles of columns, so a product
+     * can visit the matrix one tile of columns at a time while the matching
+     * part of the vector stays in the cache. A matrix that fits in a single
+     * tile, or a tile size of zero, has no tiles.
+     */
+    void buildColumnTiles(size_t newColumnTileSize)
+    {
+        clearColumnTiles();
+        if(newColumnTileSize == 0 || columnCount <= newColumnTileSize)
+            return;
+
+        columnTileSize = newColumnTileSize;
+        columnTileCount = (columnCount + columnTileSize - 1) / columnTileSize;
+        tileOffsets.resize(rowCount*(columnTileCount + 1));
+        for(size_t row = 0; row < rowCount; ++row)
+        {
+            // The columns of a row are sorted.
+            auto offsets = &tileOffsets[row*(columnTileCount + 1)];
+            auto k = rowOffsets[row];
+            for(size_t tile = 0; tile < columnTileCount; ++tile)
+            {
+                offsets[tile] = k;
+                auto tileEnd = (tile + 1)*columnTileSize;
+                while(k < rowOffsets[row + 1] && columns[k] < tileEnd)
+                    ++k;
+            }
+            offsets[columnTileCount] = rowOffsets[row + 1];
+        }
+    }
+
+    void clearColumnTiles()
+    {
+        columnTileSize = columnTileCount = 0;
+        tileOffsets.clear();
+    }
+
+    bool hasColumnTiles() const
+    {
+        return columnTileCount != 0;
+    }
+
+    size_t getColumnTileSize() const
+    {
+        return columnTileSize;
+    }
+
+    size_t getColumnTileCount() const
+    {
+        return columnTileCount;
+    }
+
+    // The first element of a row in a tile. The tile count gives the row end.
+    size_t tileBegin(size_t row, size_t tile) const
+    {
+        return tileOffsets[row*(columnTileCount + 1) + tile];
+    }
+
+    size_t getRowCount() const
+    {
+        return rowCount;
+    }
+
+    size_t getColumnCount() const
+    {
+        return columnCount;
+    }
+
+    size_t getNonZeroCount() const
+    {
+        return values.size();
+    }
+
+    size_t getMemorySize() const
+    {
+        return rowOffsets.size()*sizeof(rowOffsets[0]) +
+            columns.size()*sizeof(columns[0]) +
+            values.size()*sizeof(values[0]) +
+            tileOffsets.size()*sizeof(size_t);
+    }
+
+    size_t rowBegin(size_t row) const
+    {
+        return rowOffsets[row];
+    }
+
+    size_t rowEnd(size_t row) const
+    {
+        return rowOffsets[row + 1];
+    }
+
+    float rowSum(size_t row) const
+    {
+        float sum = 0.0f;
+        for(size_t i = rowOffsets[row]; i < rowOffsets[row + 1]; ++i)
+            sum += values[i];
+        return sum;
+    }
+
+    std::vector<size_t> rowOffsets;
+    std::vector<uint32_t> columns;
+    std::vector<float> values;
+
+private:
+    size_t rowCount;
+    size_t columnCount;
+    size_t columnTileSize;
+    size_t columnTileCount;
+    std::vector<size_t> tileOffsets;
+};
+
+} // End of namespace RadiosityTest
+
+#endif //RADIOSITY_TEST_SPARSE_MATRIX_HPP
@@ -0,0 +1,297 @@
+#include "SurfaceVisibility.hpp"
+#include "Lightmap.hpp"
+#include "QuadSurfaceBVH.hpp"
+#include "QuadSurfaceVoxelGrid.hpp"
+#include "Shaft.hpp"
+#include "ThreadPool.hpp"
+#include "Float.hpp"
+#include <algorithm>
+#include <stdio.h>
+
+namespace RadiosityTest
+{
+
+static constexpr size_t TileRowsPerChunk = 4;
+static constexpr uint32_t NoCandidateList = ~uint32_t(0);
+
+SurfaceVisibility::SurfaceVisibility(size_t tileSize, float padding)
+    : tileSize(std::max(tileSize, size_t(1))), padding(std::max(padding, 0.0f)), quadKernel(QuadKernel::Scalar),
+      partialPatchPairCount(0)
+{
+    std::fill(pairCounts, pairCounts + 4, 0);
+}
+
+SurfaceVisibility::~SurfaceVisibility()
+{
+}
+
+void SurfaceVisibility::build(const Lightmap &lightmap)
+{
+    buildTiles(lightmap);
+    quadKernel = lightmap.getQuadKernel();
+    auto tileCount = tiles.size();
+    pairs.assign(tileCount*tileCount, SurfacePairVisibility::NotFacing);
+
+    // Every row writes its own pairs and their mirrors, and keeps the
+    // candidate lists of its partial pairs.
+    std::vector<std::vector<uint32_t>> rowPartners(tileCount);
+    std::vector<std::vector<uint32_t>> rowListEnds(tileCount);
+    std::vector<std::vector<uint32_t>> rowCandidates(tileCount);
+    auto classifyRows = [&](size_t begin, size_t end) {
+        std::vector<uint32_t> candidates;
+        for(size_t i = begin; i < end; ++i)
+        {
+            for(size_t j = i + 1; j < tileCount; ++j)
+            {
+                auto visibility = classifyPair(lightmap, i, j, candidates);
+                pairs[i*tileCount + j] = visibility;
+                pairs[j*tileCount + i] = visibility;
+                if(visibility != SurfacePairVisibility::Partial)
+                    continue;
+
+                rowPartners[i].push_back(j);
+                rowCandidates[i].insert(rowCandidates[i].end(), candidates.begin(), candidates.end());
+                rowListEnds[i].push_back(rowCandidates[i].size());
+            }
+        }
+    };
+
+    auto &threadPool = lightmap.getThreadPool();
+    if(threadPool)
+        threadPool->parallelForWorkStealing(tileCount, TileRowsPerChunk, classifyRows);
+    else
+        classifyRows(0, tileCount);
+
+    // Gather the candidate lists.
+    pairCandidateLists.assign(tileCount*tileCount, NoCandidateList);
+    candidateOffsets.assign(1, 0);
+    candidateQuads.clear();
+    for(size_t i = 0; i < tileCount; ++i)
+    {
+        uint32_t listBegin = 0;
+        for(size_t k = 0; k < rowPartners[i].size(); ++k)
+        {
+            auto j = rowPartners[i][k];
+            auto listIndex = uint32_t(candidateOffsets.size() - 1);
+            pairCandidateLists[i*tileCount + j] = listIndex;
+            pairCandidateLists[j*tileCount + i] = listIndex;
+
+            auto &candidates = rowCandidates[i];
+            candidateQuads.insert(candidateQuads.end(), candidates.begin() + listBegin, candidates.begin() + rowListEnds[i][k]);
+            candidateOffsets.push_back(candidateQuads.size());
+            listBegin = rowListEnds[i][k];
+        }
+
+        rowCandidates[i].clear();
+        rowCandidates[i].shrink_to_fit();
+    }
+
+    packedCandidates.build(lightmap.quadSurfaces, candidateQuads);
+
+    std::fill(pairCounts, pairCounts + 4, 0);
+    partialPatchPairCount = 0;
+    for(size_t i = 0; i < tileCount; ++i)
+    {
+        for(size_t j = i + 1; j < tileCount; ++j)
+        {
+            auto visibility = get(i, j);
+            ++pairCounts[size_t(visibility)];
+            if(visibility == SurfacePairVisibility::Partial)
+                partialPatchPairCount += size_t(tilePatchCounts[i])*tilePatchCounts[j];
+        }
+    }
+
+    printf("Surface tile pairs: %zu tiles, %zu visible, %zu occluded, %zu partial, %zu not facing, %.1f candidates per partial pair\n",
+        tileCount, pairCounts[size_t(SurfacePairVisibility::Visible)], pairCounts[size_t(SurfacePairVisibility::Occluded)],
+        pairCounts[size_t(SurfacePairVisibility::Partial)], pairCounts[size_t(SurfacePairVisibility::NotFacing)],
+        getMeanCandidateCount());
+}
+
+bool SurfaceVisibility::isRayOccluded(const Ray &ray, size_t firstPatch, size_t secondPatch) const
+{
+    auto list = pairCandidateLists[patchTiles[firstPatch]*tiles.size() + patchTiles[secondPatch]];
+    if(list == NoCandidateList)
+        return false;
+
+    // The surfaces of both tiles are never candidates.
+    return packedCandidates.anyHit(quadKernel, ray, candidateOffsets[list], candidateOffsets[list + 1], -1, -1);
+}
+
+void SurfaceVisibility::buildTiles(const Lightmap &lightmap)
+{
+    // The tiles are the squares of texels of the lightmap, split by surface.
+    auto &patches = lightmap.patches;
+    std::vector<uint64_t> tileKeys(patches.size());
+    auto width = std::max(lightmap.width, size_t(1));
+    for(size_t i = 0; i < patches.size(); ++i)
+    {
+        auto x = (patches[i].texelIndex % width) / tileSize;
+        auto y = (patches[i].texelIndex / width) / tileSize;
+        tileKeys[i] = (uint64_t(patches[i].surfaceIndex) << 40) | (uint64_t(y) << 20) | x;
+    }
+
+    std::vector<uint64_t> uniqueKeys(tileKeys);
+    std::sort(uniqueKeys.begin(), uniqueKeys.end());
+    uniqueKeys.erase(std::unique(uniqueKeys.begin(), uniqueKeys.end()), uniqueKeys.end());
+
+    // The patches are not always inside of their quad, so the shafts are
+    // built around the patches themselves.
+    auto &quads = lightmap.quadSurfaces;
+    auto tileCount = uniqueKeys.size();
+    std::vector<glm::vec2> minCoordinates(tileCount, glm::vec2(INFINITY));
+    std::vector<glm::vec2> maxCoordinates(tileCount, glm::vec2(-INFINITY));
+    std::vector<double> distanceSums(tileCount, 0.0);
+    tilePatchCounts.assign(tileCount, 0);
+    patchTiles.resize(patches.size());
+    tiles.resize(tileCount);
+    for(size_t i = 0; i < patches.size(); ++i)
+    {
+        auto &patch = patches[i];
+        auto tile = std::lower_bound(uniqueKeys.begin(), uniqueKeys.end(), tileKeys[i]) - uniqueKeys.begin();
+        auto &quad = quads[patch.surfaceIndex];
+        glm::vec2 coordinates(glm::dot(quad.tangent, patch.position), glm::dot(quad.bitangent, patch.position));
+        minCoordinates[tile] = glm::min(minCoordinates[tile], coordinates);
+        maxCoordinates[tile] = glm::max(maxCoordinates[tile], coordinates);
+        distanceSums[tile] += glm::dot(quad.normal, patch.position);
+        ++tilePatchCounts[tile];
+        patchTiles[i] = tile;
+        tiles[tile].surfaceIndex = patch.surfaceIndex;
+    }
+
+    for(size_t i = 0; i < tileCount; ++i)
+    {
+        auto &tile = tiles[i];
+        auto &quad = quads[tile.surfaceIndex];
+        tile.normal = quad.normal;
+        tile.distance = float(distanceSums[i] / tilePatchCounts[i]);
+        tile.bounds = Box3();
+
+        auto minCoordinate = minCoordinates[i] - padding;
+        auto maxCoordinate = maxCoordinates[i] + padding;
+        glm::vec2 coordinates[4] = {
+            minCoordinate,
+            glm::vec2(maxCoordinate.x, minCoordinate.y),
+            maxCoordinate,
+            glm::vec2(minCoordinate.x, maxCoordinate.y),
+        };
+
+        for(int j = 0; j < 4; ++j)
+        {
+            tile.corners[j] = quad.normal*tile.distance + quad.tangent*coordinates[j].x + quad.bitangent*coordinates[j].y;
+            tile.bounds.insertPoint(tile.corners[j]);
+        }
+    }
+}
+
+bool SurfaceVisibility::isFacing(const SurfaceTile &tile, const SurfaceTile &other) const
+{
+    for(int i = 0; i < 4; ++i)
+    {
+        if(glm::dot(tile.normal, other.corners[i]) - tile.distance > -FloatEpsilon)
+            return true;
+    }
+
+    return false;
+}
+
+SurfacePairVisibility SurfaceVisibility::classifyPair(const Lightmap &lightmap, size_t first, size_t second,
+    std::vector<uint32_t> &candidates) const
+{
+    // The patches of a surface are coplanar, so they never see each other.
+    auto &firstTile = tiles[first];
+    auto &secondTile = tiles[second];
+    if(firstTile.surfaceIndex == secondTile.surfaceIndex ||
+        !isFacing(firstTile, secondTile) || !isFacing(secondTile, firstTile))
+        return SurfacePairVisibility::NotFacing;
+
+    // The linked patch pairs are in front of both surfaces, so the occluders
+    // behind one of them are culled too.
+    Shaft shaft;
+    shaft.build(firstTile.bounds, secondTile.bounds);
+    shaft.addPlane(-firstTile.normal, -firstTile.distance);
+    shaft.addPlane(-secondTile.normal, -secondTile.distance);
+
+    candidates.clear();
+    auto &quads = lightmap.quadSurfaces;
+    auto &bvh = lightmap.getQuadSurfaceBVH();
+    auto &voxelGrid = lightmap.getQuadSurfaceVoxelGrid();
+    if(lightmap.getOcclusionBackend() == OcclusionBackend::BVH && bvh)
+    {
+        bvh->findShaftQuads(shaft, candidates);
+    }
+    else if(lightmap.getOcclusionBackend() == OcclusionBackend::VoxelGrid && voxelGrid)
+    {
+        voxelGrid->findShaftQuads(shaft, candidates);
+    }
+    else
+    {
+        for(size_t i = 0; i < quads.size(); ++i)
+        {
+            glm::vec3 vertices[4];
+            for(int j = 0; j < 4; ++j)
+                vertices[j] = quads[i].vertexPosition(j);
+            if(!shaft.arePointsOutside(vertices, 4))
+                candidates.push_back(i);
+        }
+    }
+
+    candidates.erase(std::remove_if(candidates.begin(), candidates.end(), [&](uint32_t candidate) {
+        return candidate == firstTile.surfaceIndex || candidate == secondTile.surfaceIndex;
+    }), candidates.end());
+    if(candidates.empty())
+        return SurfacePairVisibility::Visible;
+
+    for(auto candidate : candidates)
+    {
+        if(blocksAllSegments(quads[candidate], firstTile, secondTile))
+            return SurfacePairVisibility::Occluded;
+    }
+
+    return SurfacePairVisibility::Partial;
+}
+
+bool SurfaceVisibility::blocksAllSegments(const LightmapCompactQuadSurface &occluder, const SurfaceTile &first,
+    const SurfaceTile &second) const
+{
+    // Both tiles must be strictly on opposite sides of the occluder.
+    float firstDistances[4];
+    float secondDistances[4];
+    auto firstMin = INFINITY, firstMax = -INFINITY, secondMin = INFINITY, secondMax = -INFINITY;
+    for(int i = 0; i < 4; ++i)
+    {
+        firstDistances[i] = glm::dot(occluder.normal, first.corners[i]) - occluder.distance;
+        secondDistances[i] = glm::dot(occluder.normal, second.corners[i]) - occluder.distance;
+        firstMin = std::min(firstMin, firstDistances[i]);
+        firstMax = std::max(firstMax, firstDistances[i]);
+        secondMin = std::min(secondMin, secondDistances[i]);
+        secondMax = std::max(secondMax, secondDistances[i]);
+    }
+
+    if(!((firstMin > FloatEpsilon && secondMax < -FloatEpsilon) || (firstMax < -FloatEpsilon && secondMin > FloatEpsilon)))
+        return false;
+
+    // The occluder and the tiles are convex, so the segments between
+    // the corners bound all the others.
+    for(int i = 0; i < 4; ++i)
+    {
+        for(int j = 0; j < 4; ++j)
+        {
+            auto alpha = firstDistances[i] / (firstDistances[i] - secondDistances[j]);
+            auto point = first.corners[i] + (second.corners[j] - first.corners[i])*alpha;
+            glm::vec2 projected(glm::dot(occluder.tangent, point), glm::dot(occluder.bitangent, point));
+            for(int k = 0; k < 4; ++k)
+            {
+                auto &a = occluder.vertices[k];
+                auto &b = occluder.vertices[(k + 1) % 4];
+                auto edge = b - a;
+                auto offset = projected - a;
+                if(edge.x*offset.y - edge.y*offset.x <= FloatEpsilon)
+                    return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+} // End of namespace RadiosityTest
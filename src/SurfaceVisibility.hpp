@@ -0,0 +1,137 @@
+#ifndef RADIOSITY_TEST_SURFACE_VISIBILITY_HPP
+#define RADIOSITY_TEST_SURFACE_VISIBILITY_HPP
+
+#include "Box3.hpp"
+#include "PackedQuadSurfaces.hpp"
+#include <glm/glm.hpp>
+#include <vector>
+#include <stdint.h>
+
+namespace RadiosityTest
+{
+class Lightmap;
+class LightmapCompactQuadSurface;
+
+/**
+ * The visibility between the patches of two surface tiles.
+ */
+enum class SurfacePairVisibility : uint8_t
+{
+    // Some patch pairs may be occluded, so every pair needs its own ray.
+    Partial = 0,
+
+    // No other surface enters the shaft between them.
+    Visible,
+
+    // A single surface blocks every segment between them.
+    Occluded,
+
+    // No patch of one tile is in front of the other.
+    NotFacing,
+};
+
+/**
+ * Classifies the pairs of surfaces, so that the patch pairs that are fully
+ * visible or fully occluded do not need any ray. The surfaces are split in
+ * square tiles of texels first, since a large surface is rarely fully visible
+ * from another one as a whole. The occluder candidates of a pair are the
+ * quads that enter the shaft between the patches of both tiles. They are
+ * kept for the partial pairs, so their rays only test that short list.
+ */
+class SurfaceVisibility
+{
+public:
+    static constexpr size_t DefaultTileSize = 8;
+
+    // The padding widens the tiles in their plane, for the rays that leave
+    // from any point of the texels instead of their centres.
+    SurfaceVisibility(size_t tileSize = DefaultTileSize, float padding = 0.0f);
+    ~SurfaceVisibility();
+
+    void build(const Lightmap &lightmap);
+
+    size_t getTileCount() const
+    {
+        return tiles.size();
+    }
+
+    uint32_t getPatchTile(size_t patchIndex) const
+    {
+        return patchTiles[patchIndex];
+    }
+
+    SurfacePairVisibility get(size_t firstTile, size_t secondTile) const
+    {
+        return pairs[firstTile*tiles.size() + secondTile];
+    }
+
+    SurfacePairVisibility getPatchPair(size_t firstPatch, size_t secondPatch) const
+    {
+        return get(patchTiles[firstPatch], patchTiles[secondPatch]);
+    }
+
+    // Is the ray between two patches hit by one of the occluder candidates
+    // of their tiles? Only meaningful for the partial pairs.
+    bool isRayOccluded(const Ray &ray, size_t firstPatch, size_t secondPatch) const;
+
+    // The mean length of the candidate lists of the partial pairs.
+    double getMeanCandidateCount() const
+    {
+        return candidateOffsets.size() > 1 ? double(candidateQuads.size()) / (candidateOffsets.size() - 1) : 0.0;
+    }
+
+    // The number of unordered tile pairs of a class.
+    size_t getPairCount(SurfacePairVisibility visibility) const
+    {
+        return pairCounts[size_t(visibility)];
+    }
+
+    // The number of patch pairs in the partial tile pairs, including the ones
+    // that do not face each other.
+    size_t getPartialPatchPairCount() const
+    {
+        return partialPatchPairCount;
+    }
+
+private:
+    // The rectangle around the patches of a tile, in the plane of its
+    // surface.
+    struct SurfaceTile
+    {
+        uint32_t surfaceIndex;
+        glm::vec3 corners[4];
+        glm::vec3 normal;
+        float distance;
+        Box3 bounds;
+    };
+
+    void buildTiles(const Lightmap &lightmap);
+    SurfacePairVisibility classifyPair(const Lightmap &lightmap, size_t first, size_t second,
+        std::vector<uint32_t> &candidates) const;
+    bool isFacing(const SurfaceTile &tile, const SurfaceTile &other) const;
+    bool blocksAllSegments(const LightmapCompactQuadSurface &occluder, const SurfaceTile &first,
+        const SurfaceTile &second) const;
+
+    size_t tileSize;
+    float padding;
+    QuadKernel quadKernel;
+    std::vector<SurfaceTile> tiles;
+    std::vector<uint32_t> tilePatchCounts;
+    std::vector<uint32_t> patchTiles;
+    std::vector<SurfacePairVisibility> pairs;
+    size_t pairCounts[4];
+    size_t partialPatchPairCount;
+
+    // The candidate list of every ordered tile pair, or ~0 for none, and the
+    // lists of quads.
+    // The lists are packed in the same order, so a list is a range of packed
+    // quads.
+    std::vector<uint32_t> pairCandidateLists;
+    std::vector<uint32_t> candidateOffsets;
+    std::vector<uint32_t> candidateQuads;
+    PackedQuadSurfaces packedCandidates;
+};
+
+} // End of namespace RadiosityTest
+
+#endif //RADIOSITY_TEST_SURFACE_VISIBILITY_HPP
@@ -0,0 +1,198 @@
+#include "ThreadPool.hpp"
+#include <algorithm>
+
+namespace RadiosityTest
+{
+
+ThreadPool::ThreadPool(size_t workerCount)
+    : workerCount(workerCount), shuttingDown(false), jobFunction(nullptr), jobCount(0), jobChunkSize(1), jobGeneration(0), activeWorkers(0), jobWorkStealing(false), nextChunk(0)
+{
+    if(this->workerCount == 0)
+        this->workerCount = std::max(1u, std::thread::hardware_concurrency());
+    chunkRanges.reset(new ChunkRange[this->workerCount]);
+
+    // The thread that calls parallelFor is also a worker, with index zero.
+    for(size_t i = 1; i < this->workerCount; ++i)
+    {
+        threads.push_back(std::thread([=]{
+            workerThreadMain(i);
+        }));
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::unique_lock<std::mutex> l(mutex);
+        shuttingDown = true;
+    }
+    jobReadyCondition.notify_all();
+
+    for(auto &thread : threads)
+        thread.join();
+}
+
+void ThreadPool::parallelFor(size_t count, size_t chunkSize, const RangeFunction &function)
+{
+    runJob(count, chunkSize, false, function);
+}
+
+void ThreadPool::parallelForWorkStealing(size_t count, size_t chunkSize, const RangeFunction &function)
+{
+    runJob(count, chunkSize, true, function);
+}
+
+void ThreadPool::runJob(size_t count, size_t chunkSize, bool workStealing, const RangeFunction &function)
+{
+    if(count == 0)
+        return;
+
+    chunkSize = std::max(chunkSize, size_t(1));
+    if(threads.empty() || count <= chunkSize)
+    {
+        function(0, count);
+        return;
+    }
+
+    {
+        std::unique_lock<std::mutex> l(mutex);
+        jobFunction = &function;
+        jobCount = count;
+        jobChunkSize = chunkSize;
+        jobWorkStealing = workStealing;
+        nextChunk = 0;
+
+        // Split the chunks evenly, the stealing balances them afterwards.
+        if(workStealing)
+        {
+            auto chunkCount = (count + chunkSize - 1) / chunkSize;
+            for(size_t i = 0; i < workerCount; ++i)
+            {
+                auto begin = chunkCount*i / workerCount;
+                auto end = chunkCount*(i + 1) / workerCount;
+                chunkRanges[i].range = packChunkRange(begin, end);
+            }
+        }
+
+        activeWorkers = threads.size();
+        ++jobGeneration;
+    }
+    jobReadyCondition.notify_all();
+
+    if(workStealing)
+        processStolenChunks(0);
+    else
+        processChunks();
+
+    std::unique_lock<std::mutex> l(mutex);
+    while(activeWorkers > 0)
+        jobFinishedCondition.wait(l);
+    jobFunction = nullptr;
+}
+
+void ThreadPool::processChunks()
+{
+    for(;;)
+    {
+        auto begin = nextChunk.fetch_add(jobChunkSize);
+        if(begin >= jobCount)
+            break;
+
+        auto end = std::min(begin + jobChunkSize, jobCount);
+        (*jobFunction)(begin, end);
+    }
+}
+
+void ThreadPool::processStolenChunks(size_t workerIndex)
+{
+    uint32_t chunk;
+    for(;;)
+    {
+        while(popChunk(workerIndex, chunk))
+        {
+            auto begin = chunk*jobChunkSize;
+            auto end = std::min(begin + jobChunkSize, jobCount);
+            (*jobFunction)(begin, end);
+        }
+
+        if(!stealChunks(workerIndex))
+            break;
+    }
+}
+
+bool ThreadPool::popChunk(size_t workerIndex, uint32_t &chunk)
+{
+    // The owner takes the chunks from the front.
+    auto &range = chunkRanges[workerIndex].range;
+    auto current = range.load();
+    for(;;)
+    {
+        uint32_t begin = current;
+        uint32_t end = current >> 32;
+        if(begin >= end)
+            return false;
+
+        if(range.compare_exchange_weak(current, packChunkRange(begin + 1, end)))
+        {
+            chunk = begin;
+            return true;
+        }
+    }
+}
+
+bool ThreadPool::stealChunks(size_t workerIndex)
+{
+    // The thieves take half of the chunks from the back.
+    for(size_t offset = 1; offset < workerCount; ++offset)
+    {
+        auto &victimRange = chunkRanges[(workerIndex + offset) % workerCount].range;
+        auto current = victimRange.load();
+        for(;;)
+        {
+            uint32_t begin = current;
+            uint32_t end = current >> 32;
+            if(begin >= end)
+                break;
+
+            auto middle = end - (end - begin + 1) / 2;
+            if(victimRange.compare_exchange_weak(current, packChunkRange(begin, middle)))
+            {
+                // Only the owner adds chunks to its own empty range.
+                chunkRanges[workerIndex].range = packChunkRange(middle, end);
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+void ThreadPool::workerThreadMain(size_t workerIndex)
+{
+    size_t lastGeneration = 0;
+    for(;;)
+    {
+        {
+            std::unique_lock<std::mutex> l(mutex);
+            while(!shuttingDown && jobGeneration == lastGeneration)
+                jobReadyCondition.wait(l);
+
+            if(shuttingDown)
+                return;
+            lastGeneration = jobGeneration;
+        }
+
+        if(jobWorkStealing)
+            processStolenChunks(workerIndex);
+        else
+            processChunks();
+
+        {
+            std::unique_lock<std::mutex> l(mutex);
+            if(--activeWorkers == 0)
+                jobFinishedCondition.notify_one();
+        }
+    }
+}
+
+} // End of namespace RadiosityTest
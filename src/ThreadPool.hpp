@@ -0,0 +1,92 @@
+#ifndef RADIOSITY_TEST_THREAD_POOL_HPP
+#define RADIOSITY_TEST_THREAD_POOL_HPP
+
+#include "Object.hpp"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <stdint.h>
+
+namespace RadiosityTest
+{
+DECLARE_CLASS(ThreadPool);
+
+/**
+ * A pool of worker threads for data parallel loops.
+ */
+class ThreadPool : public Object
+{
+public:
+    typedef std::function<void (size_t begin, size_t end)> RangeFunction;
+
+    // A worker count of zero uses one worker per hardware thread.
+    ThreadPool(size_t workerCount = 0);
+    ~ThreadPool();
+
+    size_t getWorkerCount() const
+    {
+        return workerCount;
+    }
+
+    /**
+     * Calls the function over chunks of the [0, count) range. The calling
+     * thread also takes part in the work, and this returns once every
+     * chunk has been processed.
+     */
+    void parallelFor(size_t count, size_t chunkSize, const RangeFunction &function);
+
+    /**
+     * Like parallelFor, but every thread starts with its own contiguous
+     * range of chunks and steals half of the remaining chunks of another
+     * thread once it runs out. This suits the loops with very uneven chunk
+     * costs, and keeps the chunks of a thread close to each other.
+     */
+    void parallelForWorkStealing(size_t count, size_t chunkSize, const RangeFunction &function);
+
+private:
+    // The remaining chunks of a thread, packed as [begin, end) in one word
+    // so that the owner and the thieves update it with a single CAS. It is
+    // padded to a cache line against false sharing.
+    struct ChunkRange
+    {
+        std::atomic<uint64_t> range;
+        char padding[64 - sizeof(std::atomic<uint64_t>)];
+    };
+
+    static uint64_t packChunkRange(uint32_t begin, uint32_t end)
+    {
+        return (uint64_t(end) << 32) | begin;
+    }
+
+    void runJob(size_t count, size_t chunkSize, bool workStealing, const RangeFunction &function);
+    void workerThreadMain(size_t workerIndex);
+    void processChunks();
+    void processStolenChunks(size_t workerIndex);
+    bool popChunk(size_t workerIndex, uint32_t &chunk);
+    bool stealChunks(size_t workerIndex);
+
+    size_t workerCount;
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable jobReadyCondition;
+    std::condition_variable jobFinishedCondition;
+    bool shuttingDown;
+
+    // The current job.
+    const RangeFunction *jobFunction;
+    size_t jobCount;
+    size_t jobChunkSize;
+    size_t jobGeneration;
+    size_t activeWorkers;
+    bool jobWorkStealing;
+    std::atomic<size_t> nextChunk;
+    std::unique_ptr<ChunkRange[]> chunkRanges;
+};
+
+} // End of namespace RadiosityTest
+
+#endif //RADIOSITY_TEST_THREAD_POOL_HPP
@@ -0,0 +1,143 @@
+#ifndef RADIOSITY_TEST_VISIBILITY_MATRIX_HPP
+#define RADIOSITY_TEST_VISIBILITY_MATRIX_HPP
+
+#include <vector>
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace RadiosityTest
+{
+
+inline size_t countTrailingZeros(uint64_t value)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, value);
+    return index;
+#else
+    return __builtin_ctzll(value);
+#endif
+}
+
+/**
+ * The visibility of the patch pairs, as a symmetric bit matrix. Only the
+ * upper triangle is kept, in square blocks of bits that are allocated on
+ * the first visible pair, so the rows and columns of patches that never see
+ * each other take no memory. A row of a block is a single word.
+ */
+class VisibilityMatrix
+{
+public:
+    static constexpr size_t BlockSize = 64;
+
+    VisibilityMatrix()
+        : patchCount(0), blockCount(0), visibleCount(0) {}
+
+    void reset(size_t newPatchCount)
+    {
+        patchCount = newPatchCount;
+        blockCount = (patchCount + BlockSize - 1) / BlockSize;
+        blockIndices.assign(blockCount*blockCount, uint32_t(NoBlock));
+        blockRows.clear();
+        visibleCount = 0;
+    }
+
+    size_t getPatchCount() const
+    {
+        return patchCount;
+    }
+
+    // The number of visible unordered pairs.
+    size_t getVisibleCount() const
+    {
+        return visibleCount;
+    }
+
+    size_t getMemorySize() const
+    {
+        return blockIndices.size()*sizeof(uint32_t) + blockRows.size()*sizeof(uint64_t);
+    }
+
+    bool get(size_t first, size_t second) const
+    {
+        orderPair(first, second);
+        auto block = blockIndices[(first / BlockSize)*blockCount + second / BlockSize];
+        if(block == NoBlock)
+            return false;
+
+        return (blockRows[block*BlockSize + first % BlockSize] >> (second % BlockSize)) & 1;
+    }
+
+    void set(size_t first, size_t second, bool visible)
+    {
+        assert(first != second);
+        orderPair(first, second);
+        auto &block = blockIndices[(first / BlockSize)*blockCount + second / BlockSize];
+        if(block == NoBlock)
+        {
+            if(!visible)
+                return;
+
+            block = uint32_t(blockRows.size() / BlockSize);
+            blockRows.resize(blockRows.size() + BlockSize, 0);
+        }
+
+        auto &row = blockRows[block*BlockSize + first % BlockSize];
+        auto bit = uint64_t(1) << (second % BlockSize);
+        if(((row & bit) != 0) == visible)
+            return;
+
+        row ^= bit;
+        visibleCount += visible ? 1 : -1;
+    }
+
+    // Calls function(column) for the visible pairs of a row with a larger
+    // column, in column order.
+    template<typename FT>
+    void forEachVisibleAfter(size_t row, const FT &function) const
+    {
+        auto blockRow = row / BlockSize;
+        for(auto blockColumn = blockRow; blockColumn < blockCount; ++blockColumn)
+        {
+            auto block = blockIndices[blockRow*blockCount + blockColumn];
+            if(block == NoBlock)
+                continue;
+
+            auto bits = blockRows[block*BlockSize + row % BlockSize];
+            while(bits != 0)
+            {
+                auto bit = countTrailingZeros(bits);
+                bits &= bits - 1;
+                function(blockColumn*BlockSize + bit);
+            }
+        }
+    }
+
+private:
+    static constexpr uint32_t NoBlock = ~uint32_t(0);
+
+    static void orderPair(size_t &first, size_t &second)
+    {
+        if(first > second)
+        {
+            auto temporary = first;
+            first = second;
+            second = temporary;
+        }
+    }
+
+    size_t patchCount;
+    size_t blockCount;
+    size_t visibleCount;
+    std::vector<uint32_t> blockIndices;
+    std::vector<uint64_t> blockRows;
+};
+
+} // End of namespace RadiosityTest
+
+#endif //RADIOSITY_TEST_VISIBILITY_MATRIX_HPP